@@ -0,0 +1,387 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_arena.h"
+#ifdef LIBCPEG_TESTING
+#include "cqc.h"
+#endif
+
+#ifdef LIBCPEG_TESTING
+
+typedef cpeg_term *cpeg_term_ptr;
+
+static unsigned test_arena_object_count;
+
+static void *test_arena_type_init(void *v)
+{
+    test_arena_object_count++;
+    return v;
+}
+
+static void test_arena_type_destroy(__attribute__((unused)) void *v)
+{
+    assert(test_arena_object_count > 0);
+    test_arena_object_count--;
+}
+
+static const cpeg_term_type test_arena_type = {
+    .id = "arena",
+    .init = test_arena_type_init,
+    .destroy = test_arena_type_destroy
+};
+
+static void
+cqc_generate_cpeg_term_ptr(cpeg_term_ptr *var, size_t scale)
+{
+    unsigned n_children = random() % scale;
+    cpeg_term_ptr children[n_children + 1];
+    unsigned i;
+
+    for (i = 0; i < n_children; i++)
+        cqc_generate_cpeg_term_ptr(&children[i], scale / n_children);
+
+    *var = cpeg_term_new(&test_arena_type, (void *)(uintptr_t)random(),
+                         n_children, children);
+}
+
+#define cqc_release_cpeg_term_ptr(_var) cpeg_term_free(_var)
+
+#define cqc_typefmt_cpeg_term_ptr "%s:%p[%p,%u]"
+#define cqc_typeargs_cpeg_term_ptr(_t) \
+    ((_t) ? (_t)->type->id : "???"),   \
+        (_t),                          \
+        ((_t) ? (_t)->value : "???"),  \
+        ((_t) ? (_t)->n_children : 0)
+
+#define cqc_equal_cpeg_term_ptr(_v1, _v2) ((_v1) == (_v2))
+
+#endif
+
+#define ARENA_DEFAULT_CHUNK_SIZE (256 * 1024)
+#define ARENA_ALIGNMENT (sizeof(void *))
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} arena_chunk;
+
+/*
+ * Only the terms that need some work on release are registered here:
+ * those with a destructor or holding references to refcounted terms.
+ */
+typedef struct arena_finalizer {
+    cpeg_term *term;
+    struct arena_finalizer *next;
+} arena_finalizer;
+
+struct cpeg_term_arena {
+    size_t chunk_size;
+    arena_chunk *chunks;
+    arena_finalizer *finalizers;
+};
+
+static arena_chunk *
+arena_new_chunk(size_t size)
+{
+    arena_chunk *chunk = cpeg_mem_alloc(sizeof(*chunk) + size);
+
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void *
+arena_alloc(cpeg_term_arena *arena, size_t size)
+{
+    arena_chunk *chunk = arena->chunks;
+    void *obj;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        if (size > arena->chunk_size / 4)
+        {
+            /* Large objects get a chunk of their own, so that
+             * the current chunk is not wasted.
+             */
+            chunk = arena_new_chunk(size);
+            if (arena->chunks == NULL)
+            {
+                chunk->next = NULL;
+                arena->chunks = chunk;
+            }
+            else
+            {
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+            }
+        }
+        else
+        {
+            chunk = arena_new_chunk(arena->chunk_size);
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    obj = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    return obj;
+}
+
+cpeg_term_arena *
+cpeg_term_arena_create(size_t chunk_size)
+{
+    cpeg_term_arena *arena = cpeg_mem_alloc(sizeof(*arena));
+
+    arena->chunk_size = chunk_size == 0 ? ARENA_DEFAULT_CHUNK_SIZE : chunk_size;
+    arena->chunks = NULL;
+    arena->finalizers = NULL;
+    return arena;
+}
+
+static void
+arena_finalize(cpeg_term_arena *arena)
+{
+    arena_finalizer *fin;
+
+    /* Finalizers are kept in the reverse order of construction,
+     * so parents are always finalized before their children.
+     */
+    for (fin = arena->finalizers; fin != NULL; fin = fin->next)
+    {
+        cpeg_term *term = fin->term;
+        unsigned i;
+
+        if (term->type->destroy)
+            term->type->destroy(term->value);
+        for (i = 0; i < term->n_children; i++)
+            cpeg_term_free(term->children[i]);
+    }
+    arena->finalizers = NULL;
+}
+
+void
+cpeg_term_arena_reset(cpeg_term_arena *arena)
+{
+    arena_chunk *chunk;
+    arena_chunk *next;
+    arena_chunk *kept = NULL;
+
+    arena_finalize(arena);
+    for (chunk = arena->chunks; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        if (kept == NULL && chunk->size == arena->chunk_size)
+        {
+            kept = chunk;
+            kept->used = 0;
+            kept->next = NULL;
+        }
+        else
+        {
+            cpeg_mem_free(chunk);
+        }
+    }
+    arena->chunks = kept;
+}
+
+void
+cpeg_term_arena_destroy(cpeg_term_arena *arena)
+{
+    if (arena == NULL)
+        return;
+
+    cpeg_term_arena_reset(arena);
+    cpeg_mem_free(arena->chunks);
+    cpeg_mem_free(arena);
+}
+
+static cpeg_term *
+arena_term(cpeg_term_arena *arena, const cpeg_term_type *type,
+           void *value, unsigned n_children, cpeg_term *children[],
+           bool share)
+{
+    cpeg_term *term = arena_alloc(arena, sizeof(*term) +
+                                  n_children *
+                                  sizeof(*term->inline_children));
+    bool needs_finalizer = type->destroy != NULL;
+    unsigned i;
+
+    term->type = type;
+    term->refcnt = UINT_MAX;
+    term->value = value;
+    term->n_children = n_children;
+    term->children = n_children == 0 ? NULL : term->inline_children;
+    term->capacity = n_children;
+    term->flags = 0;
+    for (i = 0; i < n_children; i++)
+    {
+        term->children[i] = share ? cpeg_term_use(children[i]) : children[i];
+        if (children[i] != NULL && children[i]->refcnt != UINT_MAX)
+            needs_finalizer = true;
+    }
+    cpeg_term_refresh(term);
+
+    if (needs_finalizer)
+    {
+        arena_finalizer *fin = arena_alloc(arena, sizeof(*fin));
+
+        fin->term = term;
+        fin->next = arena->finalizers;
+        arena->finalizers = fin;
+    }
+
+    return term;
+}
+
+cpeg_term *
+cpeg_term_new_in(cpeg_term_arena *arena, const cpeg_term_type *type,
+                 void *value, unsigned n_children, cpeg_term *children[])
+{
+    return arena_term(arena, type, type->init ? type->init(value) : value,
+                      n_children, children, false);
+}
+
+cpeg_term *
+cpeg_term_fromstr_in(cpeg_term_arena *arena, const cpeg_term_type *type,
+                     const char *value, unsigned n_children,
+                     cpeg_term *children[])
+{
+    assert(type->fromstr != NULL);
+    return arena_term(arena, type, type->fromstr(value),
+                      n_children, children, false);
+}
+
+cpeg_term *
+cpeg_term_copy_in(cpeg_term_arena *arena, const cpeg_term *term)
+{
+    if (term == NULL)
+        return NULL;
+
+    return arena_term(arena, term->type,
+                      term->type->init ?
+                      term->type->init(term->value) :
+                      term->value,
+                      term->n_children, term->children, true);
+}
+
+#ifdef LIBCPEG_TESTING
+CQC_TESTCASE(arena_terms_immortal,
+             "Arena terms are not refcounted")
+{
+    cqc_forall(uintptr_t, v)
+    {
+        cqc_expect
+        {
+            cpeg_term_arena *arena = cpeg_term_arena_create(0);
+            cpeg_term *t = cpeg_term_new_in(arena, &test_arena_type,
+                                            (void *)v, 0, NULL);
+
+            cqc_assert_eq(unsigned, t->refcnt, UINT_MAX);
+            cpeg_term_use(t);
+            cpeg_term_free(t);
+            cqc_assert_eq(unsigned, t->refcnt, UINT_MAX);
+            cqc_assert_eq(cqc_opaque, t->value, (void *)v);
+            cpeg_term_arena_destroy(arena);
+        }
+    }
+}
+
+CQC_TESTCASE(arena_copy_shares,
+             "Arena copies share children until the arena is reset")
+{
+    cqc_forall(cpeg_term_ptr, t)
+    {
+        cqc_expect
+        {
+            cpeg_term_arena *arena = cpeg_term_arena_create(0);
+            cpeg_term *t1 = cpeg_term_copy_in(arena, t);
+            unsigned i;
+
+            cqc_assert_eq(cqc_opaque, t1->value, t->value);
+            cqc_assert_eqn(cpeg_term_ptr, t->n_children, t->children,
+                           t1->n_children, t1->children);
+            for (i = 0; i < t->n_children; i++)
+                cqc_assert_eq(unsigned, t->children[i]->refcnt, 2);
+            cpeg_term_arena_reset(arena);
+            for (i = 0; i < t->n_children; i++)
+                cqc_assert_eq(unsigned, t->children[i]->refcnt, 1);
+            cpeg_term_arena_destroy(arena);
+        }
+    }
+}
+
+CQC_TESTCASE(arena_destructors_called,
+             "Arena reset destroys every arena term value exactly once")
+{
+    cqc_forall(uint16_t, n)
+    {
+        cqc_expect
+        {
+            unsigned saved_cnt = test_arena_object_count;
+            cpeg_term_arena *arena = cpeg_term_arena_create(256);
+            cpeg_term *prev = NULL;
+            unsigned i;
+
+            for (i = 0; i < n; i++)
+            {
+                prev = cpeg_term_new_in(arena, &test_arena_type, NULL,
+                                        prev == NULL ? 0 : 1, &prev);
+            }
+            cqc_assert_eq(unsigned, test_arena_object_count,
+                          saved_cnt + n);
+            cpeg_term_arena_reset(arena);
+            cqc_assert_eq(unsigned, test_arena_object_count, saved_cnt);
+            cpeg_term_arena_destroy(arena);
+        }
+    }
+}
+
+static void *
+test_arena_size(const cpeg_term *term, void *children[],
+                __attribute__((unused)) void *data)
+{
+    uintptr_t size = 1;
+    unsigned i;
+
+    for (i = 0; i < term->n_children; i++)
+        size += (uintptr_t)children[i];
+    return (void *)size;
+}
+
+CQC_TESTCASE(arena_memo_below,
+             "Edits below an arena term are seen by memoized reduces "
+             "above it")
+{
+    cqc_once
+    {
+        cqc_expect
+        {
+            cpeg_term_arena *arena = cpeg_term_arena_create(0);
+            cpeg_term_memo *memo = cpeg_term_memo_create(test_arena_size,
+                                                         NULL, NULL);
+            cpeg_term *c = cpeg_term_newl(&test_arena_type, NULL, NULL);
+            cpeg_term *s = cpeg_term_new_in(arena, &test_arena_type, NULL,
+                                            1, &c);
+            cpeg_term *p = cpeg_term_newl(&test_arena_type, NULL, s, NULL);
+
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, p), 3);
+            cpeg_term_graft(c, UINT_MAX,
+                            cpeg_term_newl(&test_arena_type, NULL, NULL));
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, p), 4);
+            cpeg_term_memo_destroy(memo);
+            cpeg_term_free(p);
+            cpeg_term_arena_destroy(arena);
+        }
+    }
+}
+#endif
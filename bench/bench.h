@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * A tiny harness shared by the benchmarks. Every benchmark runs
+ * in a child process of its own, so that the reported peak RSS is
+ * its own. The results are printed one per line as tab-separated
+ * `key=value` fields following the name of the benchmark:
+ *
+ *     name  [params...]  ns_per_op=...  allocs_per_op=...  peak_rss_kb=...
+ *
+ * Allocations are counted by wrapping the libc allocator at link time
+ * (see BENCH_LDFLAGS in the Makefile).
+ */
+
+#ifndef BENCH_H
+#define BENCH_H 1
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_ROUNDS 5
+
+static unsigned long bench_n_allocs;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t n, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+extern void *__real_aligned_alloc(size_t align, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    __atomic_fetch_add(&bench_n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&bench_n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&bench_n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void *
+__wrap_aligned_alloc(size_t align, size_t size)
+{
+    __atomic_fetch_add(&bench_n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_aligned_alloc(align, size);
+}
+
+/* The best of several rounds is reported */
+typedef struct bench_sample {
+    struct timespec start;
+    unsigned long start_allocs;
+    double best_ns;
+    unsigned long allocs;
+    unsigned rounds;
+} bench_sample;
+
+static inline void
+bench_begin(bench_sample *sample)
+{
+    sample->start_allocs = __atomic_load_n(&bench_n_allocs, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &sample->start);
+}
+
+static inline void
+bench_end(bench_sample *sample)
+{
+    struct timespec end;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (end.tv_sec - sample->start.tv_sec) * 1e9 +
+        (end.tv_nsec - sample->start.tv_nsec);
+    if (sample->rounds == 0 || ns < sample->best_ns)
+    {
+        sample->best_ns = ns;
+        sample->allocs = __atomic_load_n(&bench_n_allocs, __ATOMIC_RELAXED) -
+            sample->start_allocs;
+    }
+    sample->rounds++;
+}
+
+static void
+bench_report(const bench_sample *sample, const char *name,
+             unsigned long n_ops, const char *params, ...)
+{
+    struct rusage usage;
+    va_list args;
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%s", name);
+    if (params != NULL)
+    {
+        putchar('\t');
+        va_start(args, params);
+        vprintf(params, args);
+        va_end(args);
+    }
+    printf("\tns_per_op=%.2f\tallocs_per_op=%.3f\tpeak_rss_kb=%ld\n",
+           sample->best_ns / n_ops, (double)sample->allocs / n_ops,
+           usage.ru_maxrss);
+    fflush(stdout);
+}
+
+typedef struct bench_case {
+    const char *name;
+    void (*run)(const char *name);
+} bench_case;
+
+/*
+ * Runs the benchmarks whose names start with any of the arguments,
+ * or all of them if there are no arguments.
+ */
+static int
+bench_main(int argc, char *argv[], const bench_case cases[], size_t n_cases)
+{
+    size_t i;
+    int status = 0;
+
+    for (i = 0; i < n_cases; i++)
+    {
+        bool selected = argc <= 1;
+        int j;
+        pid_t pid;
+        int child_status;
+
+        for (j = 1; j < argc && !selected; j++)
+            selected = strncmp(cases[i].name, argv[j], strlen(argv[j])) == 0;
+        if (!selected)
+            continue;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if (pid == 0)
+        {
+            cases[i].run(cases[i].name);
+            exit(EXIT_SUCCESS);
+        }
+        if (waitpid(pid, &child_status, 0) < 0 ||
+            !WIFEXITED(child_status) ||
+            WEXITSTATUS(child_status) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "%s: failed\n", cases[i].name);
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,893 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "libcpeg.h"
+#include "bench.h"
+
+/*
+ * Microbenchmarks of the core term and attribute operations.
+ * Run as `bench/micro [prefix...]`.
+ */
+
+#define TREE_FANOUT 4
+#define TREE_DEPTH 8
+#define CHURN_OPS 1000000
+#define WIDE_CHILDREN 4096
+
+static const cpeg_term_type bench_type = {
+    .id = "bench"
+};
+
+static cpeg_term *
+build_tree(unsigned depth, unsigned long *count)
+{
+    cpeg_term *children[TREE_FANOUT];
+    unsigned i;
+
+    (*count)++;
+    if (depth == 0)
+        return cpeg_term_new(&bench_type, NULL, 0, NULL);
+
+    for (i = 0; i < TREE_FANOUT; i++)
+        children[i] = build_tree(depth - 1, count);
+    return cpeg_term_new(&bench_type, NULL, TREE_FANOUT, children);
+}
+
+static cpeg_term *
+new_leaf(void)
+{
+    return cpeg_term_new(&bench_type, NULL, 0, NULL);
+}
+
+/* A term is freed right after allocation, so the free list is always hot */
+static void
+bench_churn_hit(const char *name)
+{
+    bench_sample sample = {0};
+    unsigned r;
+    unsigned long i;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bench_begin(&sample);
+        for (i = 0; i < CHURN_OPS; i++)
+            cpeg_term_free(new_leaf());
+        bench_end(&sample);
+    }
+    bench_report(&sample, name, CHURN_OPS, NULL);
+}
+
+/* Many terms are alive at once, so most of them miss the free list */
+static void
+bench_churn_miss(const char *name)
+{
+    cpeg_term **terms = malloc(CHURN_OPS * sizeof(*terms));
+    bench_sample sample = {0};
+    unsigned r;
+    unsigned long i;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bench_begin(&sample);
+        for (i = 0; i < CHURN_OPS; i++)
+            terms[i] = new_leaf();
+        for (i = 0; i < CHURN_OPS; i++)
+            cpeg_term_free(terms[i]);
+        bench_end(&sample);
+    }
+    bench_report(&sample, name, CHURN_OPS, NULL);
+    free(terms);
+}
+
+static void
+bench_deep_copy(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term *copy;
+
+        bench_begin(&sample);
+        copy = cpeg_term_deep_copy(tree);
+        bench_end(&sample);
+        cpeg_term_free(copy);
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_free(tree);
+}
+
+static const cpeg_term_codec bench_codecs[] = {{.type = &bench_type}};
+
+static void
+bench_serial_write(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    FILE *f = tmpfile();
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term_writer *writer;
+
+        lseek(fileno(f), 0, SEEK_SET);
+        bench_begin(&sample);
+        writer = cpeg_term_writer_open(fileno(f), 1, bench_codecs);
+        cpeg_term_write(writer, tree);
+        if (!cpeg_term_writer_close(writer))
+            abort();
+        bench_end(&sample);
+    }
+    bench_report(&sample, name, count, "nodes=%lu bytes=%ld", count,
+                 (long)lseek(fileno(f), 0, SEEK_CUR));
+    fclose(f);
+    cpeg_term_free(tree);
+}
+
+/* Compare with deep_copy, which allocates the same terms from memory */
+static void
+bench_serial_read(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    FILE *f = tmpfile();
+    cpeg_term_writer *writer = cpeg_term_writer_open(fileno(f), 1,
+                                                     bench_codecs);
+    bench_sample sample = {0};
+    unsigned r;
+
+    cpeg_term_write(writer, tree);
+    if (!cpeg_term_writer_close(writer))
+        abort();
+    cpeg_term_free(tree);
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term_reader *reader;
+        cpeg_term *copy;
+
+        lseek(fileno(f), 0, SEEK_SET);
+        bench_begin(&sample);
+        reader = cpeg_term_reader_open(fileno(f), 1, bench_codecs);
+        copy = cpeg_term_read(reader);
+        cpeg_term_reader_close(reader);
+        bench_end(&sample);
+        if (copy == NULL)
+            abort();
+        cpeg_term_free(copy);
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    fclose(f);
+}
+
+/* Loading does not depend on the size of a pristine image */
+static void
+bench_image_load(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    FILE *f = tmpfile();
+    bench_sample sample = {0};
+    bool pristine = true;
+    unsigned r;
+
+    if (!cpeg_term_image_write(fileno(f), tree, 0, 1, bench_codecs))
+        abort();
+    cpeg_term_free(tree);
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term_image *image;
+
+        bench_begin(&sample);
+        image = cpeg_term_image_load(fileno(f), 1, bench_codecs);
+        bench_end(&sample);
+        if (image == NULL)
+            abort();
+        pristine = pristine && cpeg_term_image_pristine(image);
+        cpeg_term_image_unload(image);
+    }
+    bench_report(&sample, name, count, "nodes=%lu pristine=%d", count,
+                 (int)pristine);
+    fclose(f);
+}
+
+#define ZIPPER_EDITS 100000
+
+/* Each edit makes a new version of the tree, replacing a random leaf */
+static void
+bench_zipper_edit(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    unsigned r;
+    unsigned long i;
+    unsigned d;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bench_begin(&sample);
+        for (i = 0; i < ZIPPER_EDITS; i++)
+        {
+            cpeg_term_zipper zipper;
+            cpeg_term *version;
+
+            cpeg_term_zipper_init(&zipper, tree);
+            for (d = 0; d < TREE_DEPTH; d++)
+                cpeg_term_zipper_down(&zipper, (unsigned)i % TREE_FANOUT);
+            cpeg_term_zipper_replace(&zipper, new_leaf());
+            version = cpeg_term_zipper_root(&zipper);
+            cpeg_term_zipper_fini(&zipper);
+            cpeg_term_free(version);
+        }
+        bench_end(&sample);
+    }
+    bench_report(&sample, name, ZIPPER_EDITS, "depth=%u", TREE_DEPTH);
+    cpeg_term_free(tree);
+}
+
+static int
+count_node(__attribute__((unused)) const cpeg_term *term, void *data)
+{
+    (*(unsigned long *)data)++;
+    return 0;
+}
+
+static void
+bench_traverse(const char *name, bool preorder)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        unsigned long visited = 0;
+
+        bench_begin(&sample);
+        if (preorder)
+            cpeg_term_traverse_preorder(count_node, tree, &visited);
+        else
+            cpeg_term_traverse_postorder(count_node, tree, &visited);
+        bench_end(&sample);
+        if (visited != count)
+            abort();
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_free(tree);
+}
+
+static void
+bench_preorder(const char *name)
+{
+    bench_traverse(name, true);
+}
+
+static void
+bench_postorder(const char *name)
+{
+    bench_traverse(name, false);
+}
+
+static void
+bench_flatten(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term_flat *flat;
+
+        bench_begin(&sample);
+        flat = cpeg_term_flatten(tree);
+        bench_end(&sample);
+        cpeg_term_flat_free(flat);
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_free(tree);
+}
+
+static int
+count_flat(__attribute__((unused)) const cpeg_term_flat *flat,
+           __attribute__((unused)) uint32_t i, void *data)
+{
+    (*(unsigned long *)data)++;
+    return 0;
+}
+
+/* Compare with preorder over the same tree */
+static void
+bench_flat_preorder(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    cpeg_term_flat *flat = cpeg_term_flatten(tree);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        unsigned long visited = 0;
+
+        bench_begin(&sample);
+        cpeg_term_flat_traverse(count_flat, flat, 0, &visited);
+        bench_end(&sample);
+        if (visited != count)
+            abort();
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_flat_free(flat);
+    cpeg_term_free(tree);
+}
+
+static const cpeg_term_type rare_type = {
+    .id = "rare"
+};
+
+/* The only term of the type searched for is the last one */
+static void
+bench_flat_find(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    cpeg_term_flat *flat;
+    bench_sample sample = {0};
+    unsigned r;
+
+    cpeg_term_graft(tree, UINT_MAX, cpeg_term_new(&rare_type, NULL, 0, NULL));
+    flat = cpeg_term_flatten(tree);
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        uint32_t i;
+
+        bench_begin(&sample);
+        i = cpeg_term_flat_find(flat, &rare_type, 0);
+        bench_end(&sample);
+        if (i != count)
+            abort();
+    }
+    bench_report(&sample, name, count, "nodes=%lu kernels=%s", count,
+                 cpeg_term_flat_kernels());
+    cpeg_term_flat_free(flat);
+    cpeg_term_free(tree);
+}
+
+static void
+bench_isomorphic(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree1 = build_tree(TREE_DEPTH, &count);
+    cpeg_term *tree2 = cpeg_term_deep_copy(tree1);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bool same;
+
+        bench_begin(&sample);
+        same = cpeg_term_isomorphic(tree1, tree2);
+        bench_end(&sample);
+        if (!same)
+            abort();
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_free(tree1);
+    cpeg_term_free(tree2);
+}
+
+static void
+bench_flat_isomorphic(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree1 = build_tree(TREE_DEPTH, &count);
+    cpeg_term *tree2 = cpeg_term_deep_copy(tree1);
+    cpeg_term_flat *flat1 = cpeg_term_flatten(tree1);
+    cpeg_term_flat *flat2 = cpeg_term_flatten(tree2);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bool same;
+
+        bench_begin(&sample);
+        same = cpeg_term_flat_isomorphic(flat1, 0, flat2, 0);
+        bench_end(&sample);
+        if (!same)
+            abort();
+    }
+    bench_report(&sample, name, count, "nodes=%lu kernels=%s", count,
+                 cpeg_term_flat_kernels());
+    cpeg_term_flat_free(flat1);
+    cpeg_term_flat_free(flat2);
+    cpeg_term_free(tree1);
+    cpeg_term_free(tree2);
+}
+
+static void
+bench_flat_shape_hash(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    cpeg_term_flat *flat = cpeg_term_flatten(tree);
+    bench_sample sample = {0};
+    uint32_t first = cpeg_term_flat_shape_hash(flat, 0);
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        uint32_t hash;
+
+        bench_begin(&sample);
+        hash = cpeg_term_flat_shape_hash(flat, 0);
+        bench_end(&sample);
+        if (hash != first)
+            abort();
+    }
+    bench_report(&sample, name, count, "nodes=%lu kernels=%s", count,
+                 cpeg_term_flat_kernels());
+    cpeg_term_flat_free(flat);
+    cpeg_term_free(tree);
+}
+
+static void
+bench_archive(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    size_t memory = 0;
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term_archive *archive;
+
+        bench_begin(&sample);
+        archive = cpeg_term_archive_create(tree);
+        bench_end(&sample);
+        memory = cpeg_term_archive_memory(archive);
+        cpeg_term_archive_destroy(archive);
+    }
+    bench_report(&sample, name, count, "nodes=%lu bits/node=%.2f", count,
+                 (double)memory * 8 / (double)count);
+    cpeg_term_free(tree);
+}
+
+/* Visits all archived terms through first children and next siblings */
+static void
+bench_archive_preorder(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    cpeg_term_archive *archive = cpeg_term_archive_create(tree);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        unsigned long visited = 0;
+        size_t term = 0;
+
+        bench_begin(&sample);
+        while (term != CPEG_ARCHIVE_NONE)
+        {
+            size_t next = cpeg_term_archive_first_child(archive, term);
+
+            visited++;
+            while (next == CPEG_ARCHIVE_NONE && term != CPEG_ARCHIVE_NONE)
+            {
+                next = cpeg_term_archive_next_sibling(archive, term);
+                if (next == CPEG_ARCHIVE_NONE)
+                    term = cpeg_term_archive_parent(archive, term);
+            }
+            term = next;
+        }
+        bench_end(&sample);
+        if (visited != count)
+            abort();
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_archive_destroy(archive);
+    cpeg_term_free(tree);
+}
+
+static cpeg_term *
+keep_node(__attribute__((unused)) const cpeg_term *term,
+          __attribute__((unused)) void *data)
+{
+    return NULL;
+}
+
+static void
+bench_map(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term *mapped;
+
+        bench_begin(&sample);
+        mapped = cpeg_term_map(keep_node, tree, NULL);
+        bench_end(&sample);
+        cpeg_term_free(mapped);
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_free(tree);
+}
+
+static cpeg_term *
+replace_node(const cpeg_term *term, void *data)
+{
+    if (term != data)
+        return NULL;
+    return new_leaf();
+}
+
+static void
+bench_rewrite(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    cpeg_term *target = cpeg_term_leftmost(tree);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term *rewritten;
+
+        bench_begin(&sample);
+        rewritten = cpeg_term_rewrite(replace_node, tree, target);
+        bench_end(&sample);
+        cpeg_term_free(rewritten);
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_free(tree);
+}
+
+static void *
+sum_nodes(const cpeg_term *term, void *children[],
+          __attribute__((unused)) void *data)
+{
+    uintptr_t sum = 1;
+    unsigned i;
+
+    for (i = 0; i < term->n_children; i++)
+        sum += (uintptr_t)children[i];
+    return (void *)sum;
+}
+
+static void
+bench_reduce(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bench_begin(&sample);
+        if ((uintptr_t)cpeg_term_reduce(sum_nodes, tree, NULL) != count)
+            abort();
+        bench_end(&sample);
+    }
+    bench_report(&sample, name, count, "nodes=%lu", count);
+    cpeg_term_free(tree);
+}
+
+/* The same subtree under every child slot: few nodes, many paths */
+static cpeg_term *
+build_shared_tree(unsigned depth)
+{
+    cpeg_term *node = new_leaf();
+    cpeg_term *children[TREE_FANOUT];
+    unsigned i;
+
+    while (depth-- > 0)
+    {
+        for (i = 0; i < TREE_FANOUT; i++)
+            children[i] = i == 0 ? node : cpeg_term_use(node);
+        node = cpeg_term_new(&bench_type, NULL, TREE_FANOUT, children);
+    }
+    return node;
+}
+
+static void
+bench_reduce_variant(const char *name, bool shared, bool dag)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = shared ? build_shared_tree(TREE_DEPTH) :
+        build_tree(TREE_DEPTH, &count);
+    bench_sample sample = {0};
+    unsigned r;
+
+    if (shared)
+        count = (uintptr_t)cpeg_term_reduce(sum_nodes, tree, NULL);
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        void *result;
+
+        bench_begin(&sample);
+        result = dag ? cpeg_term_reduce_dag(sum_nodes, tree, NULL) :
+            cpeg_term_reduce(sum_nodes, tree, NULL);
+        bench_end(&sample);
+        if ((uintptr_t)result != count)
+            abort();
+    }
+    /* Per path, so that the shared cases compare with the tree ones */
+    bench_report(&sample, name, count, "paths=%lu", count);
+    cpeg_term_free(tree);
+}
+
+static void
+bench_reduce_dag(const char *name)
+{
+    bench_reduce_variant(name, false, true);
+}
+
+static void
+bench_reduce_shared(const char *name)
+{
+    bench_reduce_variant(name, true, false);
+}
+
+static void
+bench_reduce_dag_shared(const char *name)
+{
+    bench_reduce_variant(name, true, true);
+}
+
+#define MEMO_EDITS 1000
+
+/* An edit at the bottom of the tree followed by a memoized reduce */
+static void
+bench_memo_reduce(const char *name)
+{
+    unsigned long count = 0;
+    cpeg_term *tree = build_tree(TREE_DEPTH, &count);
+    cpeg_term_memo *memo = cpeg_term_memo_create(sum_nodes, NULL, NULL);
+    bench_sample sample = {0};
+    unsigned r;
+    unsigned i;
+    unsigned d;
+
+    if ((uintptr_t)cpeg_term_memo_reduce(memo, tree) != count)
+        abort();
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bench_begin(&sample);
+        for (i = 0; i < MEMO_EDITS; i++)
+        {
+            cpeg_term *node = tree;
+
+            for (d = 0; d < TREE_DEPTH; d++)
+                node = node->children[(i + d) % TREE_FANOUT];
+            cpeg_term_graft(node, UINT_MAX, new_leaf());
+            if ((uintptr_t)cpeg_term_memo_reduce(memo, tree) != ++count)
+                abort();
+        }
+        bench_end(&sample);
+    }
+    bench_report(&sample, name, MEMO_EDITS, "nodes=%lu", count);
+    cpeg_term_memo_destroy(memo);
+    cpeg_term_free(tree);
+}
+
+static void
+bench_graft_wide(const char *name)
+{
+    bench_sample sample = {0};
+    unsigned r;
+    unsigned i;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term *wide = new_leaf();
+
+        bench_begin(&sample);
+        for (i = 0; i < WIDE_CHILDREN; i++)
+            cpeg_term_graft(wide, UINT_MAX, new_leaf());
+        bench_end(&sample);
+        cpeg_term_free(wide);
+    }
+    bench_report(&sample, name, WIDE_CHILDREN, "children=%u", WIDE_CHILDREN);
+}
+
+static void
+bench_builder_wide(const char *name)
+{
+    cpeg_term_builder builder;
+    bench_sample sample = {0};
+    unsigned r;
+    unsigned i;
+
+    cpeg_term_builder_init(&builder);
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term *wide;
+
+        bench_begin(&sample);
+        for (i = 0; i < WIDE_CHILDREN; i++)
+            cpeg_term_builder_add(&builder, new_leaf());
+        wide = cpeg_term_builder_finish(&builder, 0, &bench_type, NULL);
+        bench_end(&sample);
+        cpeg_term_free(wide);
+    }
+    cpeg_term_builder_fini(&builder);
+    bench_report(&sample, name, WIDE_CHILDREN, "children=%u", WIDE_CHILDREN);
+}
+
+static cpeg_term *
+build_wide(unsigned n_children)
+{
+    cpeg_term *wide = new_leaf();
+    unsigned i;
+
+    for (i = 0; i < n_children; i++)
+        cpeg_term_graft(wide, UINT_MAX, new_leaf());
+    return wide;
+}
+
+static void
+bench_prune_wide(const char *name)
+{
+    bench_sample sample = {0};
+    unsigned r;
+    unsigned i;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term *wide = build_wide(WIDE_CHILDREN);
+
+        /* Always from the front, which is the worst case */
+        bench_begin(&sample);
+        for (i = 0; i < WIDE_CHILDREN; i++)
+            cpeg_term_prune(wide, 0);
+        bench_end(&sample);
+        cpeg_term_free(wide);
+    }
+    bench_report(&sample, name, WIDE_CHILDREN, "children=%u", WIDE_CHILDREN);
+}
+
+static void
+bench_glue_wide(const char *name)
+{
+    cpeg_term *side = build_wide(WIDE_CHILDREN);
+    bench_sample sample = {0};
+    unsigned r;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        cpeg_term *wide = build_wide(WIDE_CHILDREN);
+
+        bench_begin(&sample);
+        cpeg_term_glue(wide, side);
+        bench_end(&sample);
+        cpeg_term_free(wide);
+    }
+    bench_report(&sample, name, WIDE_CHILDREN, "children=%u", WIDE_CHILDREN);
+    cpeg_term_free(side);
+}
+
+static void
+bench_memattr_at(const char *name, unsigned n_objects)
+{
+    cpeg_term **objects = malloc(n_objects * sizeof(*objects));
+    bench_sample set = {0};
+    bench_sample get = {0};
+    bench_sample release = {0};
+    char op_name[64];
+    unsigned r;
+    unsigned i;
+
+    for (i = 0; i < n_objects; i++)
+        objects[i] = new_leaf();
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        bench_begin(&set);
+        for (i = 0; i < n_objects; i++)
+            cpeg_mem_attr_set(objects[i], &bench_type, new_leaf());
+        bench_end(&set);
+
+        bench_begin(&get);
+        for (i = 0; i < n_objects; i++)
+        {
+            if (cpeg_mem_attr_get(objects[i], &bench_type) == NULL)
+                abort();
+        }
+        bench_end(&get);
+
+        bench_begin(&release);
+        for (i = 0; i < n_objects; i++)
+            cpeg_mem_release_attrs(objects[i]);
+        bench_end(&release);
+    }
+
+    snprintf(op_name, sizeof(op_name), "%s_set", name);
+    bench_report(&set, op_name, n_objects, "objects=%u", n_objects);
+    snprintf(op_name, sizeof(op_name), "%s_get", name);
+    bench_report(&get, op_name, n_objects, "objects=%u", n_objects);
+    snprintf(op_name, sizeof(op_name), "%s_release", name);
+    bench_report(&release, op_name, n_objects, "objects=%u", n_objects);
+
+    for (i = 0; i < n_objects; i++)
+        cpeg_term_free(objects[i]);
+    free(objects);
+}
+
+static void
+bench_memattr_small(const char *name)
+{
+    bench_memattr_at(name, 1000);
+}
+
+static void
+bench_memattr_medium(const char *name)
+{
+    bench_memattr_at(name, 100000);
+}
+
+static void
+bench_memattr_large(const char *name)
+{
+    bench_memattr_at(name, 1000000);
+}
+
+static const bench_case cases[] = {
+    {"churn_hit", bench_churn_hit},
+    {"churn_miss", bench_churn_miss},
+    {"deep_copy", bench_deep_copy},
+    {"serial_write", bench_serial_write},
+    {"serial_read", bench_serial_read},
+    {"image_load", bench_image_load},
+    {"zipper_edit", bench_zipper_edit},
+    {"preorder", bench_preorder},
+    {"postorder", bench_postorder},
+    {"flatten", bench_flatten},
+    {"flat_preorder", bench_flat_preorder},
+    {"flat_find", bench_flat_find},
+    {"isomorphic", bench_isomorphic},
+    {"flat_isomorphic", bench_flat_isomorphic},
+    {"flat_shape_hash", bench_flat_shape_hash},
+    {"archive", bench_archive},
+    {"archive_preorder", bench_archive_preorder},
+    {"map", bench_map},
+    {"rewrite", bench_rewrite},
+    {"reduce", bench_reduce},
+    {"reduce_dag", bench_reduce_dag},
+    {"reduce_shared", bench_reduce_shared},
+    {"reduce_dag_shared", bench_reduce_dag_shared},
+    {"memo_reduce", bench_memo_reduce},
+    {"graft_wide", bench_graft_wide},
+    {"builder_wide", bench_builder_wide},
+    {"prune_wide", bench_prune_wide},
+    {"glue_wide", bench_glue_wide},
+    {"memattr_small", bench_memattr_small},
+    {"memattr_medium", bench_memattr_medium},
+    {"memattr_large", bench_memattr_large},
+};
+
+int
+main(int argc, char *argv[])
+{
+    return bench_main(argc, argv, cases, sizeof(cases) / sizeof(*cases));
+}
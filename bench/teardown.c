@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "libcpeg.h"
+#include "bench.h"
+
+/*
+ * Measures how fast a large tree without any attributes is torn down,
+ * while some unrelated objects do have attributes.
+ */
+
+#define TREE_FANOUT 4
+#define TREE_DEPTH 10
+#define N_ANNOTATED 10000
+
+static const cpeg_term_type bench_type = {
+    .id = "bench"
+};
+
+static cpeg_term *
+build_tree(unsigned depth, unsigned long *count)
+{
+    cpeg_term *children[TREE_FANOUT];
+    unsigned i;
+
+    (*count)++;
+    if (depth == 0)
+        return cpeg_term_new(&bench_type, NULL, 0, NULL);
+
+    for (i = 0; i < TREE_FANOUT; i++)
+        children[i] = build_tree(depth - 1, count);
+    return cpeg_term_new(&bench_type, NULL, TREE_FANOUT, children);
+}
+
+static void
+bench_teardown(const char *name)
+{
+    static cpeg_term *annotated[N_ANNOTATED];
+    bench_sample sample = {0};
+    unsigned long count = 0;
+    unsigned i;
+
+    for (i = 0; i < N_ANNOTATED; i++)
+    {
+        annotated[i] = cpeg_term_new(&bench_type, NULL, 0, NULL);
+        cpeg_mem_attr_set(annotated[i], &bench_type,
+                          cpeg_term_new(&bench_type, NULL, 0, NULL));
+    }
+
+    for (i = 0; i < BENCH_ROUNDS; i++)
+    {
+        cpeg_term *tree;
+
+        count = 0;
+        tree = build_tree(TREE_DEPTH, &count);
+        bench_begin(&sample);
+        cpeg_term_free(tree);
+        bench_end(&sample);
+    }
+
+    for (i = 0; i < N_ANNOTATED; i++)
+        cpeg_term_free(annotated[i]);
+
+    bench_report(&sample, name, count, "nodes=%lu", count);
+}
+
+/* The latency of dropping a tree in the deferred mode, per tree */
+static void
+bench_release_deferred(const char *name)
+{
+    bench_sample sample = {0};
+    unsigned long count = 0;
+    unsigned i;
+
+    cpeg_term_reclaim_mode(CPEG_RECLAIM_DEFERRED);
+    for (i = 0; i < BENCH_ROUNDS; i++)
+    {
+        cpeg_term *tree;
+
+        count = 0;
+        tree = build_tree(TREE_DEPTH, &count);
+        bench_begin(&sample);
+        cpeg_term_free(tree);
+        bench_end(&sample);
+        while (cpeg_term_reclaim_step(4096))
+            ;
+    }
+
+    bench_report(&sample, name, 1, "nodes=%lu", count);
+}
+
+static const bench_case cases[] = {
+    {"teardown", bench_teardown},
+    {"release_deferred", bench_release_deferred},
+};
+
+int
+main(int argc, char *argv[])
+{
+    return bench_main(argc, argv, cases, sizeof(cases) / sizeof(*cases));
+}
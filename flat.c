@@ -0,0 +1,817 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_ptrmap.h"
+#include "libcpeg_flat.h"
+#ifdef LIBCPEG_TESTING
+#include "cqc.h"
+#endif
+
+#ifdef LIBCPEG_TESTING
+
+static const cpeg_term_type test_flat_even = {
+    .id = "even"
+};
+
+static const cpeg_term_type test_flat_odd = {
+    .id = "odd"
+};
+
+/* Builds a tree of a given size with random fanout, numbered in preorder */
+static cpeg_term *
+test_flat_tree(uintptr_t *next, uintptr_t limit)
+{
+    uintptr_t label = (*next)++;
+    cpeg_term *node = cpeg_term_new(label % 2 ? &test_flat_odd :
+                                    &test_flat_even, (void *)label, 0, NULL);
+    unsigned fanout = (unsigned)(rand() % 5);
+
+    while (fanout-- > 0 && *next < limit)
+        cpeg_term_graft(node, UINT_MAX, test_flat_tree(next, limit));
+    return node;
+}
+
+typedef struct test_flat_walk {
+    const cpeg_term_flat *flat;
+    uint32_t pos;
+    bool ok;
+} test_flat_walk;
+
+static int
+test_flat_check_term(const cpeg_term *term, void *data)
+{
+    test_flat_walk *walk = data;
+
+    if (walk->pos >= walk->flat->n_terms ||
+        walk->flat->terms[walk->pos] != term ||
+        walk->flat->values[walk->pos] != term->value ||
+        cpeg_term_flat_type(walk->flat, walk->pos) != term->type ||
+        walk->flat->n_children[walk->pos] != term->n_children)
+        walk->ok = false;
+    walk->pos++;
+    return 0;
+}
+
+static int
+test_flat_check_index(const cpeg_term_flat *flat, uint32_t i, void *data)
+{
+    test_flat_walk *walk = data;
+    uint32_t parent = flat->parents[i];
+
+    if (i != walk->pos++ ||
+        (parent == CPEG_FLAT_NONE ? i != 0 :
+         parent >= i || i >= parent + flat->sizes[parent]))
+        walk->ok = false;
+    return 0;
+}
+
+static void *
+test_flat_size(const cpeg_term_flat *flat, uint32_t i, void *children[],
+               __attribute__((unused)) void *data)
+{
+    uintptr_t size = 1;
+    uint32_t k;
+
+    for (k = 0; k < flat->n_children[i]; k++)
+        size += (uintptr_t)children[k];
+    return (void *)size;
+}
+
+#endif
+
+typedef struct flat_frame {
+    const cpeg_term *term;
+    unsigned pos;
+    uint32_t index;
+} flat_frame;
+
+typedef struct flat_builder {
+    cpeg_term_flat *flat;
+    uint32_t capacity;
+    /* Maps types to their index plus one */
+    cpeg_ptrmap type_ids;
+    unsigned types_capacity;
+    /* Siblings mostly have the same type, so the last one is cached */
+    const cpeg_term_type *last_type;
+    uint32_t last_id;
+} flat_builder;
+
+static void
+flat_grow(flat_builder *builder, size_t capacity)
+{
+    cpeg_term_flat *flat = builder->flat;
+
+    assert(capacity < CPEG_FLAT_NONE);
+    builder->capacity = (uint32_t)capacity;
+#define FLAT_GROW(_field)                                               \
+    flat->_field = cpeg_mem_realloc(flat->_field, builder->capacity *   \
+                                    sizeof(*flat->_field))
+    FLAT_GROW(type_ids);
+    FLAT_GROW(values);
+    FLAT_GROW(n_children);
+    FLAT_GROW(sizes);
+    FLAT_GROW(parents);
+    FLAT_GROW(terms);
+#undef FLAT_GROW
+}
+
+static uint32_t
+flat_type_id(flat_builder *builder, const cpeg_term_type *type)
+{
+    cpeg_term_flat *flat = builder->flat;
+    void **id;
+
+    if (type == builder->last_type)
+        return builder->last_id;
+
+    id = cpeg_ptrmap_insert(&builder->type_ids, type);
+    if (*id == NULL)
+    {
+        if (flat->n_types == builder->types_capacity)
+        {
+            builder->types_capacity = builder->types_capacity == 0 ? 8 :
+                builder->types_capacity * 2;
+            flat->types = cpeg_mem_realloc(flat->types,
+                                           builder->types_capacity *
+                                           sizeof(*flat->types));
+        }
+        flat->types[flat->n_types++] = type;
+        *id = (void *)(uintptr_t)flat->n_types;
+    }
+    builder->last_type = type;
+    builder->last_id = (uint32_t)((uintptr_t)*id - 1);
+    return builder->last_id;
+}
+
+static uint32_t
+flat_append(flat_builder *builder, const cpeg_term *term, uint32_t parent)
+{
+    cpeg_term_flat *flat = builder->flat;
+    uint32_t i = flat->n_terms++;
+
+    if (i == builder->capacity)
+        flat_grow(builder, i < 8 ? 16 : (size_t)i * 2);
+    flat->type_ids[i] = flat_type_id(builder, term->type);
+    flat->values[i] = term->value;
+    flat->n_children[i] = term->n_children;
+    flat->sizes[i] = 1;
+    flat->parents[i] = parent;
+    flat->terms[i] = (cpeg_term *)term;
+    return i;
+}
+
+cpeg_term_flat *
+cpeg_term_flatten(const cpeg_term *term)
+{
+    cpeg_term_flat *flat = cpeg_mem_alloc(sizeof(*flat));
+    flat_builder builder = {.flat = flat};
+    flat_frame *stack;
+    unsigned depth = 0;
+    unsigned capacity = 16;
+
+    memset(flat, 0, sizeof(*flat));
+    cpeg_ptrmap_init(&builder.type_ids);
+    /*
+     * Only a hint, as the arrays grow when needed: cached metrics make
+     * it exact and cheap, and otherwise it saves copying them
+     */
+    flat_grow(&builder, cpeg_term_size(term));
+    stack = cpeg_mem_alloc(capacity * sizeof(*stack));
+
+    stack[depth++] = (flat_frame){
+        .term = term, .pos = 0,
+        .index = flat_append(&builder, cpeg_term_use((cpeg_term *)term),
+                             CPEG_FLAT_NONE)
+    };
+    while (depth > 0)
+    {
+        flat_frame *top = &stack[depth - 1];
+        const cpeg_term *child;
+        uint32_t index;
+
+        if (top->pos == top->term->n_children)
+        {
+            flat->sizes[top->index] = flat->n_terms - top->index;
+            depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        index = flat_append(&builder, child, top->index);
+        if (child->n_children == 0)
+            continue;
+        if (depth == capacity)
+        {
+            capacity *= 2;
+            stack = cpeg_mem_realloc(stack, capacity * sizeof(*stack));
+        }
+        stack[depth++] = (flat_frame){.term = child, .pos = 0,
+                                      .index = index};
+    }
+
+    cpeg_mem_free(stack);
+    cpeg_ptrmap_fini(&builder.type_ids);
+    return flat;
+}
+
+void
+cpeg_term_flat_free(cpeg_term_flat *flat)
+{
+    if (flat == NULL)
+        return;
+
+    cpeg_term_free(flat->terms[0]);
+    cpeg_mem_free(flat->types);
+    cpeg_mem_free(flat->type_ids);
+    cpeg_mem_free(flat->values);
+    cpeg_mem_free(flat->n_children);
+    cpeg_mem_free(flat->sizes);
+    cpeg_mem_free(flat->parents);
+    cpeg_mem_free(flat->terms);
+    cpeg_mem_free(flat);
+}
+
+#ifdef LIBCPEG_TESTING
+
+CQC_TESTCASE(test_flatten,
+             "A flat snapshot lists the terms in preorder with their "
+             "subtree sizes and parents")
+{
+    cqc_forall_range(unsigned, n, 1, 500)
+    {
+        cqc_expect
+        {
+            uintptr_t next = 0;
+            cpeg_term *t = test_flat_tree(&next, n);
+            cpeg_term_flat *flat = cpeg_term_flatten(t);
+            test_flat_walk walk = {.flat = flat, .pos = 0, .ok = true};
+
+            cqc_assert_eq(unsigned, t->refcnt, 2);
+            cqc_assert_eq(unsigned, flat->n_terms, (unsigned)next);
+            cpeg_term_traverse_preorder(test_flat_check_term, t, &walk);
+            cqc_assert(walk.ok);
+            cqc_assert_eq(unsigned, flat->sizes[0], flat->n_terms);
+
+            walk.pos = 0;
+            cpeg_term_flat_traverse(test_flat_check_index, flat, 0, &walk);
+            cqc_assert(walk.ok);
+            cqc_assert_eq(unsigned, walk.pos, flat->n_terms);
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_flat_reduce(test_flat_size,
+                                                           flat, NULL),
+                          flat->n_terms);
+
+            cpeg_term_flat_free(flat);
+            cqc_assert_eq(unsigned, t->refcnt, 1);
+            cpeg_term_free(t);
+        }
+    }
+}
+
+#endif
+
+uint32_t
+cpeg_term_flat_type_id(const cpeg_term_flat *flat, const cpeg_term_type *type)
+{
+    unsigned i;
+
+    for (i = 0; i < flat->n_types; i++)
+    {
+        if (flat->types[i] == type)
+            return i;
+    }
+    return CPEG_FLAT_NONE;
+}
+
+int
+cpeg_term_flat_traverse(cpeg_term_flat_traverse_fn fn,
+                        const cpeg_term_flat *flat, uint32_t i, void *data)
+{
+    uint32_t end = i + flat->sizes[i];
+    int rc;
+
+    for (; i < end; i++)
+    {
+        rc = fn(flat, i, data);
+        if (rc != 0)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * Terms are reduced from the end, so the children of a term are always
+ * done by the time it comes, and their results are picked up by
+ * skipping from one sibling to the next.
+ */
+void *
+cpeg_term_flat_reduce(cpeg_term_flat_reduce_fn reduce,
+                      const cpeg_term_flat *flat, void *data)
+{
+    void **results = cpeg_mem_alloc(flat->n_terms * sizeof(*results));
+    void **args = NULL;
+    uint32_t args_capacity = 0;
+    uint32_t i = flat->n_terms;
+    void *result;
+
+    while (i-- > 0)
+    {
+        uint32_t n = flat->n_children[i];
+        uint32_t j = i + 1;
+        uint32_t k;
+
+        if (n > args_capacity)
+        {
+            args_capacity = n;
+            args = cpeg_mem_realloc(args, args_capacity * sizeof(*args));
+        }
+        for (k = 0; k < n; k++)
+        {
+            args[k] = results[j];
+            j += flat->sizes[j];
+        }
+        results[i] = reduce(flat, i, args, data);
+    }
+
+    result = results[0];
+    cpeg_mem_free(args);
+    cpeg_mem_free(results);
+    return result;
+}
+
+/*
+ * Scans over the arrays are done by kernels picked at run time
+ * according to the CPU. All kernels give the same results: in
+ * particular, the shape hash is defined over 32 interleaved lanes,
+ * the element i going to the lane i % 32, whatever the vector width,
+ * so that vector kernels can keep several independent accumulators.
+ */
+#define FLAT_HASH_LANES 32
+#define FLAT_HASH_SEED 0x811c9dc5u
+#define FLAT_HASH_PRIME 0x01000193u
+
+typedef struct flat_kernels {
+    const char *name;
+    uint32_t (*find)(const uint32_t *ids, uint32_t i, uint32_t n,
+                     uint32_t id);
+    bool (*equal)(const uint32_t *a, const uint32_t *b, uint32_t n);
+    void (*hash)(const uint32_t *a, uint32_t n,
+                 uint32_t lanes[FLAT_HASH_LANES]);
+} flat_kernels;
+
+static uint32_t
+flat_find_scalar(const uint32_t *ids, uint32_t i, uint32_t n, uint32_t id)
+{
+    for (; i < n; i++)
+    {
+        if (ids[i] == id)
+            return i;
+    }
+    return n;
+}
+
+static bool
+flat_equal_scalar(const uint32_t *a, const uint32_t *b, uint32_t n)
+{
+    return memcmp(a, b, n * sizeof(*a)) == 0;
+}
+
+/* Continues the lanes from the element `i`, which is a multiple of 32 */
+static void
+flat_hash_tail(const uint32_t *a, uint32_t i, uint32_t n,
+               uint32_t lanes[FLAT_HASH_LANES])
+{
+    for (; i < n; i++)
+    {
+        uint32_t *h = &lanes[i % FLAT_HASH_LANES];
+
+        *h = (*h ^ a[i]) * FLAT_HASH_PRIME;
+    }
+}
+
+static void
+flat_hash_scalar(const uint32_t *a, uint32_t n,
+                 uint32_t lanes[FLAT_HASH_LANES])
+{
+    flat_hash_tail(a, 0, n, lanes);
+}
+
+static const flat_kernels flat_kernels_scalar = {
+    .name = "scalar",
+    .find = flat_find_scalar,
+    .equal = flat_equal_scalar,
+    .hash = flat_hash_scalar
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define FLAT_TARGET_SSE __attribute__((target("sse4.2")))
+#define FLAT_TARGET_AVX2 __attribute__((target("avx2")))
+
+FLAT_TARGET_SSE static uint32_t
+flat_find_sse(const uint32_t *ids, uint32_t i, uint32_t n, uint32_t id)
+{
+    __m128i key = _mm_set1_epi32((int)id);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i *p = (const __m128i *)(ids + i);
+        __m128i eq0 = _mm_cmpeq_epi32(_mm_loadu_si128(p), key);
+        __m128i eq1 = _mm_cmpeq_epi32(_mm_loadu_si128(p + 1), key);
+        __m128i eq2 = _mm_cmpeq_epi32(_mm_loadu_si128(p + 2), key);
+        __m128i eq3 = _mm_cmpeq_epi32(_mm_loadu_si128(p + 3), key);
+
+        if (!_mm_testz_si128(_mm_or_si128(_mm_or_si128(eq0, eq1),
+                                          _mm_or_si128(eq2, eq3)),
+                             _mm_set1_epi32(-1)))
+            break;
+    }
+    return flat_find_scalar(ids, i, n, id);
+}
+
+FLAT_TARGET_SSE static bool
+flat_equal_sse(const uint32_t *a, const uint32_t *b, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        const __m128i *pa = (const __m128i *)(a + i);
+        const __m128i *pb = (const __m128i *)(b + i);
+        __m128i diff =
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(pa),
+                                       _mm_loadu_si128(pb)),
+                         _mm_xor_si128(_mm_loadu_si128(pa + 1),
+                                       _mm_loadu_si128(pb + 1)));
+
+        if (!_mm_testz_si128(diff, diff))
+            return false;
+    }
+    return flat_equal_scalar(a + i, b + i, n - i);
+}
+
+FLAT_TARGET_SSE static void
+flat_hash_sse(const uint32_t *a, uint32_t n, uint32_t lanes[FLAT_HASH_LANES])
+{
+    __m128i prime = _mm_set1_epi32((int)FLAT_HASH_PRIME);
+    __m128i h[FLAT_HASH_LANES / 4];
+    uint32_t i;
+    unsigned k;
+
+    for (k = 0; k < FLAT_HASH_LANES / 4; k++)
+        h[k] = _mm_loadu_si128((const __m128i *)lanes + k);
+    for (i = 0; i + FLAT_HASH_LANES <= n; i += FLAT_HASH_LANES)
+    {
+        const __m128i *p = (const __m128i *)(a + i);
+
+        for (k = 0; k < FLAT_HASH_LANES / 4; k++)
+        {
+            __m128i v = _mm_loadu_si128(p + k);
+
+            h[k] = _mm_mullo_epi32(_mm_xor_si128(h[k], v), prime);
+        }
+    }
+    for (k = 0; k < FLAT_HASH_LANES / 4; k++)
+        _mm_storeu_si128((__m128i *)lanes + k, h[k]);
+    flat_hash_tail(a, i, n, lanes);
+}
+
+static const flat_kernels flat_kernels_sse = {
+    .name = "sse4.2",
+    .find = flat_find_sse,
+    .equal = flat_equal_sse,
+    .hash = flat_hash_sse
+};
+
+FLAT_TARGET_AVX2 static uint32_t
+flat_find_avx2(const uint32_t *ids, uint32_t i, uint32_t n, uint32_t id)
+{
+    __m256i key = _mm256_set1_epi32((int)id);
+
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i *p = (const __m256i *)(ids + i);
+        __m256i eq0 = _mm256_cmpeq_epi32(_mm256_loadu_si256(p), key);
+        __m256i eq1 = _mm256_cmpeq_epi32(_mm256_loadu_si256(p + 1), key);
+        __m256i eq2 = _mm256_cmpeq_epi32(_mm256_loadu_si256(p + 2), key);
+        __m256i eq3 = _mm256_cmpeq_epi32(_mm256_loadu_si256(p + 3), key);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(eq0, eq1),
+                                      _mm256_or_si256(eq2, eq3));
+
+        if (!_mm256_testz_si256(any, any))
+            break;
+    }
+    return flat_find_scalar(ids, i, n, id);
+}
+
+FLAT_TARGET_AVX2 static bool
+flat_equal_avx2(const uint32_t *a, const uint32_t *b, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        const __m256i *pa = (const __m256i *)(a + i);
+        const __m256i *pb = (const __m256i *)(b + i);
+        __m256i diff =
+            _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256(pa),
+                                             _mm256_loadu_si256(pb)),
+                            _mm256_xor_si256(_mm256_loadu_si256(pa + 1),
+                                             _mm256_loadu_si256(pb + 1)));
+
+        if (!_mm256_testz_si256(diff, diff))
+            return false;
+    }
+    return flat_equal_scalar(a + i, b + i, n - i);
+}
+
+FLAT_TARGET_AVX2 static void
+flat_hash_avx2(const uint32_t *a, uint32_t n, uint32_t lanes[FLAT_HASH_LANES])
+{
+    __m256i prime = _mm256_set1_epi32((int)FLAT_HASH_PRIME);
+    __m256i h[FLAT_HASH_LANES / 8];
+    uint32_t i;
+    unsigned k;
+
+    for (k = 0; k < FLAT_HASH_LANES / 8; k++)
+        h[k] = _mm256_loadu_si256((const __m256i *)lanes + k);
+    for (i = 0; i + FLAT_HASH_LANES <= n; i += FLAT_HASH_LANES)
+    {
+        const __m256i *p = (const __m256i *)(a + i);
+
+        for (k = 0; k < FLAT_HASH_LANES / 8; k++)
+        {
+            __m256i v = _mm256_loadu_si256(p + k);
+
+            h[k] = _mm256_mullo_epi32(_mm256_xor_si256(h[k], v), prime);
+        }
+    }
+    for (k = 0; k < FLAT_HASH_LANES / 8; k++)
+        _mm256_storeu_si256((__m256i *)lanes + k, h[k]);
+    flat_hash_tail(a, i, n, lanes);
+}
+
+static const flat_kernels flat_kernels_avx2 = {
+    .name = "avx2",
+    .find = flat_find_avx2,
+    .equal = flat_equal_avx2,
+    .hash = flat_hash_avx2
+};
+#endif
+
+static const flat_kernels *flat_active_kernels;
+
+static const flat_kernels *
+flat_select_kernels(void)
+{
+    const flat_kernels *kernels =
+        __atomic_load_n(&flat_active_kernels, __ATOMIC_RELAXED);
+
+    if (kernels != NULL)
+        return kernels;
+
+    kernels = &flat_kernels_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels = &flat_kernels_avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        kernels = &flat_kernels_sse;
+#endif
+    __atomic_store_n(&flat_active_kernels, kernels, __ATOMIC_RELAXED);
+    return kernels;
+}
+
+const char *
+cpeg_term_flat_kernels(void)
+{
+    return flat_select_kernels()->name;
+}
+
+uint32_t
+cpeg_term_flat_find(const cpeg_term_flat *flat, const cpeg_term_type *type,
+                    uint32_t from)
+{
+    uint32_t id = cpeg_term_flat_type_id(flat, type);
+
+    if (id == CPEG_FLAT_NONE || from >= flat->n_terms)
+        return flat->n_terms;
+    return flat_select_kernels()->find(flat->type_ids, from, flat->n_terms,
+                                       id);
+}
+
+uint32_t
+cpeg_term_flat_find_all(const cpeg_term_flat *flat,
+                        const cpeg_term_type *type, uint32_t found[])
+{
+    uint32_t (*find)(const uint32_t *, uint32_t, uint32_t, uint32_t) =
+        flat_select_kernels()->find;
+    uint32_t id = cpeg_term_flat_type_id(flat, type);
+    uint32_t n_found = 0;
+    uint32_t i;
+
+    if (id == CPEG_FLAT_NONE)
+        return 0;
+    for (i = find(flat->type_ids, 0, flat->n_terms, id);
+         i < flat->n_terms;
+         i = find(flat->type_ids, i + 1, flat->n_terms, id))
+        found[n_found++] = i;
+    return n_found;
+}
+
+bool
+cpeg_term_flat_isomorphic(const cpeg_term_flat *flat1, uint32_t i1,
+                          const cpeg_term_flat *flat2, uint32_t i2)
+{
+    /* The child counts in preorder determine the shape */
+    return flat1->sizes[i1] == flat2->sizes[i2] &&
+        flat_select_kernels()->equal(flat1->n_children + i1,
+                                     flat2->n_children + i2,
+                                     flat1->sizes[i1]);
+}
+
+static uint32_t
+flat_hash_finish(const uint32_t lanes[FLAT_HASH_LANES], uint32_t n)
+{
+    uint32_t h = FLAT_HASH_SEED ^ n;
+    unsigned l;
+
+    for (l = 0; l < FLAT_HASH_LANES; l++)
+        h = (h ^ lanes[l]) * FLAT_HASH_PRIME;
+    return h;
+}
+
+uint32_t
+cpeg_term_flat_shape_hash(const cpeg_term_flat *flat, uint32_t i)
+{
+    uint32_t lanes[FLAT_HASH_LANES];
+    unsigned l;
+
+    for (l = 0; l < FLAT_HASH_LANES; l++)
+        lanes[l] = FLAT_HASH_SEED + l;
+    flat_select_kernels()->hash(flat->n_children + i, flat->sizes[i], lanes);
+    return flat_hash_finish(lanes, flat->sizes[i]);
+}
+
+#ifdef LIBCPEG_TESTING
+
+CQC_TESTCASE(test_flat_find,
+             "Searching a flat snapshot finds all terms of a type in order")
+{
+    cqc_forall_range(unsigned, n, 1, 500)
+    {
+        cqc_expect
+        {
+            uintptr_t next = 0;
+            cpeg_term *t = test_flat_tree(&next, n);
+            cpeg_term_flat *flat = cpeg_term_flatten(t);
+            uint32_t i;
+            uint32_t expected = 1;
+            unsigned found = 0;
+
+            for (i = cpeg_term_flat_find(flat, &test_flat_odd, 0);
+                 i < flat->n_terms;
+                 i = cpeg_term_flat_find(flat, &test_flat_odd, i + 1))
+            {
+                cqc_assert_eq(uintptr_t, (uintptr_t)flat->values[i],
+                              expected);
+                cqc_assert(flat->terms[i]->type == &test_flat_odd);
+                expected += 2;
+                found++;
+            }
+            cqc_assert_eq(unsigned, found, (unsigned)next / 2);
+            cqc_assert_eq(unsigned,
+                          cpeg_term_flat_find(flat, &test_flat_even, 0), 0);
+
+            cpeg_term_flat_free(flat);
+            cpeg_term_free(t);
+        }
+    }
+}
+
+#endif
+
+#ifdef LIBCPEG_TESTING
+
+static const flat_kernels *
+test_flat_kernel_set(unsigned k)
+{
+    switch (k)
+    {
+        case 0:
+            return &flat_kernels_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        case 1:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.2") ? &flat_kernels_sse : NULL;
+        case 2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? &flat_kernels_avx2 : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+CQC_TESTCASE(test_flat_kernels,
+             "All kernels agree with the scalar ones at any offset and length")
+{
+    cqc_forall_range(unsigned, k, 0, 2)
+    {
+        cqc_forall_range(unsigned, n, 0, 100)
+        {
+            cqc_forall_range(unsigned, offset, 0, 7)
+            {
+                cqc_expect
+                {
+                    const flat_kernels *kernels = test_flat_kernel_set(k);
+                    uint32_t a[128];
+                    uint32_t b[128];
+                    uint32_t lanes[FLAT_HASH_LANES];
+                    uint32_t expected[FLAT_HASH_LANES];
+                    unsigned end = offset + n;
+                    unsigned i;
+
+                    for (i = 0; i < end; i++)
+                        a[i] = b[i] = (uint32_t)(rand() % 4);
+                    for (i = 0; i < FLAT_HASH_LANES; i++)
+                        lanes[i] = expected[i] = (uint32_t)rand();
+                    if (n > 0)
+                        b[offset + (unsigned)rand() % n] ^= 4;
+
+                    /* Only the kernels the CPU supports are checked */
+                    if (kernels != NULL)
+                    {
+                        cqc_assert_eq(unsigned,
+                                      kernels->find(a, offset, end, 3),
+                                      flat_find_scalar(a, offset, end, 3));
+                        cqc_assert(kernels->equal(a + offset, a + offset, n));
+                        cqc_assert_eq(int,
+                                      kernels->equal(a + offset, b + offset, n),
+                                      n == 0);
+                        kernels->hash(a + offset, n, lanes);
+                        flat_hash_scalar(a + offset, n, expected);
+                        cqc_assert(memcmp(lanes, expected,
+                                          sizeof(lanes)) == 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+CQC_TESTCASE(test_flat_shapes,
+             "Flat shape comparison agrees with cpeg_term_isomorphic, "
+             "and isomorphic subtrees have the same hash")
+{
+    cqc_forall_range(unsigned, n, 1, 300)
+    {
+        cqc_expect
+        {
+            uintptr_t next1 = 0;
+            uintptr_t next2 = 0;
+            cpeg_term *t1 = test_flat_tree(&next1, n);
+            cpeg_term *t2 = test_flat_tree(&next2, n);
+            cpeg_term_flat *flat1 = cpeg_term_flatten(t1);
+            cpeg_term_flat *flat2 = cpeg_term_flatten(t2);
+            uint32_t *found = malloc(flat1->n_terms * sizeof(*found));
+            uint32_t n_found;
+            uint32_t i;
+
+            cqc_assert_eq(int,
+                          cpeg_term_flat_isomorphic(flat1, 0, flat2, 0),
+                          cpeg_term_isomorphic(t1, t2));
+            for (i = 0; i < flat1->n_terms; i++)
+            {
+                cqc_assert(cpeg_term_flat_isomorphic(flat1, i, flat1, i));
+                if (flat1->n_children[i] == 1)
+                    cqc_assert(!cpeg_term_flat_isomorphic(flat1, i,
+                                                          flat1, i + 1));
+            }
+            if (cpeg_term_isomorphic(t1, t2))
+            {
+                cqc_assert_eq(unsigned, cpeg_term_flat_shape_hash(flat1, 0),
+                              cpeg_term_flat_shape_hash(flat2, 0));
+            }
+
+            n_found = cpeg_term_flat_find_all(flat1, &test_flat_odd, found);
+            cqc_assert_eq(unsigned, n_found, flat1->n_terms / 2);
+            for (i = 0; i < n_found; i++)
+                cqc_assert_eq(uintptr_t, (uintptr_t)flat1->values[found[i]],
+                              2 * i + 1);
+
+            free(found);
+            cpeg_term_flat_free(flat1);
+            cpeg_term_flat_free(flat2);
+            cpeg_term_free(t1);
+            cpeg_term_free(t2);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,437 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_hashcons.h"
+#ifdef LIBCPEG_TESTING
+#include "cqc.h"
+#endif
+
+#ifdef LIBCPEG_TESTING
+
+static unsigned test_hashcons_object_count;
+
+static void *
+test_hashcons_init(void *v)
+{
+    test_hashcons_object_count++;
+    return strdup(v);
+}
+
+static void
+test_hashcons_destroy(void *v)
+{
+    assert(test_hashcons_object_count > 0);
+    test_hashcons_object_count--;
+    free(v);
+}
+
+static size_t
+test_hashcons_hash(const void *v)
+{
+    const unsigned char *s;
+    size_t h = 2166136261u;
+
+    for (s = v; *s != '\0'; s++)
+        h = (h ^ *s) * 16777619u;
+    return h;
+}
+
+static bool
+test_hashcons_equal(const void *v1, const void *v2)
+{
+    return strcmp(v1, v2) == 0;
+}
+
+static const cpeg_term_type test_hashcons_type = {
+    .id = "hashcons",
+    .init = test_hashcons_init,
+    .destroy = test_hashcons_destroy,
+    .hash = test_hashcons_hash,
+    .equal = test_hashcons_equal
+};
+
+/* Builds a complete binary tree whose nodes are labelled by depth */
+static cpeg_term *
+test_hashcons_tree(cpeg_term_factory *factory, unsigned depth)
+{
+    static const char *labels[] = {"a", "b", "c", "d", "e", "f", "g", "h"};
+    cpeg_term *children[2];
+
+    if (depth == 0)
+        return cpeg_term_intern(factory, &test_hashcons_type, "leaf", 0, NULL);
+
+    children[0] = test_hashcons_tree(factory, depth - 1);
+    children[1] = test_hashcons_tree(factory, depth - 1);
+    return cpeg_term_intern(factory, &test_hashcons_type,
+                            (void *)labels[depth % 8], 2, children);
+}
+
+#endif
+
+#define FACTORY_MIN_SIZE 64
+
+typedef struct factory_entry {
+    size_t hash;
+    cpeg_term *term;
+} factory_entry;
+
+struct cpeg_term_factory {
+    factory_entry *entries;
+    size_t mask;
+    size_t n_terms;
+};
+
+static inline size_t
+factory_mix(size_t hash, uintptr_t val)
+{
+    uint64_t h = (hash ^ val) * UINT64_C(0x9e3779b97f4a7c15);
+
+    return (size_t)(h >> 32 ^ h);
+}
+
+static size_t
+factory_hash(const cpeg_term_type *type, const void *value,
+             unsigned n_children, cpeg_term *const children[])
+{
+    size_t hash = factory_mix(n_children, (uintptr_t)type);
+    unsigned i;
+
+    hash = factory_mix(hash, type->hash ? type->hash(value) : (uintptr_t)value);
+    for (i = 0; i < n_children; i++)
+        hash = factory_mix(hash, (uintptr_t)children[i]);
+    return hash;
+}
+
+static inline size_t
+factory_term_hash(const cpeg_term *term)
+{
+    return factory_hash(term->type, term->value,
+                        term->n_children, term->children);
+}
+
+static bool
+factory_match(const cpeg_term *term, const cpeg_term_type *type,
+              const void *value, unsigned n_children,
+              cpeg_term *const children[])
+{
+    if (term->type != type || term->n_children != n_children)
+        return false;
+    if (n_children > 0 &&
+        memcmp(term->children, children,
+               n_children * sizeof(*children)) != 0)
+        return false;
+
+    return type->equal ? type->equal(term->value, value) :
+        term->value == value;
+}
+
+static unsigned
+factory_refcnt(const cpeg_term *term)
+{
+    return (term->flags & CPEG_TERM_SHARED) ?
+        __atomic_load_n(&term->refcnt, __ATOMIC_ACQUIRE) : term->refcnt;
+}
+
+cpeg_term_factory *
+cpeg_term_factory_create(void)
+{
+    cpeg_term_factory *factory = cpeg_mem_alloc(sizeof(*factory));
+
+    factory->entries = NULL;
+    factory->mask = 0;
+    factory->n_terms = 0;
+    return factory;
+}
+
+void
+cpeg_term_factory_destroy(cpeg_term_factory *factory)
+{
+    size_t i;
+
+    if (factory == NULL)
+        return;
+
+    if (factory->entries != NULL)
+    {
+        for (i = 0; i <= factory->mask; i++)
+            cpeg_term_free(factory->entries[i].term);
+        cpeg_mem_free(factory->entries);
+    }
+    cpeg_mem_free(factory);
+}
+
+size_t
+cpeg_term_factory_size(const cpeg_term_factory *factory)
+{
+    return factory->n_terms;
+}
+
+static void
+factory_grow(cpeg_term_factory *factory)
+{
+    size_t size = factory->entries == NULL ?
+        FACTORY_MIN_SIZE : (factory->mask + 1) * 2;
+    factory_entry *entries = cpeg_mem_alloc(size * sizeof(*entries));
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        entries[i].term = NULL;
+
+    if (factory->entries != NULL)
+    {
+        for (i = 0; i <= factory->mask; i++)
+        {
+            size_t j;
+
+            if (factory->entries[i].term == NULL)
+                continue;
+            for (j = factory->entries[i].hash & (size - 1);
+                 entries[j].term != NULL;
+                 j = (j + 1) & (size - 1))
+                ;
+            entries[j] = factory->entries[i];
+        }
+        cpeg_mem_free(factory->entries);
+    }
+    factory->entries = entries;
+    factory->mask = size - 1;
+}
+
+cpeg_term *
+cpeg_term_intern(cpeg_term_factory *factory, const cpeg_term_type *type,
+                 void *value, unsigned n_children, cpeg_term *children[])
+{
+    size_t hash = factory_hash(type, value, n_children, children);
+    size_t i;
+    cpeg_term *term;
+
+    if ((factory->n_terms + 1) * 2 >
+        (factory->entries == NULL ? 0 : factory->mask + 1))
+        factory_grow(factory);
+
+    for (i = hash & factory->mask;
+         factory->entries[i].term != NULL;
+         i = (i + 1) & factory->mask)
+    {
+        if (factory->entries[i].hash == hash &&
+            factory_match(factory->entries[i].term, type, value,
+                          n_children, children))
+        {
+            unsigned j;
+
+            /* The existing term already holds the same children */
+            for (j = 0; j < n_children; j++)
+                cpeg_term_free(children[j]);
+            return cpeg_term_use(factory->entries[i].term);
+        }
+    }
+
+    term = cpeg_term_new(type, value, n_children, children);
+    factory->entries[i].hash = hash;
+    factory->entries[i].term = term;
+    factory->n_terms++;
+
+    return cpeg_term_use(term);
+}
+
+static factory_entry *
+factory_find(cpeg_term_factory *factory, const cpeg_term *term)
+{
+    size_t i;
+
+    if (factory->entries == NULL)
+        return NULL;
+
+    for (i = factory_term_hash(term) & factory->mask;
+         factory->entries[i].term != NULL;
+         i = (i + 1) & factory->mask)
+    {
+        if (factory->entries[i].term == term)
+            return &factory->entries[i];
+    }
+    return NULL;
+}
+
+static void
+factory_remove(cpeg_term_factory *factory, factory_entry *entry)
+{
+    size_t i = (size_t)(entry - factory->entries);
+    size_t j = i;
+
+    for (;;)
+    {
+        size_t home;
+
+        j = (j + 1) & factory->mask;
+        if (factory->entries[j].term == NULL)
+            break;
+        home = factory->entries[j].hash & factory->mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        factory->entries[i] = factory->entries[j];
+        i = j;
+    }
+    factory->entries[i].term = NULL;
+    factory->n_terms--;
+}
+
+typedef struct factory_list {
+    cpeg_term **terms;
+    size_t n_terms;
+    size_t capacity;
+} factory_list;
+
+static void
+factory_list_push(factory_list *list, cpeg_term *term)
+{
+    if (list->n_terms == list->capacity)
+    {
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->terms = cpeg_mem_realloc(list->terms,
+                                       list->capacity * sizeof(*list->terms));
+    }
+    list->terms[list->n_terms++] = term;
+}
+
+/*
+ * Dead terms are unlinked from the table as soon as they are found,
+ * so that a child referenced several times is only collected once.
+ */
+size_t
+cpeg_term_factory_gc(cpeg_term_factory *factory)
+{
+    factory_list dead = {NULL, 0, 0};
+    factory_list children = {NULL, 0, 0};
+    size_t n_collected = 0;
+    size_t i;
+
+    if (factory->entries == NULL)
+        return 0;
+
+    for (i = 0; i <= factory->mask; i++)
+    {
+        cpeg_term *term = factory->entries[i].term;
+
+        if (term != NULL && factory_refcnt(term) == 1)
+            factory_list_push(&dead, term);
+    }
+    for (i = 0; i < dead.n_terms; i++)
+        factory_remove(factory, factory_find(factory, dead.terms[i]));
+
+    while (dead.n_terms > 0)
+    {
+        cpeg_term *term = dead.terms[--dead.n_terms];
+        unsigned j;
+
+        children.n_terms = 0;
+        for (j = 0; j < term->n_children; j++)
+        {
+            if (term->children[j] != NULL &&
+                factory_find(factory, term->children[j]) != NULL)
+                factory_list_push(&children, term->children[j]);
+        }
+        cpeg_term_free(term);
+        n_collected++;
+
+        for (i = 0; i < children.n_terms; i++)
+        {
+            factory_entry *entry;
+
+            if (factory_refcnt(children.terms[i]) != 1)
+                continue;
+            entry = factory_find(factory, children.terms[i]);
+            if (entry == NULL)
+                continue;
+            factory_remove(factory, entry);
+            factory_list_push(&dead, children.terms[i]);
+        }
+    }
+
+    cpeg_mem_free(dead.terms);
+    cpeg_mem_free(children.terms);
+    return n_collected;
+}
+
+#ifdef LIBCPEG_TESTING
+CQC_TESTCASE(test_intern_shares,
+             "Equal terms are interned once")
+{
+    cqc_forall_range(unsigned, depth, 0, 12)
+    {
+        cqc_expect
+        {
+            cpeg_term_factory *factory = cpeg_term_factory_create();
+            cpeg_term *t1 = test_hashcons_tree(factory, depth);
+            cpeg_term *t2 = test_hashcons_tree(factory, depth);
+
+            cqc_assert_eq(cqc_opaque, t1, t2);
+            cqc_assert(cpeg_term_isomorphic(t1, t2));
+            cqc_assert_eq(size_t, cpeg_term_factory_size(factory), depth + 1);
+            cqc_assert_eq(unsigned, test_hashcons_object_count, depth + 1);
+            cpeg_term_free(t1);
+            cpeg_term_free(t2);
+            cpeg_term_factory_destroy(factory);
+            cqc_assert_eq(unsigned, test_hashcons_object_count, 0);
+        }
+    }
+}
+
+CQC_TESTCASE(test_intern_distinct,
+             "Terms with different values or children are distinct")
+{
+    cqc_forall(unsigned, v)
+    {
+        cqc_expect
+        {
+            cpeg_term_factory *factory = cpeg_term_factory_create();
+            cpeg_term *leaf = cpeg_term_intern(factory, &test_hashcons_type,
+                                               "leaf", 0, NULL);
+            cpeg_term *t1 = cpeg_term_intern(factory, &test_hashcons_type,
+                                             "node", 1,
+                                             (cpeg_term *[]){
+                                                 cpeg_term_use(leaf)});
+            cpeg_term *t2 = cpeg_term_intern(factory, &test_hashcons_type,
+                                             v % 2 ? "node" : "other", 2,
+                                             (cpeg_term *[]){
+                                                 cpeg_term_use(leaf),
+                                                 cpeg_term_use(leaf)});
+
+            cqc_assert_neq(cqc_opaque, t1, t2);
+            cqc_assert_eq(size_t, cpeg_term_factory_size(factory), 3);
+            cpeg_term_free(leaf);
+            cpeg_term_free(t1);
+            cpeg_term_free(t2);
+            cpeg_term_factory_destroy(factory);
+        }
+    }
+}
+
+CQC_TESTCASE(test_factory_gc,
+             "Only unreferenced terms are collected")
+{
+    cqc_forall_range(unsigned, depth, 1, 12)
+    {
+        cqc_expect
+        {
+            cpeg_term_factory *factory = cpeg_term_factory_create();
+            cpeg_term *t = test_hashcons_tree(factory, depth);
+            cpeg_term *sub = cpeg_term_use(t->children[0]);
+
+            cqc_assert_eq(size_t, cpeg_term_factory_gc(factory), 0);
+            cpeg_term_free(t);
+            cqc_assert_eq(size_t, cpeg_term_factory_gc(factory), 1);
+            cqc_assert_eq(size_t, cpeg_term_factory_size(factory), depth);
+            cpeg_term_free(sub);
+            cqc_assert_eq(size_t, cpeg_term_factory_gc(factory), depth);
+            cqc_assert_eq(size_t, cpeg_term_factory_size(factory), 0);
+            cqc_assert_eq(unsigned, test_hashcons_object_count, 0);
+            cpeg_term_factory_destroy(factory);
+        }
+    }
+}
+#endif
@@ -0,0 +1,648 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_ptrmap.h"
+#include "libcpeg_serial.h"
+#include "libcpeg_image.h"
+#ifdef LIBCPEG_TESTING
+#include <stdio.h>
+#include "cqc.h"
+#endif
+
+/*
+ * An image consists of the header, the term records, the values and
+ * the type table, in that order. A term record is a cpeg_term followed
+ * by its children, and records are written in postorder, so the root
+ * comes last. All pointers are stored as they would be if the image
+ * were mapped at `base`, and type pointers as they were in the writer,
+ * so that the type table tells which of them need to be changed.
+ */
+#define IMAGE_MAGIC "CPGTIMG"
+#define IMAGE_VERSION 1
+
+#if UINTPTR_MAX > 0xffffffffu
+#define IMAGE_DEFAULT_BASE ((uintptr_t)0x3f0000000000)
+#else
+#define IMAGE_DEFAULT_BASE ((uintptr_t)0x3f000000)
+#endif
+
+#define IMAGE_ALIGN 8
+#define IMAGE_BUFFER_SIZE 65536
+
+typedef struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t term_size;
+    uint64_t base;
+    uint64_t size;
+    uint64_t root;
+    uint64_t terms_start;
+    uint64_t terms_end;
+    uint64_t types_start;
+    uint64_t n_types;
+} image_header;
+
+typedef struct image_type {
+    uint64_t addr;
+    uint64_t id_start;
+    uint64_t id_len;
+} image_type;
+
+struct cpeg_term_image {
+    unsigned char *addr;
+    size_t size;
+    cpeg_term *root;
+    bool pristine;
+};
+
+#ifdef LIBCPEG_TESTING
+
+static const cpeg_term_type test_image_type = {
+    .id = "image"
+};
+
+/* Has the same id, so it stands for the type in another process */
+static const cpeg_term_type test_image_alias = {
+    .id = "image"
+};
+
+static size_t
+test_image_encode(const void *value, void *buf, size_t size)
+{
+    size_t len = strlen(value) + 1;
+
+    if (len <= size)
+        memcpy(buf, value, len);
+    return len;
+}
+
+static const cpeg_term_codec test_image_codecs[] = {
+    {.type = &test_image_type, .encode = test_image_encode}
+};
+
+static const cpeg_term_codec test_image_alias_codecs[] = {
+    {.type = &test_image_alias, .encode = test_image_encode}
+};
+
+/* Builds a binary DAG in which both children of a node are the same */
+static cpeg_term *
+test_image_dag(unsigned depth)
+{
+    static const char *labels[] = {"leaf", "a", "bb", "ccc", "dddd"};
+    cpeg_term *child;
+
+    if (depth == 0)
+        return cpeg_term_new(&test_image_type, (void *)labels[0], 0, NULL);
+
+    child = test_image_dag(depth - 1);
+    return cpeg_term_newl(&test_image_type, (void *)labels[depth % 5],
+                          child, cpeg_term_use(child), NULL);
+}
+
+static int
+test_image_same(const cpeg_term *t1, const cpeg_term *t2,
+                __attribute__((unused)) void *data)
+{
+    return t1->n_children != t2->n_children ||
+        t2->refcnt != UINT_MAX ||
+        strcmp(t1->value, t2->value) != 0;
+}
+
+#endif
+
+typedef struct image_out {
+    int fd;
+    int error;
+    uint64_t offset;
+    size_t used;
+    unsigned char buf[IMAGE_BUFFER_SIZE];
+} image_out;
+
+static void
+image_flush(image_out *out)
+{
+    size_t done = 0;
+
+    while (out->error == 0 && done < out->used)
+    {
+        ssize_t rc = pwrite(out->fd, out->buf + done, out->used - done,
+                            (off_t)(out->offset + done));
+
+        if (rc >= 0)
+            done += (size_t)rc;
+        else if (errno != EINTR)
+            out->error = errno;
+    }
+    out->offset += out->used;
+    out->used = 0;
+}
+
+static void
+image_put(image_out *out, const void *data, size_t size)
+{
+    const unsigned char *src = data;
+
+    while (size > 0)
+    {
+        size_t chunk = IMAGE_BUFFER_SIZE - out->used;
+
+        if (chunk == 0)
+        {
+            image_flush(out);
+            continue;
+        }
+        if (chunk > size)
+            chunk = size;
+        memcpy(out->buf + out->used, src, chunk);
+        out->used += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+}
+
+static inline uint64_t
+image_tell(const image_out *out)
+{
+    return out->offset + out->used;
+}
+
+static void
+image_align(image_out *out)
+{
+    static const unsigned char zeroes[IMAGE_ALIGN];
+    size_t rem = image_tell(out) % IMAGE_ALIGN;
+
+    if (rem != 0)
+        image_put(out, zeroes, IMAGE_ALIGN - rem);
+}
+
+static inline size_t
+image_record_size(const cpeg_term *term)
+{
+    return sizeof(cpeg_term) + term->n_children * sizeof(cpeg_term *);
+}
+
+typedef struct image_writer {
+    uintptr_t base;
+    const cpeg_term_codec *codecs;
+    unsigned n_codecs;
+    uint64_t terms_size;
+    /* Maps every term to its address in the image */
+    cpeg_ptrmap terms;
+    unsigned char *scratch;
+    size_t scratch_size;
+    image_out records;
+    image_out values;
+} image_writer;
+
+static const cpeg_term_codec *
+image_codec(const image_writer *writer, const cpeg_term_type *type)
+{
+    unsigned i;
+
+    for (i = 0; i < writer->n_codecs; i++)
+    {
+        if (writer->codecs[i].type == type)
+            return &writer->codecs[i];
+    }
+    return NULL;
+}
+
+/* Also checks that every type has a codec before anything is written */
+static int
+image_measure(const cpeg_term *term, void *data)
+{
+    image_writer *writer = data;
+
+    if (image_codec(writer, term->type) == NULL)
+        return EINVAL;
+    writer->terms_size += image_record_size(term);
+    return 0;
+}
+
+static void *
+image_put_value(image_writer *writer, const cpeg_term *term)
+{
+    const cpeg_term_codec *codec = image_codec(writer, term->type);
+    uint64_t start;
+    size_t len;
+
+    if (codec->encode == NULL)
+        return NULL;
+
+    len = codec->encode(term->value, writer->scratch, writer->scratch_size);
+    if (len > writer->scratch_size)
+    {
+        writer->scratch_size = len;
+        writer->scratch = cpeg_mem_realloc(writer->scratch, len);
+        len = codec->encode(term->value, writer->scratch,
+                            writer->scratch_size);
+    }
+    start = image_tell(&writer->values);
+    image_put(&writer->values, writer->scratch, len);
+    image_align(&writer->values);
+    return (void *)(writer->base + (uintptr_t)start);
+}
+
+static int
+image_put_term(const cpeg_term *term, void *data)
+{
+    image_writer *writer = data;
+    cpeg_term record;
+    unsigned i;
+
+    memset(&record, 0, sizeof(record));
+    record.type = term->type;
+    record.refcnt = UINT_MAX;
+    record.n_children = term->n_children;
+    record.value = image_put_value(writer, term);
+    *cpeg_ptrmap_insert(&writer->terms, term) =
+        (void *)(writer->base + (uintptr_t)image_tell(&writer->records));
+    if (term->n_children > 0)
+    {
+        record.children = (cpeg_term **)(writer->base +
+                                         (uintptr_t)
+                                         image_tell(&writer->records) +
+                                         sizeof(record));
+    }
+    image_put(&writer->records, &record, sizeof(record));
+
+    for (i = 0; i < term->n_children; i++)
+    {
+        void **addr = cpeg_ptrmap_lookup(&writer->terms, term->children[i]);
+
+        assert(addr != NULL);
+        image_put(&writer->records, addr, sizeof(*addr));
+    }
+    return 0;
+}
+
+bool
+cpeg_term_image_write(int fd, const cpeg_term *term, uintptr_t base,
+                      unsigned n_codecs, const cpeg_term_codec codecs[])
+{
+    image_writer *writer = cpeg_mem_alloc(sizeof(*writer));
+    image_header header;
+    uint64_t terms_size;
+    uint64_t id_start;
+    void **root;
+    unsigned i;
+    int error;
+
+    writer->base = base == 0 ? IMAGE_DEFAULT_BASE : base;
+    assert(writer->base % IMAGE_ALIGN == 0);
+    writer->codecs = codecs;
+    writer->n_codecs = n_codecs;
+    cpeg_ptrmap_init(&writer->terms);
+    writer->scratch = NULL;
+    writer->scratch_size = 0;
+    writer->terms_size = 0;
+
+    error = cpeg_term_traverse_postorder_dag(image_measure, term, writer);
+    if (error != 0)
+    {
+        cpeg_ptrmap_fini(&writer->terms);
+        cpeg_mem_free(writer);
+        errno = error;
+        return false;
+    }
+    terms_size = writer->terms_size;
+    writer->records = (image_out){.fd = fd, .offset = sizeof(header)};
+    writer->values = (image_out){.fd = fd,
+                                 .offset = sizeof(header) + terms_size};
+    cpeg_term_traverse_postorder_dag(image_put_term, term, writer);
+    image_flush(&writer->records);
+    assert(writer->records.error != 0 ||
+           writer->records.offset == sizeof(header) + terms_size);
+
+    /* The type table goes on in the same stream as the values */
+    memset(&header, 0, sizeof(header));
+    header.types_start = image_tell(&writer->values);
+    header.n_types = n_codecs;
+    id_start = header.types_start + n_codecs * sizeof(image_type);
+    for (i = 0; i < n_codecs; i++)
+    {
+        image_type type = {
+            .addr = (uintptr_t)codecs[i].type,
+            .id_start = id_start,
+            .id_len = strlen(codecs[i].type->id)
+        };
+
+        image_put(&writer->values, &type, sizeof(type));
+        id_start += type.id_len;
+    }
+    for (i = 0; i < n_codecs; i++)
+        image_put(&writer->values, codecs[i].type->id,
+                  strlen(codecs[i].type->id));
+    image_align(&writer->values);
+    image_flush(&writer->values);
+
+    root = cpeg_ptrmap_lookup(&writer->terms, term);
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.term_size = sizeof(cpeg_term);
+    header.base = writer->base;
+    header.size = writer->values.offset;
+    header.root = (uintptr_t)*root;
+    header.terms_start = sizeof(header);
+    header.terms_end = sizeof(header) + terms_size;
+    writer->records = (image_out){.fd = fd, .offset = 0,
+                                  .error = writer->records.error != 0 ?
+                                  writer->records.error :
+                                  writer->values.error};
+    image_put(&writer->records, &header, sizeof(header));
+    image_flush(&writer->records);
+    error = writer->records.error;
+
+    cpeg_ptrmap_fini(&writer->terms);
+    cpeg_mem_free(writer->scratch);
+    cpeg_mem_free(writer);
+
+    if (error != 0)
+    {
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+static bool
+image_read_header(int fd, image_header *header)
+{
+    struct stat st;
+    ssize_t rc;
+
+    do
+        rc = pread(fd, header, sizeof(*header), 0);
+    while (rc < 0 && errno == EINTR);
+    if (rc < 0 || fstat(fd, &st) != 0)
+        return false;
+
+    if ((size_t)rc != sizeof(*header) ||
+        memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header->version != IMAGE_VERSION ||
+        header->term_size != sizeof(cpeg_term) ||
+        header->base % IMAGE_ALIGN != 0 ||
+        header->size != (uint64_t)st.st_size ||
+        header->size > SIZE_MAX ||
+        header->terms_start != sizeof(*header) ||
+        header->terms_end > header->size ||
+        header->root < header->base + header->terms_start ||
+        header->root >= header->base + header->terms_end ||
+        header->types_start > header->size ||
+        header->n_types > (header->size - header->types_start) /
+        sizeof(image_type))
+    {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Finds out what the types of the image are in this process;
+ * returns false if some of them are missing from the registry.
+ */
+static bool
+image_map_types(const unsigned char *addr, const image_header *header,
+                unsigned n_codecs, const cpeg_term_codec codecs[],
+                uintptr_t *types, bool *moved)
+{
+    const image_type *table = (const image_type *)(addr + header->types_start);
+    uint64_t i;
+    unsigned j;
+
+    *moved = false;
+    for (i = 0; i < header->n_types; i++)
+    {
+        const char *id = (const char *)addr + table[i].id_start;
+
+        if (table[i].id_start > header->size ||
+            table[i].id_len > header->size - table[i].id_start)
+            return false;
+        for (j = 0; j < n_codecs; j++)
+        {
+            if (strlen(codecs[j].type->id) == table[i].id_len &&
+                memcmp(codecs[j].type->id, id, table[i].id_len) == 0)
+                break;
+        }
+        if (j == n_codecs)
+            return false;
+        types[i] = (uintptr_t)codecs[j].type;
+        /* Usually so unless forked from the writer, given ASLR and PIE */
+        if (types[i] != table[i].addr)
+            *moved = true;
+    }
+    return true;
+}
+
+/* Only writes what changes, so that the other pages stay shared */
+static void
+image_relocate(unsigned char *addr, const image_header *header,
+               const uintptr_t *types)
+{
+    const image_type *table = (const image_type *)(addr + header->types_start);
+    uintptr_t delta = (uintptr_t)addr - (uintptr_t)header->base;
+    uint64_t pos = header->terms_start;
+    uint64_t hint = 0;
+
+    while (pos < header->terms_end)
+    {
+        cpeg_term *term = (cpeg_term *)(addr + pos);
+        unsigned i;
+
+        if (table[hint].addr != (uintptr_t)term->type)
+        {
+            for (hint = 0; table[hint].addr != (uintptr_t)term->type; hint++)
+                assert(hint + 1 < header->n_types);
+        }
+        if ((uintptr_t)term->type != types[hint])
+            term->type = (const cpeg_term_type *)types[hint];
+        if (delta != 0)
+        {
+            if (term->value != NULL)
+                term->value = (void *)((uintptr_t)term->value + delta);
+            if (term->children != NULL)
+            {
+                term->children = (cpeg_term **)((uintptr_t)term->children +
+                                                delta);
+            }
+            for (i = 0; i < term->n_children; i++)
+            {
+                term->children[i] =
+                    (cpeg_term *)((uintptr_t)term->children[i] + delta);
+            }
+        }
+        pos += image_record_size(term);
+    }
+}
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+cpeg_term_image *
+cpeg_term_image_load(int fd, unsigned n_codecs,
+                     const cpeg_term_codec codecs[])
+{
+    cpeg_term_image *image;
+    image_header header;
+    unsigned char *addr;
+    uintptr_t *types;
+    bool moved;
+
+    if (!image_read_header(fd, &header))
+        return NULL;
+
+    addr = mmap((void *)(uintptr_t)header.base, header.size, PROT_READ,
+                MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    if (addr == MAP_FAILED && errno == EEXIST)
+        addr = mmap(NULL, header.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    types = cpeg_mem_alloc((header.n_types + 1) * sizeof(*types));
+    if (!image_map_types(addr, &header, n_codecs, codecs, types, &moved))
+    {
+        cpeg_mem_free(types);
+        munmap(addr, header.size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    image = cpeg_mem_alloc(sizeof(*image));
+    image->addr = addr;
+    image->size = header.size;
+    image->root = (cpeg_term *)(addr + (header.root - header.base));
+    image->pristine = (uintptr_t)addr == header.base && !moved;
+    if (!image->pristine)
+    {
+        /* Pages are only copied once they are actually written */
+        mprotect(addr, header.size, PROT_READ | PROT_WRITE);
+        image_relocate(addr, &header, types);
+        mprotect(addr, header.size, PROT_READ);
+    }
+    cpeg_mem_free(types);
+
+    return image;
+}
+
+cpeg_term *
+cpeg_term_image_root(const cpeg_term_image *image)
+{
+    return image->root;
+}
+
+bool
+cpeg_term_image_pristine(const cpeg_term_image *image)
+{
+    return image->pristine;
+}
+
+void
+cpeg_term_image_unload(cpeg_term_image *image)
+{
+    munmap(image->addr, image->size);
+    cpeg_mem_free(image);
+}
+
+#ifdef LIBCPEG_TESTING
+
+CQC_TESTCASE(test_image_roundtrip,
+             "Image terms are immortal copies with the same sharing, "
+             "wherever the image is mapped")
+{
+    cqc_forall_range(unsigned, depth, 0, 12)
+    {
+        cqc_expect
+        {
+            cpeg_term *t = test_image_dag(depth);
+            FILE *f = tmpfile();
+            cpeg_term_image *image1;
+            cpeg_term_image *image2;
+            cpeg_term_image *image3;
+            const cpeg_term *r;
+
+            cqc_assert(cpeg_term_image_write(fileno(f), t, 0, 1,
+                                             test_image_codecs));
+            image1 = cpeg_term_image_load(fileno(f), 1, test_image_codecs);
+            cqc_assert(image1 != NULL);
+            /* The preferred address is taken by now */
+            image2 = cpeg_term_image_load(fileno(f), 1, test_image_codecs);
+            cqc_assert(image2 != NULL);
+            image3 = cpeg_term_image_load(fileno(f), 1,
+                                          test_image_alias_codecs);
+            cqc_assert(image3 != NULL);
+            fclose(f);
+
+            cqc_assert(!cpeg_term_image_pristine(image2));
+            cqc_assert(!cpeg_term_image_pristine(image3));
+            cqc_assert_eq(int,
+                          cpeg_term_zip(test_image_same, t,
+                                        cpeg_term_image_root(image1), NULL),
+                          0);
+            cqc_assert_eq(int,
+                          cpeg_term_zip(test_image_same, t,
+                                        cpeg_term_image_root(image2), NULL),
+                          0);
+            cqc_assert_eq(int,
+                          cpeg_term_zip(test_image_same, t,
+                                        cpeg_term_image_root(image3), NULL),
+                          0);
+            for (r = cpeg_term_image_root(image3); r->n_children > 0;
+                 r = r->children[0])
+            {
+                cqc_assert(r->type == &test_image_alias);
+                cqc_assert(r->children[0] == r->children[1]);
+            }
+            cqc_assert(r->type == &test_image_alias);
+
+            cpeg_term_image_unload(image1);
+            cpeg_term_image_unload(image2);
+            cpeg_term_image_unload(image3);
+            cpeg_term_free(t);
+        }
+    }
+}
+
+CQC_TESTCASE(test_image_invalid,
+             "Terms and files with unknown types are rejected, and so are "
+             "files that are not images")
+{
+    cqc_forall_range(unsigned, len, 0, 100)
+    {
+        cqc_expect
+        {
+            cpeg_term *t = test_image_dag(3);
+            FILE *f = tmpfile();
+
+            errno = 0;
+            cqc_assert(!cpeg_term_image_write(fileno(f), t, 0, 0, NULL));
+            cqc_assert_eq(int, errno, EINVAL);
+            cqc_assert(!cpeg_term_image_write(fileno(f), t, 0, 1,
+                                              test_image_alias_codecs));
+            cqc_assert_eq(int, errno, EINVAL);
+            cqc_assert(cpeg_term_image_write(fileno(f), t, 0, 1,
+                                             test_image_codecs));
+            cpeg_term_free(t);
+            cqc_assert(cpeg_term_image_load(fileno(f), 0, NULL) == NULL);
+            cqc_assert_eq(int, errno, EINVAL);
+            cqc_assert(ftruncate(fileno(f), len) == 0);
+            cqc_assert(cpeg_term_image_load(fileno(f), 1,
+                                            test_image_codecs) == NULL);
+            cqc_assert_eq(int, errno, EINVAL);
+            fclose(f);
+        }
+    }
+}
+
+#endif
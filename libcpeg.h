@@ -15,6 +15,16 @@ extern "C"
 
 #include "libcpeg_memattr.h"
 #include "libcpeg_terms.h"
+#include "libcpeg_arena.h"
+#include "libcpeg_ptrmap.h"
+#include "libcpeg_parallel.h"
+#include "libcpeg_hashcons.h"
+#include "libcpeg_zipper.h"
+#include "libcpeg_serial.h"
+#include "libcpeg_image.h"
+#include "libcpeg_flat.h"
+#include "libcpeg_succinct.h"
+#include "libcpeg_stats.h"
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,53 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_ARENA_H
+#define LIBCPEG_ARENA_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include "libcpeg_terms.h"
+
+/*
+ * Terms allocated in an arena are immortal (`refcnt == UINT_MAX`) just
+ * like statically declared ones: they are never reclaimed individually,
+ * and all of them are released at once by cpeg_term_arena_reset()
+ * or cpeg_term_arena_destroy(). Type destructors are still called
+ * for arena terms at that point, and references to ordinary
+ * refcounted children are dropped. Attributes set on arena terms
+ * are not released automatically.
+ */
+typedef struct cpeg_term_arena cpeg_term_arena;
+
+extern cpeg_term_arena *cpeg_term_arena_create(size_t chunk_size);
+
+extern void cpeg_term_arena_reset(cpeg_term_arena *arena);
+
+extern void cpeg_term_arena_destroy(cpeg_term_arena *arena);
+
+extern cpeg_term *cpeg_term_new_in(cpeg_term_arena *arena,
+                                   const cpeg_term_type *type,
+                                   void *value, unsigned n_children,
+                                   cpeg_term *children[]);
+
+extern cpeg_term *cpeg_term_fromstr_in(cpeg_term_arena *arena,
+                                       const cpeg_term_type *type,
+                                       const char *value, unsigned n_children,
+                                       cpeg_term *children[]);
+
+extern cpeg_term *cpeg_term_copy_in(cpeg_term_arena *arena,
+                                    const cpeg_term *term);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_ARENA_H */
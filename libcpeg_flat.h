@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_FLAT_H
+#define LIBCPEG_FLAT_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "libcpeg_terms.h"
+
+/*
+ * A flat snapshot lists the terms of a tree in preorder as a set of
+ * parallel arrays, so that read-only passes can scan them linearly.
+ * The subtree of the ith term occupies the indices from i up to
+ * i + sizes[i], so the next sibling of a term is at i + sizes[i].
+ * Shared subterms are listed once per occurrence.
+ *
+ * The snapshot holds a reference to the root, so the terms in
+ * `terms` stay valid, and cpeg_term_cow() users leave them intact.
+ */
+#define CPEG_FLAT_NONE UINT32_MAX
+
+typedef struct cpeg_term_flat {
+    uint32_t n_terms;
+    /* Terms refer to their types by an index into `types` */
+    unsigned n_types;
+    const cpeg_term_type **types;
+    uint32_t *type_ids;
+    void **values;
+    uint32_t *n_children;
+    uint32_t *sizes;
+    /* CPEG_FLAT_NONE for the root */
+    uint32_t *parents;
+    cpeg_term **terms;
+} cpeg_term_flat;
+
+extern cpeg_term_flat *cpeg_term_flatten(const cpeg_term *term);
+
+extern void cpeg_term_flat_free(cpeg_term_flat *flat);
+
+static inline const cpeg_term_type *
+cpeg_term_flat_type(const cpeg_term_flat *flat, uint32_t i)
+{
+    return flat->types[flat->type_ids[i]];
+}
+
+/* Returns CPEG_FLAT_NONE if the type does not occur in the snapshot */
+extern uint32_t cpeg_term_flat_type_id(const cpeg_term_flat *flat,
+                                       const cpeg_term_type *type);
+
+typedef int (*cpeg_term_flat_traverse_fn)(const cpeg_term_flat *, uint32_t,
+                                          void *);
+
+/* Visits the subtree of the ith term in preorder, like the term walks */
+extern int cpeg_term_flat_traverse(cpeg_term_flat_traverse_fn fn,
+                                   const cpeg_term_flat *flat, uint32_t i,
+                                   void *data);
+
+typedef void *(*cpeg_term_flat_reduce_fn)(const cpeg_term_flat *, uint32_t,
+                                          void *[], void *);
+
+extern void *cpeg_term_flat_reduce(cpeg_term_flat_reduce_fn reduce,
+                                   const cpeg_term_flat *flat, void *data);
+
+/*
+ * Returns the first index not less than `from` of a term of the given
+ * type, or `n_terms` if there is none.
+ */
+extern uint32_t cpeg_term_flat_find(const cpeg_term_flat *flat,
+                                    const cpeg_term_type *type,
+                                    uint32_t from);
+
+/*
+ * Stores the indices of all terms of the given type into `found`,
+ * which must have room for `n_terms` of them; returns their number.
+ */
+extern uint32_t cpeg_term_flat_find_all(const cpeg_term_flat *flat,
+                                        const cpeg_term_type *type,
+                                        uint32_t found[]);
+
+/* Like cpeg_term_isomorphic() for the subtrees of the given terms */
+extern bool cpeg_term_flat_isomorphic(const cpeg_term_flat *flat1,
+                                      uint32_t i1,
+                                      const cpeg_term_flat *flat2,
+                                      uint32_t i2);
+
+/*
+ * A hash of the shape of a subtree, which is the same for isomorphic
+ * subtrees. It is not related to cpeg_term_shape_hash().
+ */
+extern uint32_t cpeg_term_flat_shape_hash(const cpeg_term_flat *flat,
+                                          uint32_t i);
+
+/*
+ * The scans over snapshots are vectorized where the CPU allows;
+ * returns the name of the kernels in use ("avx2", "sse4.2" or "scalar").
+ */
+extern const char *cpeg_term_flat_kernels(void);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_FLAT_H */
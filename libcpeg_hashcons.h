@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_HASHCONS_H
+#define LIBCPEG_HASHCONS_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include "libcpeg_terms.h"
+
+/*
+ * A factory interns terms by their type, value and the identity of
+ * their children, so that structurally equal terms built from interned
+ * children are the same term. Values are compared with the `hash` and
+ * `equal` hooks of the type if present, and as pointers otherwise;
+ * the hooks must treat a value the same before and after `init`.
+ *
+ * The factory keeps a reference to every interned term, so they are
+ * never modified in place by cpeg_term_cow() users; grafting onto an
+ * interned term directly breaks the factory. A factory may only be
+ * used from one thread at a time.
+ */
+typedef struct cpeg_term_factory cpeg_term_factory;
+
+extern cpeg_term_factory *cpeg_term_factory_create(void);
+
+extern void cpeg_term_factory_destroy(cpeg_term_factory *factory);
+
+/*
+ * Like cpeg_term_new(), takes over the references to `children`.
+ * If an equal term already exists, `value` is left untouched
+ * (`init` is not called for it) and the existing term is returned.
+ */
+extern cpeg_term *cpeg_term_intern(cpeg_term_factory *factory,
+                                   const cpeg_term_type *type,
+                                   void *value, unsigned n_children,
+                                   cpeg_term *children[]);
+
+/* Drops the terms only referenced by the factory; returns their number */
+extern size_t cpeg_term_factory_gc(cpeg_term_factory *factory);
+
+extern size_t cpeg_term_factory_size(const cpeg_term_factory *factory);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_HASHCONS_H */
@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_IMAGE_H
+#define LIBCPEG_IMAGE_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "libcpeg_terms.h"
+#include "libcpeg_serial.h"
+
+/*
+ * An image is a file holding a term graph laid out as immortal terms,
+ * which is mapped read-only and used in place. Each distinct subterm is
+ * stored once. The value of an image term points to the bytes produced
+ * by the `encode` hook of its codec (NULL if there is none), so images
+ * suit types whose encoding is their representation, such as strings;
+ * `init` and `destroy` are never called for them.
+ *
+ * An image is written for a preferred address. If it can be mapped
+ * there and the types have the same addresses as in the writer, loading
+ * does not touch a single page, so all processes share them. In practice
+ * this means processes forked from the writer or from a common parent:
+ * separately started ones, even of the same binary, have their types
+ * elsewhere when it is position-independent and address randomization
+ * is on, as is the default. Otherwise the pointers are relocated in one
+ * pass over a private mapping, and only the pages that actually change
+ * are copied; when the types have moved, that is every page holding
+ * terms, and only the values stay shared. Images are trusted input:
+ * their contents are not validated beyond the header, and the library
+ * and its users must be built the same way as the writer.
+ */
+typedef struct cpeg_term_image cpeg_term_image;
+
+/*
+ * `base` is the preferred address, 0 for the default one; images
+ * that are used together should have different ones. Returns false
+ * and sets errno on I/O errors, or to EINVAL without writing anything
+ * if the term has types missing from `codecs`.
+ */
+extern bool cpeg_term_image_write(int fd, const cpeg_term *term,
+                                  uintptr_t base, unsigned n_codecs,
+                                  const cpeg_term_codec codecs[]);
+
+/*
+ * Returns NULL and sets errno if the image cannot be mapped
+ * (EINVAL if it is not an image or has types missing from the registry).
+ * The descriptor may be closed afterwards.
+ */
+extern cpeg_term_image *cpeg_term_image_load(int fd, unsigned n_codecs,
+                                             const cpeg_term_codec codecs[]);
+
+extern cpeg_term *cpeg_term_image_root(const cpeg_term_image *image);
+
+/* True if the image has been used in place without relocation */
+extern bool cpeg_term_image_pristine(const cpeg_term_image *image);
+
+/* No terms of the image may be used after that */
+extern void cpeg_term_image_unload(cpeg_term_image *image);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_IMAGE_H */
@@ -30,6 +30,14 @@ extern void cpeg_mem_free(void *addr);
 
 extern void *cpeg_mem_realloc(void *oldaddr, size_t newsize);
 
+/*
+ * Returns as much cached memory as possible to the system: the free
+ * terms (see cpeg_term_cache_trim()), unused space in the attribute
+ * table and, with glibc, free heap pages. Returns the number of
+ * released terms.
+ */
+extern size_t cpeg_mem_trim(void);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
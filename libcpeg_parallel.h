@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_PARALLEL_H
+#define LIBCPEG_PARALLEL_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include "libcpeg_terms.h"
+
+/*
+ * Starts a pool of `n_threads` workers (the number of online CPUs if 0).
+ * Calling it is optional: the parallel functions start a default pool
+ * on the first use.
+ */
+extern void cpeg_parallel_init(unsigned n_threads);
+
+extern void cpeg_parallel_shutdown(void);
+
+/*
+ * Parallel versions of cpeg_term_map() and cpeg_term_reduce().
+ * Subtrees of at least `threshold` nodes are processed as separate
+ * tasks, smaller ones are processed sequentially by the worker that
+ * owns their parent. The results are exactly the same as of the
+ * sequential functions, in particular, `results[]` are always in the
+ * order of children. The callbacks may be run concurrently from
+ * different threads, so they must not modify `data` without
+ * synchronisation, and they may not touch the refcounts of the input
+ * term unless it is shared.
+ */
+extern cpeg_term *cpeg_term_map_parallel(cpeg_term_map_fn map,
+                                         const cpeg_term *term,
+                                         void *data, size_t threshold);
+
+extern void *cpeg_term_reduce_parallel(cpeg_term_reduce_fn reduce,
+                                       const cpeg_term *term,
+                                       void *data, size_t threshold);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_PARALLEL_H */
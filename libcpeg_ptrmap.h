@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_PTRMAP_H
+#define LIBCPEG_PTRMAP_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A simple map from non-NULL addresses to arbitrary pointers,
+ * for bookkeeping that is local to some algorithm. Unlike memory
+ * attributes, it is not shared and not thread-safe.
+ */
+typedef struct cpeg_ptrmap_entry {
+    const void *key;
+    void *value;
+} cpeg_ptrmap_entry;
+
+typedef struct cpeg_ptrmap {
+    cpeg_ptrmap_entry *entries;
+    size_t mask;
+    size_t n_entries;
+} cpeg_ptrmap;
+
+extern void cpeg_ptrmap_init(cpeg_ptrmap *map);
+
+extern void cpeg_ptrmap_fini(cpeg_ptrmap *map);
+
+extern void **cpeg_ptrmap_lookup(const cpeg_ptrmap *map, const void *key);
+
+/*
+ * Returns the location of the value for `key`, adding an entry with
+ * a NULL value if there was none.
+ */
+extern void **cpeg_ptrmap_insert(cpeg_ptrmap *map, const void *key);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_PTRMAP_H */
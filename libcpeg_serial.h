@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_SERIAL_H
+#define LIBCPEG_SERIAL_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "libcpeg_terms.h"
+
+/*
+ * A codec tells how to store the values of a term type. Types are
+ * identified in a stream by their `id`, so a reader may use a different
+ * registry than the writer as long as the ids of the types in use match.
+ *
+ * `encode` stores the encoding of `value` into `buf` if it fits into
+ * `size` bytes and returns its length in any case. `decode` returns a
+ * value to be passed to cpeg_term_new(), so `init` is applied to it;
+ * it may point into `data`, which stays valid until then.
+ * If there are no hooks, the values are not stored and read as NULL.
+ */
+typedef struct cpeg_term_codec {
+    const cpeg_term_type *type;
+    size_t (*encode)(const void *value, void *buf, size_t size);
+    void *(*decode)(const void *data, size_t size);
+} cpeg_term_codec;
+
+/*
+ * Writers and readers work over a file descriptor through a fixed-size
+ * buffer and never recurse, so only the sharing tables grow with
+ * the input. Subterms referenced more than once are stored once:
+ * the writer remembers them for the whole stream, holding a reference
+ * to each, and the reader restores the same sharing. The descriptor
+ * is not closed.
+ */
+typedef struct cpeg_term_writer cpeg_term_writer;
+
+typedef struct cpeg_term_reader cpeg_term_reader;
+
+extern cpeg_term_writer *cpeg_term_writer_open(int fd, unsigned n_codecs,
+                                               const cpeg_term_codec codecs[]);
+
+/*
+ * Returns false and sets errno on I/O errors and for terms of types
+ * missing from the registry (EINVAL). Errors are sticky: nothing more
+ * is written, and the stream may end in the middle of a term.
+ */
+extern bool cpeg_term_write(cpeg_term_writer *writer, const cpeg_term *term);
+
+/* Flushes the buffer; returns false if anything has not been written */
+extern bool cpeg_term_writer_close(cpeg_term_writer *writer);
+
+/* Returns NULL and sets errno if the stream header cannot be read */
+extern cpeg_term_reader *cpeg_term_reader_open(int fd, unsigned n_codecs,
+                                               const cpeg_term_codec codecs[]);
+
+/*
+ * Returns the next term in the stream. At the end of the stream,
+ * returns NULL with errno set to 0; on errors, NULL with errno set
+ * (EINVAL for malformed data or types missing from the registry).
+ */
+extern cpeg_term *cpeg_term_read(cpeg_term_reader *reader);
+
+extern void cpeg_term_reader_close(cpeg_term_reader *reader);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_SERIAL_H */
@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_STATS_H
+#define LIBCPEG_STATS_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include "libcpeg_terms.h"
+
+/*
+ * Snapshots of the internal state of the library, for monitoring.
+ * Term counters are kept per thread without any synchronisation
+ * and summed up when a snapshot is taken, so a snapshot is only
+ * approximately consistent while other threads are running.
+ * Counters named after events only ever grow, rates may be computed
+ * from two snapshots. Terms allocated in arenas are not counted.
+ */
+#define CPEG_STATS_MAX_TYPES 32
+
+typedef struct cpeg_term_type_stats {
+    const cpeg_term_type *type;
+    size_t live;
+} cpeg_term_type_stats;
+
+typedef struct cpeg_term_stats {
+    unsigned long allocated;
+    unsigned long reclaimed;
+    /* Allocations served from a free list vs. from malloc */
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    size_t live;
+    /* Free terms held by thread caches and by the global depot */
+    size_t cached;
+    size_t depot;
+    size_t n_types;
+    cpeg_term_type_stats types[CPEG_STATS_MAX_TYPES];
+    /* Live terms of types that did not fit into `types` */
+    size_t other_live;
+} cpeg_term_stats;
+
+typedef struct cpeg_mem_attr_stats {
+    /* Addresses with attributes and attribute values */
+    size_t objects;
+    size_t values;
+    size_t table_size;
+    /* Non-zero while entries are moved from a smaller table */
+    size_t old_table_size;
+    double load_factor;
+    size_t max_probe;
+} cpeg_mem_attr_stats;
+
+typedef struct cpeg_stats {
+    cpeg_term_stats terms;
+    cpeg_mem_attr_stats attrs;
+} cpeg_stats;
+
+extern void cpeg_term_stats_snapshot(cpeg_term_stats *stats);
+
+/* Scans the whole attribute table with the lock held */
+extern void cpeg_mem_attr_stats_snapshot(cpeg_mem_attr_stats *stats);
+
+static inline void
+cpeg_stats_snapshot(cpeg_stats *stats)
+{
+    cpeg_term_stats_snapshot(&stats->terms);
+    cpeg_mem_attr_stats_snapshot(&stats->attrs);
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_STATS_H */
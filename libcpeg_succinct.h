@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_SUCCINCT_H
+#define LIBCPEG_SUCCINCT_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libcpeg_terms.h"
+
+/*
+ * An archive is a read-only succinct copy of a tree. Its shape is
+ * a balanced parentheses bitvector, two bits per term, with rank and
+ * excess directories on top of it. Types and values are kept once per
+ * distinct pair (as told by the `hash` and `equal` hooks of the type),
+ * and every term has a bit-packed index of its pair. Shared subterms
+ * are stored once per occurrence.
+ *
+ * A term is denoted by the position of its opening parenthesis, the
+ * root being 0. Moving to a child or a sibling and getting the subtree
+ * size take constant time within a 512-bit block; searches that leave
+ * the block go through a min-excess tree over the blocks, which is
+ * logarithmic in their number. The archive owns copies of the values,
+ * made with `init` and released with `destroy`.
+ */
+typedef struct cpeg_term_archive cpeg_term_archive;
+
+#define CPEG_ARCHIVE_NONE SIZE_MAX
+
+extern cpeg_term_archive *cpeg_term_archive_create(const cpeg_term *term);
+
+extern void cpeg_term_archive_destroy(cpeg_term_archive *archive);
+
+/* The number of bytes the archive takes, except for the values */
+extern size_t cpeg_term_archive_memory(const cpeg_term_archive *archive);
+
+extern size_t cpeg_term_archive_n_terms(const cpeg_term_archive *archive);
+
+/* The navigation functions return CPEG_ARCHIVE_NONE where there is none */
+extern size_t cpeg_term_archive_parent(const cpeg_term_archive *archive,
+                                       size_t term);
+
+extern size_t cpeg_term_archive_first_child(const cpeg_term_archive *archive,
+                                            size_t term);
+
+extern size_t cpeg_term_archive_next_sibling(const cpeg_term_archive *archive,
+                                             size_t term);
+
+extern size_t cpeg_term_archive_subtree_size(const cpeg_term_archive *archive,
+                                             size_t term);
+
+/* Preorder numbers of terms and back */
+extern size_t cpeg_term_archive_index(const cpeg_term_archive *archive,
+                                      size_t term);
+
+extern size_t cpeg_term_archive_term(const cpeg_term_archive *archive,
+                                     size_t index);
+
+extern const cpeg_term_type *
+cpeg_term_archive_type(const cpeg_term_archive *archive, size_t term);
+
+extern void *cpeg_term_archive_value(const cpeg_term_archive *archive,
+                                     size_t term);
+
+/* Makes an ordinary term out of the subtree of `term` */
+extern cpeg_term *cpeg_term_archive_extract(const cpeg_term_archive *archive,
+                                            size_t term);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_SUCCINCT_H */
@@ -24,22 +24,66 @@ typedef struct cpeg_term_type {
     void *(*init)(void *);
     void *(*fromstr)(const char *);
     void (*destroy)(void *);
+    /* Optional; values are compared as pointers if absent */
+    size_t (*hash)(const void *);
+    bool (*equal)(const void *, const void *);
 } cpeg_term_type;
 
+/*
+ * When built with LIBCPEG_TERM_METRICS, every term caches a few
+ * properties of its subtree; `size` is 0 for terms that do not have
+ * them (static and foreign ones), which are then walked on demand.
+ * The library and its users must be built with the same setting.
+ */
+typedef struct cpeg_term_metrics {
+    size_t size;
+    size_t shape_hash;
+    unsigned height;
+    /* Set when `shape_hash` must be recomputed from the children */
+    bool stale_shape;
+    struct cpeg_term *leftmost;
+    struct cpeg_term *rightmost;
+    /* When the metrics were computed; see cpeg_term_size() */
+    size_t epoch;
+    /* The term whose metrics include this one, if it is the only one */
+    struct cpeg_term *parent;
+} cpeg_term_metrics;
+
+/*
+ * Heap-allocated terms keep their children right after the header,
+ * in `inline_children`, and `children` points there. When a term
+ * outgrows its inline `capacity`, its children are moved to a separate
+ * array, so `children` is the only valid way to access them.
+ */
 typedef struct cpeg_term {
     const cpeg_term_type *type;
     unsigned refcnt;
-    void *value;
     unsigned n_children;
+    void *value;
     cpeg_term **children;
+    unsigned capacity;
+    unsigned flags;
+#ifdef LIBCPEG_TERM_METRICS
+    cpeg_term_metrics metrics;
+#endif
+    cpeg_term *inline_children[];
 } cpeg_term;
 
+/* The size class a term was allocated from; 0 for terms not pooled */
+#define CPEG_TERM_CLASS_MASK 0xffu
+/* The term may be referenced from several threads, see cpeg_term_share() */
+#define CPEG_TERM_SHARED 0x100u
+/* The term may have memoized results, see cpeg_term_memo_reduce() */
+#define CPEG_TERM_MEMOIZED 0x200u
+
 #define CPEG_TERM_LEAF(_type, _value) \
     (&(cpeg_term){.type = &(_type),   \
             .refcnt = UINT_MAX,       \
             .value = (_value),        \
             .n_children = 0,          \
-            .children = NULL})
+            .children = NULL,         \
+            .capacity = 0,            \
+            .flags = 0})
 
 #define CPEG_TERM_NODE(_type, _value, ...)              \
     (&(cpeg_term){.type = &(_type),                     \
@@ -48,7 +92,9 @@ typedef struct cpeg_term {
             .n_children =                               \
             sizeof((cpeg_term *[]){__VA_ARGS__}) /      \
             sizeof(cpeg_term *),                        \
-            .children = (cpeg_term *[]){__VA_ARGS__}})
+            .children = (cpeg_term *[]){__VA_ARGS__},   \
+            .capacity = 0,                              \
+            .flags = 0})
 
 extern cpeg_term *cpeg_term_new(const cpeg_term_type *type,
                                 void *value, unsigned n_children,
@@ -64,31 +110,162 @@ extern cpeg_term *cpeg_term_fromstr(const cpeg_term_type *type,
 extern cpeg_term *cpeg_term_fromstrl(const cpeg_term_type *type,
                                      const char *value, ...);
 
+/*
+ * A builder accumulates children in a reusable scratch buffer, so that
+ * a node with any number of children is allocated once. Nested nodes
+ * may share a builder: a node is made of the children added since the
+ * mark taken before the first of them. The builder owns the references
+ * to the children it holds.
+ */
+typedef struct cpeg_term_builder {
+    cpeg_term **children;
+    unsigned n_children;
+    unsigned capacity;
+} cpeg_term_builder;
+
+extern void cpeg_term_builder_init(cpeg_term_builder *builder);
+
+extern void cpeg_term_builder_fini(cpeg_term_builder *builder);
+
+extern void cpeg_term_builder_grow(cpeg_term_builder *builder);
+
+static inline unsigned
+cpeg_term_builder_mark(const cpeg_term_builder *builder)
+{
+    return builder->n_children;
+}
+
+static inline void
+cpeg_term_builder_add(cpeg_term_builder *builder, cpeg_term *child)
+{
+    if (builder->n_children == builder->capacity)
+        cpeg_term_builder_grow(builder);
+    builder->children[builder->n_children++] = child;
+}
+
+/* Drops the children added since `mark` */
+extern void cpeg_term_builder_rewind(cpeg_term_builder *builder,
+                                     unsigned mark);
 
+extern cpeg_term *cpeg_term_builder_finish(cpeg_term_builder *builder,
+                                           unsigned mark,
+                                           const cpeg_term_type *type,
+                                           void *value);
+
+/*
+ * Refcounts of terms owned by a single thread are updated without any
+ * synchronisation. Shared terms are never immortal, so the flag is
+ * checked first and `refcnt` is only ever accessed atomically for them.
+ */
 static inline cpeg_term *
 cpeg_term_use(cpeg_term *term)
 {
-    if (term != NULL && term->refcnt != UINT_MAX)
+    if (term == NULL)
+        return NULL;
+
+    if (term->flags & CPEG_TERM_SHARED)
+        __atomic_fetch_add(&term->refcnt, 1, __ATOMIC_RELAXED);
+    else if (term->refcnt != UINT_MAX)
         term->refcnt++;
     return term;
 }
 
 extern void cpeg_term_reclaim(cpeg_term *term);
 
+/*
+ * By default, the thread that drops the last reference to a term
+ * reclaims the whole subtree at once. In the deferred mode, only the
+ * root is destroyed right away and the rest is reclaimed by calls to
+ * cpeg_term_reclaim_step() on the same thread, `budget` nodes and
+ * child references at a time; it returns true while there is work
+ * left. In the background mode, the rest is reclaimed by a separate
+ * thread, so destructors of subterms run there; terms released that
+ * way must not have unshared subterms still used elsewhere.
+ * The mode is set per thread and the previous one is returned.
+ */
+typedef enum cpeg_reclaim_mode {
+    CPEG_RECLAIM_IMMEDIATE,
+    CPEG_RECLAIM_DEFERRED,
+    CPEG_RECLAIM_BACKGROUND
+} cpeg_reclaim_mode;
+
+extern cpeg_reclaim_mode cpeg_term_reclaim_mode(cpeg_reclaim_mode mode);
+
+extern bool cpeg_term_reclaim_step(size_t budget);
+
+/* Waits until the background reclaimer has nothing to do */
+extern void cpeg_term_reclaim_wait(void);
+
+/*
+ * Free terms are cached for reuse: a few hundred of each size
+ * per thread, and up to `n_terms` of each size in a global depot
+ * (16384 by default); the excess goes back to malloc.
+ */
+extern void cpeg_term_cache_limit(size_t n_terms);
+
+/*
+ * Releases all free terms cached by the calling thread and by the
+ * depot, returns their number. The caches of other threads are kept.
+ */
+extern size_t cpeg_term_cache_trim(void);
+
 static inline void
 cpeg_term_free(cpeg_term *term)
 {
-    if (term != NULL && term->refcnt != UINT_MAX &&
-        term->refcnt-- <= 1)
+    if (term == NULL)
+        return;
+
+    if (term->flags & CPEG_TERM_SHARED)
+    {
+        if (__atomic_fetch_sub(&term->refcnt, 1, __ATOMIC_ACQ_REL) <= 1)
+            cpeg_term_reclaim(term);
+    }
+    else if (term->refcnt != UINT_MAX && term->refcnt-- <= 1)
     {
         cpeg_term_reclaim(term);
     }
 }
 
+/*
+ * Switches the term and all its subterms to atomic reference counting.
+ * This must be done by the owning thread before the term is made
+ * visible to other threads. Immortal terms are left as they are, but
+ * the walk goes through them. Terms later grafted or glued into
+ * a shared term are switched as well.
+ */
+extern cpeg_term *cpeg_term_share(cpeg_term *term);
+
 extern cpeg_term *cpeg_term_leftmost(cpeg_term *term);
 
 extern cpeg_term *cpeg_term_rightmost(cpeg_term *term);
 
+/*
+ * The number of nodes, the length of the longest path to a leaf and
+ * a hash of the shape of a term; terms that are isomorphic in the
+ * sense of cpeg_term_isomorphic() have the same shape hash.
+ * These are O(1) with cached metrics and walk the term otherwise.
+ *
+ * Cached metrics are updated by the functions that change a term.
+ * A term remembers the parent whose metrics include it, so changing
+ * a term that is already attached marks the metrics of its ancestors
+ * as stale, and they are recomputed on next use. The ancestors of
+ * shared terms, and of terms included in the metrics of several terms
+ * or of immortal ones, are not known: changing them makes all the
+ * metrics computed so far stale. Shared and immortal terms with stale
+ * metrics are walked instead. Modifying terms before they are attached,
+ * as the copy-on-write discipline implies anyway, keeps these functions
+ * O(1). Code changing `children` directly must call cpeg_term_refresh()
+ * afterwards, and may not change the children it takes out in place
+ * once the term is freed.
+ */
+extern size_t cpeg_term_size(const cpeg_term *term);
+
+extern unsigned cpeg_term_height(const cpeg_term *term);
+
+extern size_t cpeg_term_shape_hash(const cpeg_term *term);
+
+extern void cpeg_term_refresh(cpeg_term *term);
+
 extern cpeg_term *cpeg_term_copy(const cpeg_term *term);
 
 extern cpeg_term *cpeg_term_deep_copy(const cpeg_term *term);
@@ -96,7 +273,12 @@ extern cpeg_term *cpeg_term_deep_copy(const cpeg_term *term);
 static inline cpeg_term *
 cpeg_term_cow(cpeg_term *term)
 {
-    if (term == NULL || term->refcnt == 1)
+    if (term == NULL)
+        return NULL;
+
+    if ((term->flags & CPEG_TERM_SHARED) ?
+        __atomic_load_n(&term->refcnt, __ATOMIC_ACQUIRE) == 1 :
+        term->refcnt == 1)
         return term;
 
     return cpeg_term_copy(term);
@@ -135,12 +317,94 @@ typedef cpeg_term *(*cpeg_term_map_fn)(const cpeg_term *, void *);
 extern cpeg_term *cpeg_term_map(cpeg_term_map_fn map, const cpeg_term *term,
                                 void *data);
 
+/*
+ * One step of cpeg_term_map() in the shape of a reduce function, for
+ * other traversals to share: `children` are the mapped children, which
+ * the result takes over, and `data` points to a cpeg_term_map_closure.
+ */
+typedef struct cpeg_term_map_closure {
+    cpeg_term_map_fn map;
+    void *data;
+} cpeg_term_map_closure;
+
+extern void *cpeg_term_map_node(const cpeg_term *term, void *children[],
+                                void *data);
+
+/*
+ * Like cpeg_term_map(), but NULL or the term itself, without a new
+ * reference, keeps a term as it is: if none of its children have
+ * changed, the result is the original term with a new reference rather
+ * than a copy, so only the ancestors of replaced terms are reallocated.
+ */
+extern cpeg_term *cpeg_term_rewrite(cpeg_term_map_fn map,
+                                    const cpeg_term *term, void *data);
 
 typedef void *(*cpeg_term_reduce_fn)(const cpeg_term *, void *[], void *);
 
 extern void *cpeg_term_reduce(cpeg_term_reduce_fn reduce, const cpeg_term *term,
                               void *data);
 
+/*
+ * The `_dag` variants treat a term as a graph: a subterm referenced more
+ * than once is visited once however many paths lead to it, and its
+ * result is reused (the mapped term is shared). So the deep copy
+ * preserves sharing, and the cost is linear in the number of distinct
+ * subterms rather than of paths, plus a hash lookup per shared one.
+ * The zip visits each distinct pair of subterms once, so a subterm
+ * paired with several others is visited once with each of them.
+ */
+extern cpeg_term *cpeg_term_deep_copy_dag(const cpeg_term *term);
+
+extern int cpeg_term_traverse_preorder_dag(cpeg_term_traverse_fn fn,
+                                           const cpeg_term *term,
+                                           void *data);
+
+extern int cpeg_term_traverse_postorder_dag(cpeg_term_traverse_fn fn,
+                                            const cpeg_term *term,
+                                            void *data);
+
+extern int cpeg_term_zip_dag(cpeg_term_zip_fn fn,
+                             const cpeg_term *term1, const cpeg_term *term2,
+                             void *data);
+
+extern cpeg_term *cpeg_term_map_dag(cpeg_term_map_fn map,
+                                    const cpeg_term *term, void *data);
+
+extern void *cpeg_term_reduce_dag(cpeg_term_reduce_fn reduce,
+                                  const cpeg_term *term, void *data);
+
+/*
+ * A memo keeps the result of `reduce` for every subterm it has seen,
+ * so that a repeated reduce only recomputes the subterms that are new
+ * or have been modified since. Results are attached to terms as
+ * attributes, so they are dropped along with the terms.
+ *
+ * Grafting, gluing, pruning or refreshing a term forgets the results
+ * for it and for all its ancestors known to any memo, even if the term
+ * has been modified in place while attached. Results are owned by the
+ * memo: those passed to `reduce` and the one returned are only valid
+ * until the next edit, and `release`, if not NULL, is called for each
+ * dropped result, possibly in the thread that frees the term.
+ * A memo may only be used by one thread at a time, and memoized terms
+ * may not be used by other threads meanwhile. The results of
+ * a destroyed memo are released when their terms are freed or edited.
+ *
+ * Immortal terms are never memoized, nor are the terms above them
+ * if any term below them may be edited: their results are recomputed
+ * on each call and are only valid until the next call with the same
+ * memo. Immortal terms themselves may not be edited.
+ */
+typedef struct cpeg_term_memo cpeg_term_memo;
+
+extern cpeg_term_memo *cpeg_term_memo_create(cpeg_term_reduce_fn reduce,
+                                             void *data,
+                                             void (*release)(void *));
+
+extern void cpeg_term_memo_destroy(cpeg_term_memo *memo);
+
+extern void *cpeg_term_memo_reduce(cpeg_term_memo *memo,
+                                   const cpeg_term *term);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
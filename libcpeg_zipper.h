@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2020, Artem V. Andreev
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+
+#ifndef LIBCPEG_ZIPPER_H
+#define LIBCPEG_ZIPPER_H 1
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdbool.h>
+#include "libcpeg_terms.h"
+
+/*
+ * A zipper is a cursor into a term that remembers the path from the
+ * root. Replacing the focus does not touch the original tree: when the
+ * cursor moves up, only the nodes on the path are copied (or updated in
+ * place if the zipper holds the only reference to them), and all other
+ * subterms are shared. A zipper holds a reference to the focus and to
+ * every node on the path.
+ */
+typedef struct cpeg_term_zipper_frame {
+    cpeg_term *parent;
+    unsigned pos;
+} cpeg_term_zipper_frame;
+
+typedef struct cpeg_term_zipper {
+    cpeg_term *focus;
+    cpeg_term_zipper_frame *path;
+    unsigned depth;
+    unsigned capacity;
+} cpeg_term_zipper;
+
+extern void cpeg_term_zipper_init(cpeg_term_zipper *zipper, cpeg_term *root);
+
+extern void cpeg_term_zipper_fini(cpeg_term_zipper *zipper);
+
+static inline cpeg_term *
+cpeg_term_zipper_focus(const cpeg_term_zipper *zipper)
+{
+    return zipper->focus;
+}
+
+/* The movements return false and do nothing if there is nowhere to go */
+extern bool cpeg_term_zipper_down(cpeg_term_zipper *zipper, unsigned pos);
+
+extern bool cpeg_term_zipper_up(cpeg_term_zipper *zipper);
+
+extern bool cpeg_term_zipper_left(cpeg_term_zipper *zipper);
+
+extern bool cpeg_term_zipper_right(cpeg_term_zipper *zipper);
+
+/* Takes over the reference to `term` */
+extern void cpeg_term_zipper_replace(cpeg_term_zipper *zipper,
+                                     cpeg_term *term);
+
+/*
+ * Moves the cursor to the root and returns a new reference to it;
+ * the zipper may be used for further edits.
+ */
+extern cpeg_term *cpeg_term_zipper_root(cpeg_term_zipper *zipper);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LIBCPEG_ZIPPER_H */
@@ -1,9 +1,15 @@
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <inttypes.h>
-#include <sys/queue.h>
+#include <limits.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <pthread.h>
 #include "libcpeg_memattr.h"
 #include "libcpeg_terms.h"
+#include "libcpeg_stats.h"
 #ifdef LIBCPEG_TESTING
 #include "cqc.h"
 #endif
@@ -57,122 +63,413 @@ cpeg_mem_alloc(size_t size)
 
 struct cpeg_term;
 
-#define ATTR_HASH_TABLE_SIZE 65537
-
-typedef struct mem_attr_value {
+/*
+ * Attributes are kept in an open-addressing table with linear probing,
+ * keyed by the address. Each slot fills a cache line and holds up to
+ * MEM_ATTR_INLINE attributes; only addresses with more attributes than
+ * that get an overflow array. A slot is occupied iff its first pair
+ * has a value; pairs are kept packed, inline ones first.
+ */
+#define MEM_ATTR_INLINE 3
+#define MEM_ATTR_MIN_TABLE_SIZE 64
+#define MEM_ATTR_MIGRATE_STEP 8
+
+typedef struct mem_attr_pair {
     const void *attr;
     cpeg_term *term;
-    SLIST_ENTRY(mem_attr_value) entry;
-} mem_attr_value;
+} mem_attr_pair;
 
-typedef struct mem_attr_cell {
+typedef struct mem_attr_overflow {
+    unsigned n_pairs;
+    unsigned capacity;
+    mem_attr_pair pairs[];
+} mem_attr_overflow;
+
+typedef struct mem_attr_slot {
     const void *addr;
-    SLIST_HEAD(, mem_attr_value) values;
-    LIST_ENTRY(mem_attr_cell) entry;
-} mem_attr_cell;
+    mem_attr_overflow *overflow;
+    mem_attr_pair pairs[MEM_ATTR_INLINE];
+} mem_attr_slot;
+
+typedef struct mem_attr_table {
+    mem_attr_slot *slots;
+    size_t mask;
+    size_t used;
+} mem_attr_table;
+
+/*
+ * When the table grows, entries are moved from the old table to the new
+ * one a few clusters at a time on each subsequent operation, starting
+ * from an empty slot. Since whole clusters are moved, an entry is always
+ * found either in the cluster of its home slot in the old table, or
+ * in the new one.
+ */
+static mem_attr_table attr_table;
+static mem_attr_table attr_old_table;
+static size_t attr_migrate_pos;
+static size_t attr_migrate_left;
+
+/*
+ * The table is shared between threads and protected by a single lock.
+ * Attribute values are never released with the lock held, since that
+ * may reenter the table.
+ */
+static pthread_mutex_t mem_attr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t
+mem_addr_hash(const void *addr)
+{
+    uint64_t val = (uintptr_t)addr * UINT64_C(0x9e3779b97f4a7c15);
 
-static LIST_HEAD(, mem_attr_cell) addr_hash_table[ATTR_HASH_TABLE_SIZE];
+    return (size_t)(val >> 32 ^ val);
+}
 
-static unsigned
-mem_addr_hash(const void *addr)
+/*
+ * A counting filter of addresses that have attributes, so that the
+ * table need not be locked and probed for the vast majority of objects
+ * that never get any. Counters are only changed under the lock and
+ * saturate, so a filter entry may only err on the side of presence.
+ */
+#define MEM_ATTR_FILTER_BITS 16
+
+static uint8_t attr_filter[1u << MEM_ATTR_FILTER_BITS];
+
+static inline uint8_t *
+mem_attr_filter_entry(const void *addr)
+{
+    return &attr_filter[mem_addr_hash(addr) >> (sizeof(size_t) * CHAR_BIT -
+                                                MEM_ATTR_FILTER_BITS)];
+}
+
+static inline bool
+mem_attr_maybe_present(const void *addr)
+{
+    return __atomic_load_n(mem_attr_filter_entry(addr),
+                           __ATOMIC_RELAXED) != 0;
+}
+
+static void
+mem_attr_filter_update(const void *addr, int delta)
 {
-    uintptr_t val = (uintptr_t)addr;
+    uint8_t *entry = mem_attr_filter_entry(addr);
+    uint8_t count = *entry;
 
-    return (val / sizeof(double)) % ATTR_HASH_TABLE_SIZE;
+    if (count == UINT8_MAX)
+        return;
+    __atomic_store_n(entry, count + delta, __ATOMIC_RELAXED);
 }
 
-static LIST_HEAD(, mem_attr_cell) cell_free_list =
-    LIST_HEAD_INITIALIZER(cell_free_list);
-static SLIST_HEAD(, mem_attr_value) attr_val_free_list =
-    SLIST_HEAD_INITIALIZER(attr_val_free_list);
+static inline bool
+mem_attr_slot_used(const mem_attr_slot *slot)
+{
+    return slot->pairs[0].term != NULL;
+}
 
-static mem_attr_value *
-mem_attr_value_alloc(const void *attr)
+static mem_attr_slot *
+mem_attr_table_find(const mem_attr_table *table, const void *addr)
 {
-    mem_attr_value *v = NULL;
+    size_t i;
 
-    if (SLIST_EMPTY(&attr_val_free_list))
-        v = malloc(sizeof(*v));
-    else
+    if (table->slots == NULL)
+        return NULL;
+
+    for (i = mem_addr_hash(addr) & table->mask;
+         mem_attr_slot_used(&table->slots[i]);
+         i = (i + 1) & table->mask)
     {
-        v = SLIST_FIRST(&attr_val_free_list);
-        SLIST_REMOVE_HEAD(&attr_val_free_list, entry);
+        if (table->slots[i].addr == addr)
+            return &table->slots[i];
     }
-    assert(v != NULL);
+    return NULL;
+}
 
-    v->attr = attr;
-    v->term = NULL;
-    return v;
+/* The address must not be present in the table */
+static mem_attr_slot *
+mem_attr_table_insert(mem_attr_table *table, const mem_attr_slot *src)
+{
+    size_t i;
+
+    for (i = mem_addr_hash(src->addr) & table->mask;
+         mem_attr_slot_used(&table->slots[i]);
+         i = (i + 1) & table->mask)
+        ;
+    table->slots[i] = *src;
+    table->used++;
+    return &table->slots[i];
 }
 
-static mem_attr_cell *
-mem_attr_find_cell(const void *addr, bool add)
+static void
+mem_attr_table_remove(mem_attr_table *table, mem_attr_slot *slot)
 {
-    unsigned h = mem_addr_hash(addr);
-    mem_attr_cell *cell;
+    size_t i = (size_t)(slot - table->slots);
+    size_t j = i;
 
-    LIST_FOREACH(cell, &addr_hash_table[h], entry)
+    /* backward shift deletion, so that no tombstones are needed */
+    for (;;)
     {
-        if (cell->addr == addr)
-            return cell;
+        size_t home;
+
+        j = (j + 1) & table->mask;
+        if (!mem_attr_slot_used(&table->slots[j]))
+            break;
+        home = mem_addr_hash(table->slots[j].addr) & table->mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        table->slots[i] = table->slots[j];
+        i = j;
     }
-    if (!add)
-        return NULL;
+    table->slots[i].pairs[0].term = NULL;
+    table->used--;
+}
 
-    if (LIST_EMPTY(&cell_free_list))
-        cell = malloc(sizeof(*cell));
-    else
+static mem_attr_slot *
+mem_attr_alloc_slots(size_t n)
+{
+    mem_attr_slot *slots = aligned_alloc(sizeof(*slots), n * sizeof(*slots));
+    size_t i;
+
+    assert(slots != NULL);
+    for (i = 0; i < n; i++)
+        slots[i].pairs[0].term = NULL;
+    return slots;
+}
+
+static void
+mem_attr_migrate(size_t n)
+{
+    mem_attr_table *old = &attr_old_table;
+
+    while (attr_migrate_left > 0)
     {
-        cell = LIST_FIRST(&cell_free_list);
-        LIST_REMOVE(cell, entry);
+        mem_attr_slot *slot = &old->slots[attr_migrate_pos];
+
+        if (mem_attr_slot_used(slot))
+        {
+            mem_attr_table_insert(&attr_table, slot);
+            slot->pairs[0].term = NULL;
+            old->used--;
+        }
+        else if (n == 0)
+            break;
+        else
+            n--;
+        attr_migrate_pos = (attr_migrate_pos + 1) & old->mask;
+        attr_migrate_left--;
     }
-    assert(cell != NULL);
-    cell->addr = addr;
-    SLIST_INIT(&cell->values);
-    LIST_INSERT_HEAD(&addr_hash_table[h], cell, entry);
+    if (attr_migrate_left == 0 && old->slots != NULL)
+    {
+        assert(old->used == 0);
+        free(old->slots);
+        old->slots = NULL;
+    }
+}
+
+static void
+mem_attr_grow(void)
+{
+    size_t size = attr_table.slots == NULL ? MEM_ATTR_MIN_TABLE_SIZE :
+        (attr_table.mask + 1) * 2;
+
+    if (attr_old_table.slots != NULL)
+        mem_attr_migrate(SIZE_MAX);
 
-    return cell;
+    attr_old_table = attr_table;
+    attr_table.slots = mem_attr_alloc_slots(size);
+    attr_table.mask = size - 1;
+    attr_table.used = 0;
+
+    if (attr_old_table.slots != NULL)
+    {
+        size_t start = 0;
+
+        while (mem_attr_slot_used(&attr_old_table.slots[start]))
+            start++;
+        attr_migrate_pos = (start + 1) & attr_old_table.mask;
+        attr_migrate_left = attr_old_table.mask;
+        mem_attr_migrate(0);
+    }
 }
 
-static mem_attr_value *
-mem_attr_access(const void *addr, const void *attr, bool add)
+static mem_attr_slot *
+mem_attr_find_slot(const void *addr)
 {
-    mem_attr_cell *cell = mem_attr_find_cell(addr, add);
-    mem_attr_value *v;
+    mem_attr_slot *slot;
 
-    /* this may only happen if `add` is false */
-    if (cell == NULL)
-        return NULL;
+    if (attr_old_table.slots != NULL)
+        mem_attr_migrate(MEM_ATTR_MIGRATE_STEP);
+
+    slot = mem_attr_table_find(&attr_table, addr);
+    if (slot == NULL && attr_old_table.slots != NULL)
+        slot = mem_attr_table_find(&attr_old_table, addr);
+    return slot;
+}
+
+static void
+mem_attr_remove_slot(mem_attr_slot *slot)
+{
+    mem_attr_filter_update(slot->addr, -1);
+    if (attr_old_table.slots != NULL &&
+        slot >= attr_old_table.slots &&
+        slot <= &attr_old_table.slots[attr_old_table.mask])
+        mem_attr_table_remove(&attr_old_table, slot);
+    else
+        mem_attr_table_remove(&attr_table, slot);
+}
+
+static mem_attr_slot *
+mem_attr_add_slot(const mem_attr_slot *src)
+{
+    if ((attr_table.used + attr_old_table.used + 1) * 2 >
+        (attr_table.slots == NULL ? 0 : attr_table.mask + 1))
+        mem_attr_grow();
+
+    mem_attr_filter_update(src->addr, 1);
+    return mem_attr_table_insert(&attr_table, src);
+}
+
+static mem_attr_pair *
+mem_attr_find_pair(mem_attr_slot *slot, const void *attr)
+{
+    unsigned i;
+
+    for (i = 0; i < MEM_ATTR_INLINE && slot->pairs[i].term != NULL; i++)
+    {
+        if (slot->pairs[i].attr == attr)
+            return &slot->pairs[i];
+    }
+    if (slot->overflow != NULL)
+    {
+        for (i = 0; i < slot->overflow->n_pairs; i++)
+        {
+            if (slot->overflow->pairs[i].attr == attr)
+                return &slot->overflow->pairs[i];
+        }
+    }
+    return NULL;
+}
 
-    SLIST_FOREACH(v, &cell->values, entry)
+static void
+mem_attr_add_pair(mem_attr_slot *slot, const void *attr, cpeg_term *term)
+{
+    mem_attr_overflow *ovf = slot->overflow;
+    unsigned i;
+
+    for (i = 0; i < MEM_ATTR_INLINE; i++)
     {
-        if (v->attr == attr)
-            return v;
+        if (slot->pairs[i].term == NULL)
+        {
+            slot->pairs[i].attr = attr;
+            slot->pairs[i].term = term;
+            return;
+        }
     }
-    if (add)
+    if (ovf == NULL || ovf->n_pairs == ovf->capacity)
     {
-        v = mem_attr_value_alloc(attr);
-        SLIST_INSERT_HEAD(&cell->values, v, entry);
+        unsigned capacity = ovf == NULL ? MEM_ATTR_INLINE + 1 :
+            ovf->capacity * 2;
+
+        ovf = realloc(ovf, sizeof(*ovf) + capacity * sizeof(*ovf->pairs));
+        assert(ovf != NULL);
+        if (slot->overflow == NULL)
+            ovf->n_pairs = 0;
+        ovf->capacity = capacity;
+        slot->overflow = ovf;
     }
-    return v;
+    ovf->pairs[ovf->n_pairs].attr = attr;
+    ovf->pairs[ovf->n_pairs].term = term;
+    ovf->n_pairs++;
+}
+
+/* Keeps the pairs packed; may remove the slot altogether */
+static void
+mem_attr_remove_pair(mem_attr_slot *slot, mem_attr_pair *pair)
+{
+    mem_attr_overflow *ovf = slot->overflow;
+    mem_attr_pair *last;
+
+    if (ovf != NULL)
+    {
+        last = &ovf->pairs[--ovf->n_pairs];
+        if (ovf->n_pairs == 0)
+            slot->overflow = NULL;
+    }
+    else
+    {
+        unsigned i;
+
+        for (i = MEM_ATTR_INLINE; slot->pairs[i - 1].term == NULL; i--)
+            ;
+        last = &slot->pairs[i - 1];
+    }
+    *pair = *last;
+    last->term = NULL;
+    if (slot->overflow == NULL)
+        free(ovf);
+
+    if (!mem_attr_slot_used(slot))
+        mem_attr_remove_slot(slot);
 }
 
 cpeg_term *
 cpeg_mem_attr_get(const void *addr, const void *attr)
 {
-    mem_attr_value *v = mem_attr_access(addr, attr, false);
+    mem_attr_slot *slot;
+    mem_attr_pair *pair = NULL;
+    cpeg_term *term = NULL;
 
-    return v == NULL ? NULL : v->term;
+    if (!mem_attr_maybe_present(addr))
+        return NULL;
+
+    pthread_mutex_lock(&mem_attr_lock);
+    slot = mem_attr_find_slot(addr);
+    if (slot != NULL)
+        pair = mem_attr_find_pair(slot, attr);
+    if (pair != NULL)
+        term = pair->term;
+    pthread_mutex_unlock(&mem_attr_lock);
+
+    return term;
 }
 
 void
 cpeg_mem_attr_set(const void *addr, const void *attr, cpeg_term *val)
 {
-    mem_attr_value *v = mem_attr_access(addr, attr, true);
+    mem_attr_slot *slot;
+    mem_attr_pair *pair = NULL;
+    cpeg_term *old = NULL;
+
+    pthread_mutex_lock(&mem_attr_lock);
+    slot = mem_attr_find_slot(addr);
+    if (slot != NULL)
+        pair = mem_attr_find_pair(slot, attr);
+    if (pair != NULL)
+    {
+        old = pair->term;
+        if (val != NULL)
+            pair->term = val;
+        else
+            mem_attr_remove_pair(slot, pair);
+    }
+    else if (val != NULL)
+    {
+        if (slot == NULL)
+        {
+            mem_attr_slot new_slot = {
+                .addr = addr,
+                .overflow = NULL,
+                .pairs = {{.attr = attr, .term = val}}
+            };
 
-    assert(v != NULL);
-    cpeg_term_free(v->term);
-    v->term = val;
+            mem_attr_add_slot(&new_slot);
+        }
+        else
+        {
+            mem_attr_add_pair(slot, attr, val);
+        }
+    }
+    pthread_mutex_unlock(&mem_attr_lock);
+
+    cpeg_term_free(old);
 }
 
 #ifdef LIBCPEG_TESTING
@@ -264,25 +561,50 @@ CQC_TESTCASE(test_set_get_unaligned,
 
 #endif
 
+/* Must be called without the lock held */
 static void
-mem_release_attrs(mem_attr_cell *cell)
+mem_release_attrs(mem_attr_slot *slot)
 {
-    while (!SLIST_EMPTY(&cell->values))
+    unsigned i;
+
+    for (i = 0; i < MEM_ATTR_INLINE && slot->pairs[i].term != NULL; i++)
+        cpeg_term_free(slot->pairs[i].term);
+    if (slot->overflow != NULL)
     {
-        mem_attr_value *v = SLIST_FIRST(&cell->values);
-        cpeg_term_free(v->term);
-        SLIST_REMOVE_HEAD(&cell->values, entry);
-        SLIST_INSERT_HEAD(&attr_val_free_list, v, entry);
+        for (i = 0; i < slot->overflow->n_pairs; i++)
+            cpeg_term_free(slot->overflow->pairs[i].term);
+        free(slot->overflow);
     }
 }
 
+/* Detaches all the attributes of `addr` for mem_release_attrs() */
+static bool
+mem_detach_attrs(const void *addr, mem_attr_slot *detached)
+{
+    mem_attr_slot *slot;
+
+    if (!mem_attr_maybe_present(addr))
+        return false;
+
+    pthread_mutex_lock(&mem_attr_lock);
+    slot = mem_attr_find_slot(addr);
+    if (slot != NULL)
+    {
+        *detached = *slot;
+        mem_attr_remove_slot(slot);
+    }
+    pthread_mutex_unlock(&mem_attr_lock);
+
+    return slot != NULL;
+}
+
 void
 cpeg_mem_release_attrs(const void *addr)
 {
-    mem_attr_cell *cell = mem_attr_find_cell(addr, false);
+    mem_attr_slot detached;
 
-    if (cell != NULL)
-        mem_release_attrs(cell);
+    if (mem_detach_attrs(addr, &detached))
+        mem_release_attrs(&detached);
 }
 
 #ifdef LIBCPEG_TESTING
@@ -327,38 +649,294 @@ CQC_TESTCASE(test_release_attr,
 void
 cpeg_mem_free(void *addr)
 {
-    mem_attr_cell *cell = mem_attr_find_cell(addr, false);
-
-    if (cell != NULL)
-    {
-        mem_release_attrs(cell);
-        LIST_REMOVE(cell, entry);
-    }
+    cpeg_mem_release_attrs(addr);
     free(addr);
 }
 
 void *
 cpeg_mem_realloc(void *oldaddr, size_t newsize)
 {
+    mem_attr_slot detached;
+    bool has_attrs = oldaddr != NULL && mem_detach_attrs(oldaddr, &detached);
     void *newaddr = realloc(oldaddr, newsize);
 
     assert(newaddr != NULL);
-    if (oldaddr != newaddr && oldaddr != NULL)
+    if (has_attrs)
+    {
+        pthread_mutex_lock(&mem_attr_lock);
+        detached.addr = newaddr;
+        mem_attr_add_slot(&detached);
+        pthread_mutex_unlock(&mem_attr_lock);
+    }
+
+    return newaddr;
+}
+
+/*
+ * After a burst of attributes the table is left much larger than
+ * needed; rebuild it with the load of 1/4 at most, or free it if empty.
+ */
+static void
+mem_attr_shrink(void)
+{
+    mem_attr_table old = attr_table;
+    size_t size = MEM_ATTR_MIN_TABLE_SIZE;
+    size_t i;
+
+    if (attr_old_table.slots != NULL)
+        mem_attr_migrate(SIZE_MAX);
+    if (old.slots == NULL)
+        return;
+
+    if (old.used == 0)
     {
-        mem_attr_cell *cell = mem_attr_find_cell(oldaddr, false);
+        free(old.slots);
+        attr_table.slots = NULL;
+        attr_table.mask = 0;
+        return;
+    }
+
+    while (old.used * 4 > size)
+        size *= 2;
+    if (size >= old.mask + 1)
+        return;
 
-        if (cell != NULL)
+    attr_table.slots = mem_attr_alloc_slots(size);
+    attr_table.mask = size - 1;
+    attr_table.used = 0;
+    for (i = 0; i <= old.mask; i++)
+    {
+        if (mem_attr_slot_used(&old.slots[i]))
+            mem_attr_table_insert(&attr_table, &old.slots[i]);
+    }
+    free(old.slots);
+}
+
+size_t
+cpeg_mem_trim(void)
+{
+    size_t released = cpeg_term_cache_trim();
+
+    pthread_mutex_lock(&mem_attr_lock);
+    mem_attr_shrink();
+    pthread_mutex_unlock(&mem_attr_lock);
+
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    return released;
+}
+
+static void
+mem_attr_table_stats(const mem_attr_table *table, cpeg_mem_attr_stats *stats)
+{
+    size_t i;
+
+    if (table->slots == NULL)
+        return;
+
+    for (i = 0; i <= table->mask; i++)
+    {
+        const mem_attr_slot *slot = &table->slots[i];
+        size_t probe;
+        unsigned j;
+
+        if (!mem_attr_slot_used(slot))
+            continue;
+        probe = (i - mem_addr_hash(slot->addr)) & table->mask;
+        if (probe > stats->max_probe)
+            stats->max_probe = probe;
+        stats->objects++;
+        for (j = 0; j < MEM_ATTR_INLINE && slot->pairs[j].term != NULL; j++)
+            stats->values++;
+        if (slot->overflow != NULL)
+            stats->values += slot->overflow->n_pairs;
+    }
+}
+
+void
+cpeg_mem_attr_stats_snapshot(cpeg_mem_attr_stats *stats)
+{
+    stats->objects = 0;
+    stats->values = 0;
+    stats->max_probe = 0;
+
+    pthread_mutex_lock(&mem_attr_lock);
+    stats->table_size = attr_table.slots == NULL ? 0 : attr_table.mask + 1;
+    stats->old_table_size = attr_old_table.slots == NULL ?
+        0 : attr_old_table.mask + 1;
+    mem_attr_table_stats(&attr_table, stats);
+    mem_attr_table_stats(&attr_old_table, stats);
+    pthread_mutex_unlock(&mem_attr_lock);
+
+    stats->load_factor = stats->table_size == 0 ? 0.0 :
+        (double)stats->objects / stats->table_size;
+}
+
+#ifdef LIBCPEG_TESTING
+CQC_TESTCASE(test_attr_stats,
+             "Attribute statistics count objects and values")
+{
+    cqc_forall(uint8_t, n)
+    {
+        cqc_expect
         {
-            unsigned newh = mem_addr_hash(newaddr);
+            cpeg_mem_attr_stats before;
+            cpeg_mem_attr_stats after;
+            unsigned i;
 
-            LIST_REMOVE(cell, entry);
-            LIST_INSERT_HEAD(&addr_hash_table[newh], cell, entry);
+            cpeg_mem_attr_stats_snapshot(&before);
+            for (i = 0; i < n; i++)
+            {
+                cpeg_term_ptr t;
+
+                cqc_generate_cpeg_term_ptr(&t, cqc_scale);
+                cpeg_mem_attr_set(&test_mem_attr_type,
+                                  (const void *)(uintptr_t)i, t);
+            }
+            cpeg_mem_attr_stats_snapshot(&after);
+            cqc_assert_eq(size_t, after.objects,
+                          before.objects + (n > 0 ? 1 : 0));
+            cqc_assert_eq(size_t, after.values, before.values + n);
+            cqc_assert(after.load_factor <= 0.5);
+            cpeg_mem_release_attrs(&test_mem_attr_type);
+            cpeg_mem_attr_stats_snapshot(&after);
+            cqc_assert_eq(size_t, after.objects, before.objects);
+            cqc_assert_eq(size_t, after.values, before.values);
         }
     }
+}
 
-    return newaddr;
+CQC_TESTCASE(test_attr_trim,
+             "Trimming shrinks the table and keeps the attributes")
+{
+    cqc_forall(uint16_t, n)
+    {
+        cqc_expect
+        {
+            cpeg_term_ptr kept;
+            cpeg_mem_attr_stats stats;
+            unsigned i;
+
+            cqc_generate_cpeg_term_ptr(&kept, cqc_scale);
+            cpeg_mem_attr_set(&kept, &test_mem_attr_type, kept);
+            for (i = 0; i < n; i++)
+            {
+                cpeg_term_ptr t;
+
+                cqc_generate_cpeg_term_ptr(&t, cqc_scale);
+                cpeg_mem_attr_set((const void *)(uintptr_t)(i + 1),
+                                  &test_mem_attr_type, t);
+            }
+            for (i = 0; i < n; i++)
+                cpeg_mem_release_attrs((const void *)(uintptr_t)(i + 1));
+
+            cpeg_mem_trim();
+            cpeg_mem_attr_stats_snapshot(&stats);
+            cqc_assert(stats.table_size <= MEM_ATTR_MIN_TABLE_SIZE ||
+                       stats.objects * 4 > stats.table_size / 2);
+            cqc_assert_eq(cpeg_term_ptr,
+                          cpeg_mem_attr_get(&kept, &test_mem_attr_type), kept);
+            cpeg_mem_release_attrs(&kept);
+        }
+    }
+}
+
+CQC_TESTCASE(test_many_attrs,
+             "Any number of attributes can be set for an address")
+{
+    cqc_forall(uintptr_t, addr)
+    {
+        cqc_forall(uint8_t, n)
+        {
+            cqc_expect
+            {
+                cpeg_term_ptr terms[(unsigned)n + 1];
+                unsigned attr_cnt = test_mem_attr_count;
+                unsigned i;
+
+                for (i = 0; i < n; i++)
+                {
+                    cqc_generate_cpeg_term_ptr(&terms[i], cqc_scale);
+                    cpeg_mem_attr_set((const void *)addr,
+                                      (const void *)(uintptr_t)i, terms[i]);
+                }
+                for (i = 0; i < n; i++)
+                {
+                    cqc_assert_eq(cpeg_term_ptr, terms[i],
+                                  cpeg_mem_attr_get((const void *)addr,
+                                                    (const void *)
+                                                    (uintptr_t)i));
+                }
+                for (i = 0; i < n; i += 2)
+                {
+                    cpeg_mem_attr_set((const void *)addr,
+                                      (const void *)(uintptr_t)i, NULL);
+                }
+                for (i = 0; i < n; i++)
+                {
+                    cqc_assert_eq(cpeg_term_ptr, i % 2 ? terms[i] : NULL,
+                                  cpeg_mem_attr_get((const void *)addr,
+                                                    (const void *)
+                                                    (uintptr_t)i));
+                }
+                cpeg_mem_release_attrs((const void *)addr);
+                cqc_assert_eq(unsigned, test_mem_attr_count, attr_cnt);
+            }
+        }
+    }
 }
 
+CQC_TESTCASE(test_table_growth,
+             "Attributes survive the growth of the table")
+{
+    cqc_forall(uintptr_t, attr)
+    {
+        cqc_forall(uint16_t, n)
+        {
+            cqc_expect
+            {
+                unsigned attr_cnt = test_mem_attr_count;
+                void **addrs = cpeg_mem_alloc(((size_t)n + 1) *
+                                              sizeof(*addrs));
+                unsigned i;
+
+                for (i = 0; i < n; i++)
+                {
+                    cpeg_term_ptr t;
+
+                    addrs[i] = cpeg_mem_alloc(1);
+                    cqc_generate_cpeg_term_ptr(&t, cqc_scale);
+                    cpeg_mem_attr_set(addrs[i], (const void *)attr, t);
+                    if (i % 3 == 0 && i > 0)
+                    {
+                        cpeg_mem_free(addrs[i / 3]);
+                        addrs[i / 3] = NULL;
+                    }
+                }
+                for (i = 0; i < n; i++)
+                {
+                    cpeg_term_ptr t;
+
+                    if (addrs[i] == NULL)
+                        continue;
+                    t = cpeg_mem_attr_get(addrs[i], (const void *)attr);
+                    cqc_assert_neq(cpeg_term_ptr, t, NULL);
+                    addrs[i] = cpeg_mem_realloc(addrs[i], 256);
+                    cqc_assert_eq(cpeg_term_ptr, t,
+                                  cpeg_mem_attr_get(addrs[i],
+                                                    (const void *)attr));
+                }
+                for (i = 0; i < n; i++)
+                    cpeg_mem_free(addrs[i]);
+                cpeg_mem_free(addrs);
+                cqc_assert_eq(unsigned, test_mem_attr_count, attr_cnt);
+            }
+        }
+    }
+}
+#endif
+
 #if 0
 #ifdef LIBCPEG_TESTING
 CQC_TESTCASE(realloc_keeps_attrs,
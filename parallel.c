@@ -0,0 +1,566 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_ptrmap.h"
+#include "libcpeg_parallel.h"
+#ifdef LIBCPEG_TESTING
+#include "cqc.h"
+#endif
+
+#ifdef LIBCPEG_TESTING
+
+typedef cpeg_term *cpeg_term_ptr;
+
+/* No init or destroy hooks: workers create terms concurrently */
+static const cpeg_term_type test_parallel_type = {
+    .id = "parallel"
+};
+
+static cpeg_term *
+test_parallel_tree(unsigned depth, unsigned fanout)
+{
+    cpeg_term *children[fanout];
+    unsigned n = depth == 0 ? 0 : 1 + (unsigned)random() % fanout;
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        children[i] = test_parallel_tree(depth - 1, fanout);
+
+    return cpeg_term_new(&test_parallel_type,
+                         (void *)(uintptr_t)(random() % 1000), n, children);
+}
+
+#endif
+
+#define PARALLEL_INITIAL_DEQUE 64
+
+/*
+ * A task processes a single subtree and stores the result into
+ * a slot of its parent's results. Tasks live in their parent's frame,
+ * which waits for them to complete.
+ */
+typedef struct par_task {
+    const struct par_job *job;
+    const cpeg_term *term;
+    void **result;
+    bool root;
+    int done;
+} par_task;
+
+typedef struct par_job {
+    cpeg_term_reduce_fn fn;
+    void *data;
+    /* The sizes of subtrees that are processed as separate tasks */
+    cpeg_ptrmap big;
+    size_t threshold;
+} par_job;
+
+/*
+ * The owner pushes and pops tasks at the tail, thieves take them
+ * from the head, so the oldest and presumably largest tasks
+ * are stolen first.
+ */
+typedef struct par_deque {
+    pthread_mutex_t lock;
+    par_task **tasks;
+    size_t head;
+    size_t n_tasks;
+    size_t capacity;
+} par_deque;
+
+typedef struct par_worker {
+    par_deque deque;
+    pthread_t thread;
+    unsigned seed;
+} par_worker;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    par_worker *workers;
+    unsigned n_workers;
+    /* Tasks submitted by threads outside the pool */
+    par_deque injected;
+    unsigned queued;
+    unsigned sleeping;
+    bool shutdown;
+} par_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .injected = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+
+static __thread par_worker *par_self;
+
+static void
+par_deque_init(par_deque *deque)
+{
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->tasks = NULL;
+    deque->head = 0;
+    deque->n_tasks = 0;
+    deque->capacity = 0;
+}
+
+static void
+par_deque_fini(par_deque *deque)
+{
+    assert(deque->n_tasks == 0);
+    cpeg_mem_free(deque->tasks);
+    deque->tasks = NULL;
+    deque->capacity = 0;
+    pthread_mutex_destroy(&deque->lock);
+}
+
+static void
+par_deque_push(par_deque *deque, par_task *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->n_tasks == deque->capacity)
+    {
+        size_t capacity = deque->capacity == 0 ?
+            PARALLEL_INITIAL_DEQUE : deque->capacity * 2;
+        par_task **tasks = cpeg_mem_alloc(capacity * sizeof(*tasks));
+        size_t i;
+
+        for (i = 0; i < deque->n_tasks; i++)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        cpeg_mem_free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[(deque->head + deque->n_tasks) % deque->capacity] = task;
+    /* n_tasks is peeked at by thieves without locking */
+    __atomic_store_n(&deque->n_tasks, deque->n_tasks + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&deque->lock);
+
+    __atomic_fetch_add(&par_pool.queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&par_pool.sleeping, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&par_pool.lock);
+        pthread_cond_signal(&par_pool.wake);
+        pthread_mutex_unlock(&par_pool.lock);
+    }
+}
+
+static par_task *
+par_deque_pop(par_deque *deque)
+{
+    par_task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->n_tasks > 0)
+    {
+        __atomic_store_n(&deque->n_tasks, deque->n_tasks - 1, __ATOMIC_RELAXED);
+        task = deque->tasks[(deque->head + deque->n_tasks) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (task != NULL)
+        __atomic_fetch_sub(&par_pool.queued, 1, __ATOMIC_SEQ_CST);
+    return task;
+}
+
+static par_task *
+par_deque_steal(par_deque *deque)
+{
+    par_task *task = NULL;
+
+    if (__atomic_load_n(&deque->n_tasks, __ATOMIC_RELAXED) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->n_tasks > 0)
+    {
+        task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        __atomic_store_n(&deque->n_tasks, deque->n_tasks - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (task != NULL)
+        __atomic_fetch_sub(&par_pool.queued, 1, __ATOMIC_SEQ_CST);
+    return task;
+}
+
+static par_task *
+par_find_task(par_worker *self)
+{
+    par_task *task = par_deque_pop(&self->deque);
+    unsigned start;
+    unsigned i;
+
+    if (task != NULL)
+        return task;
+
+    start = (unsigned)rand_r(&self->seed) % par_pool.n_workers;
+    for (i = 0; i < par_pool.n_workers; i++)
+    {
+        par_worker *victim = &par_pool.workers[(start + i) % par_pool.n_workers];
+
+        if (victim == self)
+            continue;
+        task = par_deque_steal(&victim->deque);
+        if (task != NULL)
+            return task;
+    }
+
+    return par_deque_steal(&par_pool.injected);
+}
+
+static void par_run(par_worker *self, par_task *task);
+
+/*
+ * Instead of blocking, a waiting worker executes other tasks,
+ * starting with the ones it has spawned itself.
+ */
+static void
+par_join(par_worker *self, par_task *task)
+{
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+    {
+        par_task *other = par_find_task(self);
+
+        if (other != NULL)
+            par_run(self, other);
+        else
+            sched_yield();
+    }
+}
+
+static bool
+par_is_big(const par_job *job, const cpeg_term *term)
+{
+    return term != NULL && cpeg_ptrmap_lookup(&job->big, term) != NULL;
+}
+
+static void *
+par_fold(par_worker *self, const par_job *job, const cpeg_term *term)
+{
+    unsigned n = term->n_children;
+    void **results;
+    par_task *tasks;
+    unsigned n_tasks = 0;
+    unsigned i;
+    void *result;
+
+    if (n == 0 || !par_is_big(job, term))
+        return cpeg_term_reduce(job->fn, term, job->data);
+
+    results = cpeg_mem_alloc(n * sizeof(*results));
+    tasks = cpeg_mem_alloc(n * sizeof(*tasks));
+    for (i = 0; i < n; i++)
+    {
+        if (par_is_big(job, term->children[i]))
+        {
+            par_task *task = &tasks[n_tasks++];
+
+            task->job = job;
+            task->term = term->children[i];
+            task->result = &results[i];
+            task->root = false;
+            task->done = 0;
+            par_deque_push(&self->deque, task);
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (!par_is_big(job, term->children[i]))
+            results[i] = cpeg_term_reduce(job->fn, term->children[i], job->data);
+    }
+    while (n_tasks > 0)
+        par_join(self, &tasks[--n_tasks]);
+
+    result = job->fn(term, results, job->data);
+    cpeg_mem_free(tasks);
+    cpeg_mem_free(results);
+    return result;
+}
+
+static void
+par_run(par_worker *self, par_task *task)
+{
+    bool root = task->root;
+
+    *task->result = par_fold(self, task->job, task->term);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+    if (root)
+    {
+        /* Root tasks are waited for by threads outside the pool */
+        pthread_mutex_lock(&par_pool.lock);
+        pthread_cond_broadcast(&par_pool.done);
+        pthread_mutex_unlock(&par_pool.lock);
+    }
+}
+
+static void *
+par_worker_main(void *arg)
+{
+    par_worker *self = arg;
+
+    par_self = self;
+    for (;;)
+    {
+        par_task *task = par_find_task(self);
+
+        if (task != NULL)
+        {
+            par_run(self, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&par_pool.lock);
+        __atomic_fetch_add(&par_pool.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!par_pool.shutdown &&
+            __atomic_load_n(&par_pool.queued, __ATOMIC_SEQ_CST) == 0)
+            pthread_cond_wait(&par_pool.wake, &par_pool.lock);
+        __atomic_fetch_sub(&par_pool.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (par_pool.shutdown)
+        {
+            pthread_mutex_unlock(&par_pool.lock);
+            break;
+        }
+        pthread_mutex_unlock(&par_pool.lock);
+    }
+    par_self = NULL;
+    return NULL;
+}
+
+static void
+par_start(unsigned n_threads)
+{
+    unsigned i;
+
+    if (n_threads == 0)
+    {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        n_threads = n_cpus > 0 ? (unsigned)n_cpus : 1;
+    }
+
+    par_pool.shutdown = false;
+    par_pool.workers = cpeg_mem_alloc(n_threads * sizeof(*par_pool.workers));
+    par_pool.n_workers = n_threads;
+    for (i = 0; i < n_threads; i++)
+    {
+        par_deque_init(&par_pool.workers[i].deque);
+        par_pool.workers[i].seed = i;
+    }
+    for (i = 0; i < n_threads; i++)
+    {
+        int rc = pthread_create(&par_pool.workers[i].thread, NULL,
+                                par_worker_main, &par_pool.workers[i]);
+
+        assert(rc == 0);
+        (void)rc;
+    }
+}
+
+void
+cpeg_parallel_init(unsigned n_threads)
+{
+    pthread_mutex_lock(&par_pool.lock);
+    assert(par_pool.workers == NULL);
+    par_start(n_threads);
+    pthread_mutex_unlock(&par_pool.lock);
+}
+
+void
+cpeg_parallel_shutdown(void)
+{
+    par_worker *workers;
+    unsigned n_workers;
+    unsigned i;
+
+    pthread_mutex_lock(&par_pool.lock);
+    workers = par_pool.workers;
+    n_workers = par_pool.n_workers;
+    par_pool.shutdown = true;
+    pthread_cond_broadcast(&par_pool.wake);
+    pthread_mutex_unlock(&par_pool.lock);
+
+    for (i = 0; i < n_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+    for (i = 0; i < n_workers; i++)
+        par_deque_fini(&workers[i].deque);
+
+    pthread_mutex_lock(&par_pool.lock);
+    par_pool.workers = NULL;
+    par_pool.n_workers = 0;
+    pthread_mutex_unlock(&par_pool.lock);
+    cpeg_mem_free(workers);
+}
+
+static void *
+par_size_node(const cpeg_term *term, void *children[], void *data)
+{
+    par_job *job = data;
+    size_t size = 1;
+    unsigned i;
+
+    for (i = 0; i < term->n_children; i++)
+        size += (uintptr_t)children[i];
+
+    if (size >= job->threshold)
+        *cpeg_ptrmap_insert(&job->big, term) = (void *)(uintptr_t)size;
+    return (void *)(uintptr_t)size;
+}
+
+static void *
+par_execute(par_job *job, const cpeg_term *term)
+{
+    par_task root = {.job = job, .term = term, .root = true};
+    void *result;
+
+    if (term == NULL)
+        return NULL;
+
+    /* Only the subtrees that are worth a task are remembered */
+    cpeg_ptrmap_init(&job->big);
+    cpeg_term_reduce(par_size_node, term, job);
+
+    if (par_self != NULL)
+    {
+        /* Nested calls from a callback are run by the current worker */
+        result = par_fold(par_self, job, term);
+    }
+    else
+    {
+        pthread_mutex_lock(&par_pool.lock);
+        if (par_pool.workers == NULL)
+            par_start(0);
+        pthread_mutex_unlock(&par_pool.lock);
+
+        root.result = &result;
+        par_deque_push(&par_pool.injected, &root);
+
+        pthread_mutex_lock(&par_pool.lock);
+        while (!__atomic_load_n(&root.done, __ATOMIC_ACQUIRE))
+            pthread_cond_wait(&par_pool.done, &par_pool.lock);
+        pthread_mutex_unlock(&par_pool.lock);
+    }
+
+    cpeg_ptrmap_fini(&job->big);
+    return result;
+}
+
+void *
+cpeg_term_reduce_parallel(cpeg_term_reduce_fn reduce, const cpeg_term *term,
+                          void *data, size_t threshold)
+{
+    par_job job = {.fn = reduce, .data = data, .threshold = threshold};
+
+    return par_execute(&job, term);
+}
+
+cpeg_term *
+cpeg_term_map_parallel(cpeg_term_map_fn map, const cpeg_term *term,
+                       void *data, size_t threshold)
+{
+    cpeg_term_map_closure closure = {.map = map, .data = data};
+    par_job job = {.fn = cpeg_term_map_node, .data = &closure,
+                   .threshold = threshold};
+
+    return par_execute(&job, term);
+}
+
+#ifdef LIBCPEG_TESTING
+static void *
+test_parallel_sum(const cpeg_term *term, void *children[],
+                  __attribute__((unused)) void *data)
+{
+    uintptr_t sum = (uintptr_t)term->value;
+    unsigned i;
+
+    /* Order-sensitive, so that misplaced results are noticed */
+    for (i = 0; i < term->n_children; i++)
+        sum = sum * 31 + (uintptr_t)children[i];
+
+    return (void *)sum;
+}
+
+static cpeg_term *
+test_parallel_increment(const cpeg_term *term,
+                        __attribute__((unused)) void *data)
+{
+    return cpeg_term_new(term->type, (void *)((uintptr_t)term->value + 1),
+                         0, NULL);
+}
+
+static int
+test_parallel_compare(const cpeg_term *t1, const cpeg_term *t2,
+                      __attribute__((unused)) void *data)
+{
+    return (uintptr_t)t1->value + 1 == (uintptr_t)t2->value ? 0 : 1;
+}
+
+CQC_TESTCASE(test_reduce_parallel,
+             "Parallel reduce yields the same result as sequential")
+{
+    cqc_forall_range(unsigned, threshold, 1, 64)
+    {
+        cqc_expect
+        {
+            cpeg_term *t = test_parallel_tree(8, 5);
+
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_reduce_parallel(
+                              test_parallel_sum, t, NULL, threshold),
+                          (uintptr_t)cpeg_term_reduce(test_parallel_sum,
+                                                      t, NULL));
+            cpeg_term_free(t);
+        }
+    }
+}
+
+CQC_TESTCASE(test_map_parallel,
+             "Parallel map yields the same result as sequential")
+{
+    cqc_forall_range(unsigned, threshold, 1, 64)
+    {
+        cqc_expect
+        {
+            cpeg_term *t = test_parallel_tree(8, 5);
+            cpeg_term *t1 = cpeg_term_map_parallel(test_parallel_increment,
+                                                   t, NULL, threshold);
+
+            cqc_assert(cpeg_term_isomorphic(t, t1));
+            cqc_assert_eq(int, cpeg_term_zip(test_parallel_compare,
+                                             t, t1, NULL), 0);
+            cpeg_term_free(t);
+            cpeg_term_free(t1);
+        }
+    }
+}
+
+CQC_TESTCASE(test_parallel_restart,
+             "The pool may be shut down and restarted")
+{
+    cqc_forall_range(unsigned, n_threads, 1, 8)
+    {
+        cqc_expect
+        {
+            cpeg_term *t = test_parallel_tree(6, 4);
+
+            cpeg_parallel_shutdown();
+            cpeg_parallel_init(n_threads);
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_reduce_parallel(
+                              test_parallel_sum, t, NULL, 2),
+                          (uintptr_t)cpeg_term_reduce(test_parallel_sum,
+                                                      t, NULL));
+            cpeg_term_free(t);
+        }
+    }
+}
+#endif
@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_ptrmap.h"
+#ifdef LIBCPEG_TESTING
+#include "cqc.h"
+#endif
+
+#define PTRMAP_MIN_SIZE 16
+
+static inline size_t
+ptrmap_hash(const void *key)
+{
+    uint64_t val = (uintptr_t)key * UINT64_C(0x9e3779b97f4a7c15);
+
+    return (size_t)(val >> 32 ^ val);
+}
+
+void
+cpeg_ptrmap_init(cpeg_ptrmap *map)
+{
+    map->entries = NULL;
+    map->mask = 0;
+    map->n_entries = 0;
+}
+
+void
+cpeg_ptrmap_fini(cpeg_ptrmap *map)
+{
+    cpeg_mem_free(map->entries);
+    cpeg_ptrmap_init(map);
+}
+
+static cpeg_ptrmap_entry *
+ptrmap_probe(cpeg_ptrmap_entry *entries, size_t mask, const void *key)
+{
+    size_t i;
+
+    for (i = ptrmap_hash(key) & mask;
+         entries[i].key != NULL && entries[i].key != key;
+         i = (i + 1) & mask)
+        ;
+    return &entries[i];
+}
+
+void **
+cpeg_ptrmap_lookup(const cpeg_ptrmap *map, const void *key)
+{
+    cpeg_ptrmap_entry *entry;
+
+    assert(key != NULL);
+    if (map->entries == NULL)
+        return NULL;
+
+    entry = ptrmap_probe(map->entries, map->mask, key);
+    return entry->key == NULL ? NULL : &entry->value;
+}
+
+static void
+ptrmap_grow(cpeg_ptrmap *map)
+{
+    size_t size = map->entries == NULL ? PTRMAP_MIN_SIZE : (map->mask + 1) * 2;
+    cpeg_ptrmap_entry *entries = cpeg_mem_alloc(size * sizeof(*entries));
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        entries[i].key = NULL;
+
+    if (map->entries != NULL)
+    {
+        for (i = 0; i <= map->mask; i++)
+        {
+            if (map->entries[i].key != NULL)
+            {
+                *ptrmap_probe(entries, size - 1, map->entries[i].key) =
+                    map->entries[i];
+            }
+        }
+        cpeg_mem_free(map->entries);
+    }
+    map->entries = entries;
+    map->mask = size - 1;
+}
+
+void **
+cpeg_ptrmap_insert(cpeg_ptrmap *map, const void *key)
+{
+    cpeg_ptrmap_entry *entry;
+
+    assert(key != NULL);
+    if ((map->n_entries + 1) * 2 > (map->entries == NULL ? 0 : map->mask + 1))
+        ptrmap_grow(map);
+
+    entry = ptrmap_probe(map->entries, map->mask, key);
+    if (entry->key == NULL)
+    {
+        entry->key = key;
+        entry->value = NULL;
+        map->n_entries++;
+    }
+    return &entry->value;
+}
+
+#ifdef LIBCPEG_TESTING
+CQC_TESTCASE(ptrmap_insert_lookup,
+             "Values inserted into a map can be looked up")
+{
+    cqc_forall(uint16_t, n)
+    {
+        cqc_expect
+        {
+            cpeg_ptrmap map;
+            unsigned i;
+
+            cpeg_ptrmap_init(&map);
+            for (i = 1; i <= n; i++)
+            {
+                *cpeg_ptrmap_insert(&map, (const void *)(uintptr_t)(i * 8)) =
+                    (void *)(uintptr_t)i;
+            }
+            cqc_assert_eq(size_t, map.n_entries, n);
+            for (i = 1; i <= n; i++)
+            {
+                void **v = cpeg_ptrmap_lookup(&map,
+                                              (const void *)(uintptr_t)(i * 8));
+
+                cqc_assert(v != NULL);
+                cqc_assert_eq(uintptr_t, (uintptr_t)*v, i);
+            }
+            cqc_assert(cpeg_ptrmap_lookup(&map, (const void *)(uintptr_t)4) ==
+                       NULL);
+            cpeg_ptrmap_fini(&map);
+        }
+    }
+}
+#endif
@@ -0,0 +1,895 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_ptrmap.h"
+#include "libcpeg_serial.h"
+#ifdef LIBCPEG_TESTING
+#include <stdio.h>
+#include "cqc.h"
+#endif
+
+#ifdef LIBCPEG_TESTING
+
+static unsigned test_serial_object_count;
+
+static void *
+test_serial_init(void *v)
+{
+    test_serial_object_count++;
+    return strdup(v);
+}
+
+static void
+test_serial_destroy(void *v)
+{
+    assert(test_serial_object_count > 0);
+    test_serial_object_count--;
+    free(v);
+}
+
+static const cpeg_term_type test_serial_type = {
+    .id = "serial",
+    .init = test_serial_init,
+    .destroy = test_serial_destroy
+};
+
+static size_t
+test_serial_encode(const void *value, void *buf, size_t size)
+{
+    size_t len = strlen(value) + 1;
+
+    if (len <= size)
+        memcpy(buf, value, len);
+    return len;
+}
+
+static void *
+test_serial_decode(const void *data, size_t size)
+{
+    assert(size > 0 && ((const char *)data)[size - 1] == '\0');
+    return (void *)data;
+}
+
+static const cpeg_term_codec test_serial_codecs[] = {
+    {&test_serial_type, test_serial_encode, test_serial_decode}
+};
+
+/*
+ * Builds a complete binary tree whose labels get longer with depth;
+ * if `shared` is set, both children of a node are the same term.
+ */
+static cpeg_term *
+test_serial_tree(unsigned depth, bool shared)
+{
+    char label[512];
+    cpeg_term *children[2];
+
+    memset(label, 'a' + depth % 26, depth * 20);
+    label[depth * 20] = '\0';
+    if (depth == 0)
+        return cpeg_term_new(&test_serial_type, label, 0, NULL);
+
+    children[0] = test_serial_tree(depth - 1, shared);
+    children[1] = shared ? cpeg_term_use(children[0]) :
+        test_serial_tree(depth - 1, shared);
+    return cpeg_term_new(&test_serial_type, label, 2, children);
+}
+
+static int
+test_serial_same(const cpeg_term *t1, const cpeg_term *t2,
+                 __attribute__((unused)) void *data)
+{
+    return t1->type != t2->type || t1->n_children != t2->n_children ||
+        strcmp(t1->value, t2->value) != 0;
+}
+
+#endif
+
+/*
+ * A stream starts with the magic, the format version and the ids of
+ * the writer's types, and then holds terms in preorder. Every term
+ * begins with a varint tag: an odd tag refers back to the (tag >> 1)th
+ * shared term of the stream; otherwise it is followed by the number of
+ * children, the children themselves and finally the length-prefixed
+ * value. Shared terms are numbered in the order they are completed.
+ */
+#define SERIAL_MAGIC "CPGT"
+#define SERIAL_VERSION 1
+
+#define SERIAL_TAG_BACKREF 1u
+#define SERIAL_TAG_SHARED 2u
+#define SERIAL_TAG_TYPE_SHIFT 2
+
+#define SERIAL_VARINT_MAX 10
+
+/* The tests use a tiny buffer so that they cross its boundaries */
+#ifdef LIBCPEG_TESTING
+#define SERIAL_BUFFER_SIZE 64
+#else
+#define SERIAL_BUFFER_SIZE 65536
+#endif
+
+#define SERIAL_SCRATCH_MIN 256
+
+typedef struct writer_frame {
+    const cpeg_term *term;
+    const cpeg_term_codec *codec;
+    unsigned pos;
+    bool multiref;
+} writer_frame;
+
+struct cpeg_term_writer {
+    int fd;
+    int error;
+    size_t used;
+    unsigned char *scratch;
+    size_t scratch_size;
+    cpeg_term_codec *codecs;
+    /* Types map to their codec index plus one, terms to their number plus one */
+    cpeg_ptrmap types;
+    cpeg_ptrmap shared;
+    size_t n_shared;
+    writer_frame *stack;
+    unsigned depth;
+    unsigned capacity;
+    unsigned char buf[SERIAL_BUFFER_SIZE];
+};
+
+typedef struct reader_frame {
+    unsigned codec;
+    unsigned remaining;
+    unsigned mark;
+    bool multiref;
+} reader_frame;
+
+struct cpeg_term_reader {
+    int fd;
+    size_t pos;
+    size_t end;
+    unsigned char *scratch;
+    size_t scratch_size;
+    cpeg_term_codec *codecs;
+    unsigned n_codecs;
+    /* Stream type numbers map to codec indices, UINT_MAX if unknown */
+    unsigned *types;
+    size_t n_types;
+    cpeg_term **shared;
+    size_t n_shared;
+    size_t shared_capacity;
+    cpeg_term_builder builder;
+    reader_frame *stack;
+    unsigned depth;
+    unsigned capacity;
+    unsigned char buf[SERIAL_BUFFER_SIZE];
+};
+
+static void
+serial_grow_scratch(unsigned char **scratch, size_t *scratch_size, size_t size)
+{
+    size_t new_size = *scratch_size == 0 ? SERIAL_SCRATCH_MIN : *scratch_size;
+
+    while (new_size < size)
+        new_size *= 2;
+    *scratch = cpeg_mem_realloc(*scratch, new_size);
+    *scratch_size = new_size;
+}
+
+static cpeg_term_codec *
+serial_copy_codecs(unsigned n_codecs, const cpeg_term_codec codecs[])
+{
+    cpeg_term_codec *copy;
+
+    if (n_codecs == 0)
+        return NULL;
+    copy = cpeg_mem_alloc(n_codecs * sizeof(*copy));
+    memcpy(copy, codecs, n_codecs * sizeof(*copy));
+    return copy;
+}
+
+static bool
+serial_multiref(const cpeg_term *term)
+{
+    unsigned refcnt = term->flags & CPEG_TERM_SHARED ?
+        __atomic_load_n(&term->refcnt, __ATOMIC_RELAXED) :
+        term->refcnt;
+
+    return refcnt > 1;
+}
+
+static void
+writer_flush(cpeg_term_writer *writer)
+{
+    size_t done = 0;
+
+    while (writer->error == 0 && done < writer->used)
+    {
+        ssize_t rc = write(writer->fd, writer->buf + done,
+                           writer->used - done);
+
+        if (rc >= 0)
+            done += (size_t)rc;
+        else if (errno != EINTR)
+            writer->error = errno;
+    }
+    writer->used = 0;
+}
+
+static void
+writer_put_varint(cpeg_term_writer *writer, uint64_t v)
+{
+    if (writer->used + SERIAL_VARINT_MAX > SERIAL_BUFFER_SIZE)
+        writer_flush(writer);
+    while (v >= 0x80)
+    {
+        writer->buf[writer->used++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    writer->buf[writer->used++] = (unsigned char)v;
+}
+
+static void
+writer_put_bytes(cpeg_term_writer *writer, const void *data, size_t size)
+{
+    const unsigned char *src = data;
+
+    while (size > 0)
+    {
+        size_t chunk = SERIAL_BUFFER_SIZE - writer->used;
+
+        if (chunk == 0)
+        {
+            writer_flush(writer);
+            continue;
+        }
+        if (chunk > size)
+            chunk = size;
+        memcpy(writer->buf + writer->used, src, chunk);
+        writer->used += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+}
+
+cpeg_term_writer *
+cpeg_term_writer_open(int fd, unsigned n_codecs,
+                      const cpeg_term_codec codecs[])
+{
+    cpeg_term_writer *writer = cpeg_mem_alloc(sizeof(*writer));
+    unsigned i;
+
+    writer->fd = fd;
+    writer->error = 0;
+    writer->used = 0;
+    writer->scratch = NULL;
+    writer->scratch_size = 0;
+    writer->codecs = serial_copy_codecs(n_codecs, codecs);
+    cpeg_ptrmap_init(&writer->types);
+    cpeg_ptrmap_init(&writer->shared);
+    writer->n_shared = 0;
+    writer->stack = NULL;
+    writer->depth = 0;
+    writer->capacity = 0;
+
+    writer_put_bytes(writer, SERIAL_MAGIC, sizeof(SERIAL_MAGIC) - 1);
+    writer_put_varint(writer, SERIAL_VERSION);
+    writer_put_varint(writer, n_codecs);
+    for (i = 0; i < n_codecs; i++)
+    {
+        size_t len = strlen(codecs[i].type->id);
+
+        *cpeg_ptrmap_insert(&writer->types, codecs[i].type) =
+            (void *)(uintptr_t)(i + 1);
+        writer_put_varint(writer, len);
+        writer_put_bytes(writer, codecs[i].type->id, len);
+    }
+
+    return writer;
+}
+
+/*
+ * Returns the codec of `term` if its children and value are to follow,
+ * and NULL if it has been written before or its type has no codec.
+ */
+static const cpeg_term_codec *
+writer_put_head(cpeg_term_writer *writer, const cpeg_term *term,
+                bool multiref)
+{
+    void **index;
+
+    if (multiref)
+    {
+        index = cpeg_ptrmap_lookup(&writer->shared, term);
+        if (index != NULL)
+        {
+            writer_put_varint(writer,
+                              ((uint64_t)(uintptr_t)*index - 1) << 1 |
+                              SERIAL_TAG_BACKREF);
+            return NULL;
+        }
+    }
+    index = cpeg_ptrmap_lookup(&writer->types, term->type);
+    if (index == NULL)
+    {
+        /* Nothing after that could be read back, so it is sticky */
+        if (writer->error == 0)
+            writer->error = EINVAL;
+        return NULL;
+    }
+    writer_put_varint(writer,
+                      ((uint64_t)(uintptr_t)*index - 1) <<
+                      SERIAL_TAG_TYPE_SHIFT |
+                      (multiref ? SERIAL_TAG_SHARED : 0));
+    writer_put_varint(writer, term->n_children);
+    return &writer->codecs[(uintptr_t)*index - 1];
+}
+
+static void
+writer_put_tail(cpeg_term_writer *writer, const cpeg_term *term,
+                const cpeg_term_codec *codec, bool multiref)
+{
+    size_t len = 0;
+
+    if (codec->encode != NULL)
+    {
+        len = codec->encode(term->value, writer->scratch,
+                            writer->scratch_size);
+        if (len > writer->scratch_size)
+        {
+            serial_grow_scratch(&writer->scratch, &writer->scratch_size, len);
+            len = codec->encode(term->value, writer->scratch,
+                                writer->scratch_size);
+        }
+    }
+    writer_put_varint(writer, len);
+    writer_put_bytes(writer, writer->scratch, len);
+
+    if (multiref)
+    {
+        /* The reference keeps the address from being reused */
+        *cpeg_ptrmap_insert(&writer->shared,
+                            cpeg_term_use((cpeg_term *)term)) =
+            (void *)(uintptr_t)++writer->n_shared;
+    }
+}
+
+bool
+cpeg_term_write(cpeg_term_writer *writer, const cpeg_term *term)
+{
+    bool multiref = serial_multiref(term);
+    const cpeg_term_codec *codec = writer_put_head(writer, term, multiref);
+
+    if (codec != NULL)
+    {
+        if (term->n_children == 0)
+            writer_put_tail(writer, term, codec, multiref);
+        else
+        {
+            assert(writer->depth == 0);
+            if (writer->capacity == 0)
+            {
+                writer->capacity = 16;
+                writer->stack = cpeg_mem_alloc(writer->capacity *
+                                               sizeof(*writer->stack));
+            }
+            writer->stack[writer->depth++] = (writer_frame){
+                .term = term, .codec = codec, .pos = 0, .multiref = multiref
+            };
+        }
+    }
+
+    while (writer->depth > 0)
+    {
+        writer_frame *top = &writer->stack[writer->depth - 1];
+        const cpeg_term *child;
+
+        if (top->pos == top->term->n_children)
+        {
+            writer_put_tail(writer, top->term, top->codec, top->multiref);
+            writer->depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        multiref = serial_multiref(child);
+        codec = writer_put_head(writer, child, multiref);
+        if (codec == NULL)
+        {
+            if (writer->error != 0)
+                writer->depth = 0;
+            continue;
+        }
+        if (child->n_children == 0)
+        {
+            writer_put_tail(writer, child, codec, multiref);
+            continue;
+        }
+        if (writer->depth == writer->capacity)
+        {
+            writer->capacity *= 2;
+            writer->stack = cpeg_mem_realloc(writer->stack,
+                                             writer->capacity *
+                                             sizeof(*writer->stack));
+        }
+        writer->stack[writer->depth++] = (writer_frame){
+            .term = child, .codec = codec, .pos = 0, .multiref = multiref
+        };
+    }
+
+    if (writer->error != 0)
+    {
+        errno = writer->error;
+        return false;
+    }
+    return true;
+}
+
+bool
+cpeg_term_writer_close(cpeg_term_writer *writer)
+{
+    int error;
+    size_t i;
+
+    writer_flush(writer);
+    error = writer->error;
+
+    for (i = 0; i <= writer->shared.mask && writer->shared.entries != NULL; i++)
+    {
+        if (writer->shared.entries[i].key != NULL)
+            cpeg_term_free((cpeg_term *)writer->shared.entries[i].key);
+    }
+    cpeg_ptrmap_fini(&writer->shared);
+    cpeg_ptrmap_fini(&writer->types);
+    cpeg_mem_free(writer->stack);
+    cpeg_mem_free(writer->scratch);
+    cpeg_mem_free(writer->codecs);
+    cpeg_mem_free(writer);
+
+    if (error != 0)
+    {
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+/* Returns -1 at the end of the stream and on errors, with errno set */
+static int
+reader_get_byte(cpeg_term_reader *reader)
+{
+    while (reader->pos == reader->end)
+    {
+        ssize_t rc = read(reader->fd, reader->buf, SERIAL_BUFFER_SIZE);
+
+        if (rc == 0)
+        {
+            errno = 0;
+            return -1;
+        }
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        reader->pos = 0;
+        reader->end = (size_t)rc;
+    }
+    return reader->buf[reader->pos++];
+}
+
+/*
+ * Like reader_get_byte(), returns false with errno set to 0 if the stream
+ * ends before the varint; a truncated varint is malformed data.
+ */
+static bool
+reader_get_varint(cpeg_term_reader *reader, uint64_t *v)
+{
+    unsigned shift;
+
+    /* Most varints are a single byte already in the buffer */
+    if (reader->pos < reader->end && reader->buf[reader->pos] < 0x80)
+    {
+        *v = reader->buf[reader->pos++];
+        return true;
+    }
+
+    *v = 0;
+    for (shift = 0; shift < 7 * SERIAL_VARINT_MAX; shift += 7)
+    {
+        int c = reader_get_byte(reader);
+
+        if (c < 0)
+        {
+            if (errno == 0 && shift > 0)
+                errno = EINVAL;
+            return false;
+        }
+        if (shift == 63 && (c & 0x7e) != 0)
+            break;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0)
+            return true;
+    }
+    errno = EINVAL;
+    return false;
+}
+
+/* Reads `size` bytes into the scratch buffer, growing it as data arrive */
+static bool
+reader_get_bytes(cpeg_term_reader *reader, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        size_t chunk;
+
+        if (reader->pos == reader->end)
+        {
+            int c = reader_get_byte(reader);
+
+            if (c < 0)
+            {
+                if (errno == 0)
+                    errno = EINVAL;
+                return false;
+            }
+            reader->pos--;
+        }
+        chunk = reader->end - reader->pos;
+        if (chunk > size - done)
+            chunk = size - done;
+        if (done + chunk > reader->scratch_size)
+        {
+            serial_grow_scratch(&reader->scratch, &reader->scratch_size,
+                                done + chunk);
+        }
+        memcpy(reader->scratch + done, reader->buf + reader->pos, chunk);
+        reader->pos += chunk;
+        done += chunk;
+    }
+    return true;
+}
+
+static bool
+reader_get_header(cpeg_term_reader *reader)
+{
+    uint64_t version;
+    uint64_t n_types;
+    size_t i;
+
+    if (!reader_get_bytes(reader, sizeof(SERIAL_MAGIC) - 1))
+        return false;
+    if (memcmp(reader->scratch, SERIAL_MAGIC, sizeof(SERIAL_MAGIC) - 1) != 0 ||
+        !reader_get_varint(reader, &version) || version != SERIAL_VERSION ||
+        !reader_get_varint(reader, &n_types) || n_types >= UINT_MAX)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (n_types > 0)
+        reader->types = cpeg_mem_alloc(n_types * sizeof(*reader->types));
+    for (i = 0; i < n_types; i++)
+    {
+        uint64_t len;
+        unsigned j;
+
+        if (!reader_get_varint(reader, &len) ||
+            !reader_get_bytes(reader, len))
+        {
+            errno = EINVAL;
+            return false;
+        }
+        reader->types[i] = UINT_MAX;
+        for (j = 0; j < reader->n_codecs; j++)
+        {
+            const char *id = reader->codecs[j].type->id;
+
+            if (strlen(id) == len && memcmp(id, reader->scratch, len) == 0)
+            {
+                reader->types[i] = j;
+                break;
+            }
+        }
+        reader->n_types++;
+    }
+    return true;
+}
+
+cpeg_term_reader *
+cpeg_term_reader_open(int fd, unsigned n_codecs,
+                      const cpeg_term_codec codecs[])
+{
+    cpeg_term_reader *reader = cpeg_mem_alloc(sizeof(*reader));
+
+    reader->fd = fd;
+    reader->pos = 0;
+    reader->end = 0;
+    reader->scratch = NULL;
+    reader->scratch_size = 0;
+    reader->codecs = serial_copy_codecs(n_codecs, codecs);
+    reader->n_codecs = n_codecs;
+    reader->types = NULL;
+    reader->n_types = 0;
+    reader->shared = NULL;
+    reader->n_shared = 0;
+    reader->shared_capacity = 0;
+    cpeg_term_builder_init(&reader->builder);
+    reader->stack = NULL;
+    reader->depth = 0;
+    reader->capacity = 0;
+
+    if (!reader_get_header(reader))
+    {
+        int error = errno;
+
+        cpeg_term_reader_close(reader);
+        errno = error;
+        return NULL;
+    }
+    return reader;
+}
+
+/* Reads the value of a term whose children are in the builder after `mark` */
+static cpeg_term *
+reader_finish(cpeg_term_reader *reader, unsigned codec_index, unsigned mark,
+              bool multiref)
+{
+    const cpeg_term_codec *codec = &reader->codecs[codec_index];
+    cpeg_term *term;
+    uint64_t len;
+    void *value = NULL;
+
+    if (!reader_get_varint(reader, &len) || !reader_get_bytes(reader, len))
+    {
+        if (errno == 0)
+            errno = EINVAL;
+        return NULL;
+    }
+    if (codec->decode != NULL)
+        value = codec->decode(reader->scratch, len);
+    else if (len != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    term = cpeg_term_builder_finish(&reader->builder, mark, codec->type, value);
+
+    if (multiref)
+    {
+        if (reader->n_shared == reader->shared_capacity)
+        {
+            reader->shared_capacity = reader->shared_capacity == 0 ? 16 :
+                reader->shared_capacity * 2;
+            reader->shared = cpeg_mem_realloc(reader->shared,
+                                              reader->shared_capacity *
+                                              sizeof(*reader->shared));
+        }
+        reader->shared[reader->n_shared++] = cpeg_term_use(term);
+    }
+    return term;
+}
+
+static cpeg_term *
+reader_fail(cpeg_term_reader *reader, int error)
+{
+    cpeg_term_builder_rewind(&reader->builder, 0);
+    reader->depth = 0;
+    errno = error;
+    return NULL;
+}
+
+cpeg_term *
+cpeg_term_read(cpeg_term_reader *reader)
+{
+    for (;;)
+    {
+        cpeg_term *term;
+        uint64_t tag;
+        uint64_t n_children;
+        unsigned codec_index;
+        bool multiref;
+
+        if (!reader_get_varint(reader, &tag))
+        {
+            if (errno == 0 && reader->depth == 0)
+                return NULL;
+            return reader_fail(reader, errno == 0 ? EINVAL : errno);
+        }
+        if (tag & SERIAL_TAG_BACKREF)
+        {
+            if ((tag >> 1) >= reader->n_shared)
+                return reader_fail(reader, EINVAL);
+            term = cpeg_term_use(reader->shared[tag >> 1]);
+        }
+        else
+        {
+            multiref = (tag & SERIAL_TAG_SHARED) != 0;
+            tag >>= SERIAL_TAG_TYPE_SHIFT;
+            if (tag >= reader->n_types || reader->types[tag] == UINT_MAX)
+                return reader_fail(reader, EINVAL);
+            codec_index = reader->types[tag];
+            if (!reader_get_varint(reader, &n_children) ||
+                n_children >= UINT_MAX)
+                return reader_fail(reader, errno == 0 ? EINVAL : errno);
+
+            if (n_children > 0)
+            {
+                if (reader->depth == reader->capacity)
+                {
+                    reader->capacity = reader->capacity == 0 ? 16 :
+                        reader->capacity * 2;
+                    reader->stack = cpeg_mem_realloc(reader->stack,
+                                                     reader->capacity *
+                                                     sizeof(*reader->stack));
+                }
+                reader->stack[reader->depth++] = (reader_frame){
+                    .codec = codec_index,
+                    .remaining = (unsigned)n_children,
+                    .mark = cpeg_term_builder_mark(&reader->builder),
+                    .multiref = multiref
+                };
+                continue;
+            }
+            term = reader_finish(reader, codec_index,
+                                 cpeg_term_builder_mark(&reader->builder),
+                                 multiref);
+            if (term == NULL)
+                return reader_fail(reader, errno);
+        }
+
+        /* Hand the complete term over to its parent, completing it in turn */
+        for (;;)
+        {
+            reader_frame *top;
+
+            if (reader->depth == 0)
+                return term;
+            top = &reader->stack[reader->depth - 1];
+            cpeg_term_builder_add(&reader->builder, term);
+            if (--top->remaining > 0)
+                break;
+            term = reader_finish(reader, top->codec, top->mark,
+                                 top->multiref);
+            if (term == NULL)
+                return reader_fail(reader, errno);
+            reader->depth--;
+        }
+    }
+}
+
+void
+cpeg_term_reader_close(cpeg_term_reader *reader)
+{
+    while (reader->n_shared > 0)
+        cpeg_term_free(reader->shared[--reader->n_shared]);
+    cpeg_term_builder_fini(&reader->builder);
+    cpeg_mem_free(reader->shared);
+    cpeg_mem_free(reader->stack);
+    cpeg_mem_free(reader->types);
+    cpeg_mem_free(reader->scratch);
+    cpeg_mem_free(reader->codecs);
+    cpeg_mem_free(reader);
+}
+
+#ifdef LIBCPEG_TESTING
+
+CQC_TESTCASE(test_serial_roundtrip,
+             "Terms are read back as written, with the same sharing")
+{
+    cqc_forall_range(unsigned, depth, 0, 10)
+    {
+        cqc_forall_range(unsigned, shared, 0, 1)
+        {
+            cqc_expect
+            {
+                unsigned saved_cnt = test_serial_object_count;
+                cpeg_term *t = test_serial_tree(depth, shared);
+                FILE *f = tmpfile();
+                cpeg_term_writer *writer;
+                cpeg_term_reader *reader;
+                cpeg_term *r1;
+                cpeg_term *r2;
+
+                writer = cpeg_term_writer_open(fileno(f), 1,
+                                               test_serial_codecs);
+                cqc_assert(cpeg_term_write(writer, t));
+                cqc_assert(cpeg_term_write(writer, t));
+                cqc_assert(cpeg_term_writer_close(writer));
+
+                lseek(fileno(f), 0, SEEK_SET);
+                reader = cpeg_term_reader_open(fileno(f), 1,
+                                               test_serial_codecs);
+                cqc_assert(reader != NULL);
+                r1 = cpeg_term_read(reader);
+                r2 = cpeg_term_read(reader);
+                cqc_assert(r1 != NULL && r2 != NULL);
+                cqc_assert(cpeg_term_read(reader) == NULL);
+                cqc_assert_eq(int, errno, 0);
+                cpeg_term_reader_close(reader);
+                fclose(f);
+
+                cqc_assert_eq(int,
+                              cpeg_term_zip(test_serial_same, t, r1, NULL), 0);
+                cqc_assert_eq(int,
+                              cpeg_term_zip(test_serial_same, t, r2, NULL), 0);
+                if (depth > 0)
+                {
+                    cqc_assert_eq(int, r1->children[0] == r1->children[1],
+                                  (int)shared);
+                    cqc_assert_eq(int, r1->children[0] == r2->children[0],
+                                  (int)shared);
+                }
+                cqc_assert_eq(unsigned, test_serial_object_count,
+                              saved_cnt + (shared ? 2 * depth + 3 :
+                                           3 * ((2u << depth) - 1)));
+                cpeg_term_free(r1);
+                cpeg_term_free(r2);
+                cpeg_term_free(t);
+                cqc_assert_eq(unsigned, test_serial_object_count, saved_cnt);
+            }
+        }
+    }
+}
+
+CQC_TESTCASE(test_serial_malformed,
+             "Truncated streams and unknown types are reported")
+{
+    cqc_forall_range(unsigned, depth, 1, 6)
+    {
+        cqc_expect
+        {
+            unsigned saved_cnt = test_serial_object_count;
+            cpeg_term *t = test_serial_tree(depth, true);
+            FILE *f = tmpfile();
+            cpeg_term_writer *writer;
+            cpeg_term_reader *reader;
+            off_t size;
+
+            writer = cpeg_term_writer_open(fileno(f), 0, NULL);
+            cqc_assert(!cpeg_term_write(writer, t));
+            cqc_assert_eq(int, errno, EINVAL);
+            cqc_assert(!cpeg_term_writer_close(writer));
+            cqc_assert_eq(int, errno, EINVAL);
+
+            cqc_assert(ftruncate(fileno(f), 0) == 0);
+            lseek(fileno(f), 0, SEEK_SET);
+            writer = cpeg_term_writer_open(fileno(f), 1, test_serial_codecs);
+            cqc_assert(cpeg_term_write(writer, t));
+            cqc_assert(cpeg_term_writer_close(writer));
+            cpeg_term_free(t);
+
+            reader = cpeg_term_reader_open(fileno(f), 0, NULL);
+            cqc_assert(reader == NULL);
+            cqc_assert_eq(int, errno, EINVAL);
+
+            lseek(fileno(f), 0, SEEK_SET);
+            reader = cpeg_term_reader_open(fileno(f), 0, NULL);
+            cqc_assert(reader != NULL);
+            cqc_assert(cpeg_term_read(reader) == NULL);
+            cqc_assert_eq(int, errno, EINVAL);
+            cpeg_term_reader_close(reader);
+
+            size = lseek(fileno(f), 0, SEEK_END);
+            cqc_assert(ftruncate(fileno(f), size - 1) == 0);
+            lseek(fileno(f), 0, SEEK_SET);
+            reader = cpeg_term_reader_open(fileno(f), 1, test_serial_codecs);
+            cqc_assert(reader != NULL);
+            cqc_assert(cpeg_term_read(reader) == NULL);
+            cqc_assert_eq(int, errno, EINVAL);
+            cpeg_term_reader_close(reader);
+            fclose(f);
+
+            cqc_assert_eq(unsigned, test_serial_object_count, saved_cnt);
+        }
+    }
+}
+
+#endif
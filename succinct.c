@@ -0,0 +1,1007 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_succinct.h"
+#ifdef LIBCPEG_TESTING
+#include "cqc.h"
+#endif
+
+#ifdef LIBCPEG_TESTING
+
+static unsigned test_archive_object_count;
+
+static void *
+test_archive_init(void *v)
+{
+    test_archive_object_count++;
+    return strdup(v);
+}
+
+static void
+test_archive_destroy(void *v)
+{
+    assert(test_archive_object_count > 0);
+    test_archive_object_count--;
+    free(v);
+}
+
+static size_t
+test_archive_hash(const void *v)
+{
+    const unsigned char *s;
+    size_t hash = 0;
+
+    for (s = v; *s != '\0'; s++)
+        hash = hash * 31 + *s;
+    return hash;
+}
+
+static bool
+test_archive_equal(const void *v1, const void *v2)
+{
+    return strcmp(v1, v2) == 0;
+}
+
+static const cpeg_term_type test_archive_type = {
+    .id = "archived",
+    .init = test_archive_init,
+    .destroy = test_archive_destroy,
+    .hash = test_archive_hash,
+    .equal = test_archive_equal
+};
+
+/* Values of this type are static strings compared as pointers */
+static const cpeg_term_type test_archive_plain = {
+    .id = "plain"
+};
+
+static const char *const test_archive_labels[] = {"a", "b", "c", "d", "e"};
+
+static cpeg_term *
+test_archive_leaf(unsigned label)
+{
+    return cpeg_term_new(label % 2 ? &test_archive_plain : &test_archive_type,
+                         (void *)test_archive_labels[label % 5], 0, NULL);
+}
+
+/* Builds a tree of a given size with random fanout */
+static cpeg_term *
+test_archive_tree(unsigned *next, unsigned limit)
+{
+    cpeg_term *node = test_archive_leaf((*next)++);
+    unsigned fanout = (unsigned)(rand() % 5);
+
+    while (fanout-- > 0 && *next < limit)
+        cpeg_term_graft(node, UINT_MAX, test_archive_tree(next, limit));
+    return node;
+}
+
+/* A spine of the given depth where every node but the last has a leaf */
+static cpeg_term *
+test_archive_spine(unsigned depth)
+{
+    cpeg_term *node = test_archive_leaf(depth);
+
+    while (depth-- > 0)
+    {
+        cpeg_term *parent = test_archive_leaf(depth);
+
+        cpeg_term_graft(parent, UINT_MAX, node);
+        cpeg_term_graft(parent, UINT_MAX, test_archive_leaf(depth + 1));
+        node = parent;
+    }
+    return node;
+}
+
+/*
+ * Checks the archived subtree at `pos` against `term`; returns the size
+ * of the subtree or 0 if they differ.
+ */
+static size_t
+test_archive_check(const cpeg_term_archive *archive, const cpeg_term *term,
+                   size_t pos, size_t parent, size_t *index)
+{
+    size_t child;
+    size_t size = 1;
+    unsigned i;
+
+    if (cpeg_term_archive_index(archive, pos) != *index ||
+        cpeg_term_archive_term(archive, *index) != pos ||
+        cpeg_term_archive_parent(archive, pos) != parent ||
+        cpeg_term_archive_type(archive, pos) != term->type ||
+        strcmp(cpeg_term_archive_value(archive, pos), term->value) != 0)
+        return 0;
+    (*index)++;
+
+    child = cpeg_term_archive_first_child(archive, pos);
+    for (i = 0; i < term->n_children; i++)
+    {
+        size_t child_size;
+
+        if (child == CPEG_ARCHIVE_NONE)
+            return 0;
+        child_size = test_archive_check(archive, term->children[i], child,
+                                        pos, index);
+        if (child_size == 0)
+            return 0;
+        size += child_size;
+        child = cpeg_term_archive_next_sibling(archive, child);
+    }
+    if (child != CPEG_ARCHIVE_NONE ||
+        cpeg_term_archive_subtree_size(archive, pos) != size)
+        return 0;
+    return size;
+}
+
+static bool
+test_archive_same_values(const cpeg_term *term1, const cpeg_term *term2)
+{
+    unsigned i;
+
+    if (strcmp(term1->value, term2->value) != 0 ||
+        (term1->type->init != NULL && term1->value == term2->value))
+        return false;
+    for (i = 0; i < term1->n_children; i++)
+    {
+        if (!test_archive_same_values(term1->children[i], term2->children[i]))
+            return false;
+    }
+    return true;
+}
+
+#endif
+
+/*
+ * The shape has an opening parenthesis (a set bit) and a closing one
+ * (a clear bit) for every term, in preorder; the bits are numbered
+ * from the least significant one of each word. The excess at a position
+ * is the number of opening parentheses before it minus the number of
+ * closing ones, so a term closes at the first position after it where
+ * the excess drops back, and its parent opens at the last position
+ * before it where the excess is one less.
+ *
+ * Blocks of the shape are the leaves of a perfect binary tree stored
+ * as a heap, whose nodes hold the total excess of their ranges and the
+ * minimum of the excess relative to the start of the range, taken over
+ * all positions from the start to the end inclusive.
+ */
+#define ARCHIVE_BLOCK_BITS 512
+#define ARCHIVE_BLOCK_WORDS (ARCHIVE_BLOCK_BITS / 64)
+
+typedef struct archive_pair {
+    const cpeg_term_type *type;
+    void *value;
+} archive_pair;
+
+struct cpeg_term_archive {
+    size_t n_terms;
+    size_t n_bits;
+    uint64_t *shape;
+    /* The number of opening parentheses before each block */
+    uint32_t *ranks;
+    size_t n_blocks;
+    size_t n_leaves;
+    int32_t *excess;
+    int32_t *min_excess;
+    unsigned n_pairs;
+    archive_pair *pairs;
+    /* Terms refer to their pairs by indices packed in `pair_bits` bits */
+    unsigned pair_bits;
+    uint64_t *pair_ids;
+};
+
+static inline bool
+archive_bit(const uint64_t *shape, size_t i)
+{
+    return (shape[i / 64] >> (i % 64)) & 1;
+}
+
+static inline unsigned
+archive_byte(const uint64_t *shape, size_t i)
+{
+    return (unsigned)(shape[i / 64] >> (i % 64)) & 0xff;
+}
+
+static inline size_t
+archive_block_end(const cpeg_term_archive *archive, size_t block)
+{
+    size_t end = (block + 1) * ARCHIVE_BLOCK_BITS;
+
+    return end < archive->n_bits ? end : archive->n_bits;
+}
+
+/*
+ * For every byte, its total excess and the minimum excess after each
+ * of its bits relative to its start (forward) or to its end (backward)
+ */
+static int8_t archive_byte_excess[256];
+static int8_t archive_byte_min[256];
+static int8_t archive_byte_back_min[256];
+static pthread_once_t archive_tables_once = PTHREAD_ONCE_INIT;
+
+static void
+archive_init_tables(void)
+{
+    unsigned byte;
+
+    for (byte = 0; byte < 256; byte++)
+    {
+        int e = 0;
+        int min = 8;
+        int back_min = 8;
+        unsigned k;
+
+        for (k = 0; k < 8; k++)
+        {
+            e += (byte >> k) & 1 ? 1 : -1;
+            if (e < min)
+                min = e;
+        }
+        archive_byte_excess[byte] = (int8_t)e;
+        archive_byte_min[byte] = (int8_t)min;
+
+        e = 0;
+        for (k = 8; k-- > 0;)
+        {
+            e -= (byte >> k) & 1 ? 1 : -1;
+            if (e < back_min)
+                back_min = e;
+        }
+        archive_byte_back_min[byte] = (int8_t)back_min;
+    }
+}
+
+/*
+ * Scans the bits from `from` up to `to`, `*e` being the excess before
+ * `from`; returns the first bit after which the excess is `target`,
+ * or `to`. Bytes that do not reach the target are skipped as a whole.
+ */
+static size_t
+archive_scan_forward(const uint64_t *shape, size_t from, size_t to,
+                     long *e, long target)
+{
+    size_t i = from;
+
+    while (i < to)
+    {
+        if (i % 8 == 0 && to - i >= 8)
+        {
+            unsigned byte = archive_byte(shape, i);
+
+            if (*e + archive_byte_min[byte] > target)
+            {
+                *e += archive_byte_excess[byte];
+                i += 8;
+                continue;
+            }
+        }
+        *e += archive_bit(shape, i) ? 1 : -1;
+        if (*e == target)
+            return i;
+        i++;
+    }
+    return to;
+}
+
+/*
+ * Scans the bits from `to` down to `from`, `*e` being the excess at
+ * `to`; returns the last position where the excess is `target`,
+ * or SIZE_MAX.
+ */
+static size_t
+archive_scan_backward(const uint64_t *shape, size_t from, size_t to,
+                      long *e, long target)
+{
+    size_t i = to;
+
+    while (i > from)
+    {
+        if (i % 8 == 0 && i - from >= 8)
+        {
+            unsigned byte = archive_byte(shape, i - 8);
+
+            if (*e + archive_byte_back_min[byte] > target)
+            {
+                *e -= archive_byte_excess[byte];
+                i -= 8;
+                continue;
+            }
+        }
+        i--;
+        *e -= archive_bit(shape, i) ? 1 : -1;
+        if (*e == target)
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+/* The first bit after which the excess relative to `from` is `target` */
+static size_t
+archive_forward(const cpeg_term_archive *archive, size_t from, long target)
+{
+    size_t block = from / ARCHIVE_BLOCK_BITS;
+    size_t end = archive_block_end(archive, block);
+    size_t node = archive->n_leaves + block;
+    long e = 0;
+    size_t found = archive_scan_forward(archive->shape, from, end, &e, target);
+
+    if (found < end)
+        return found;
+
+    for (;;)
+    {
+        if (node == 1)
+            return CPEG_ARCHIVE_NONE;
+        if (node % 2 == 0)
+        {
+            if (e + archive->min_excess[node + 1] <= target)
+            {
+                node++;
+                break;
+            }
+            e += archive->excess[node + 1];
+        }
+        node /= 2;
+    }
+    while (node < archive->n_leaves)
+    {
+        node *= 2;
+        if (e + archive->min_excess[node] > target)
+        {
+            e += archive->excess[node];
+            node++;
+        }
+    }
+
+    block = node - archive->n_leaves;
+    end = archive_block_end(archive, block);
+    found = archive_scan_forward(archive->shape, block * ARCHIVE_BLOCK_BITS,
+                                 end, &e, target);
+    assert(found < end);
+    return found;
+}
+
+/* The last position where the excess relative to `to` is `target` */
+static size_t
+archive_backward(const cpeg_term_archive *archive, size_t to, long target)
+{
+    size_t block = to / ARCHIVE_BLOCK_BITS;
+    size_t node = archive->n_leaves + block;
+    long e = 0;
+    size_t found = archive_scan_backward(archive->shape,
+                                         block * ARCHIVE_BLOCK_BITS, to,
+                                         &e, target);
+
+    if (found != SIZE_MAX)
+        return found;
+
+    for (;;)
+    {
+        if (node == 1)
+            return CPEG_ARCHIVE_NONE;
+        if (node % 2 == 1)
+        {
+            if (e + archive->min_excess[node - 1] -
+                archive->excess[node - 1] <= target)
+            {
+                node--;
+                break;
+            }
+            e -= archive->excess[node - 1];
+        }
+        node /= 2;
+    }
+    while (node < archive->n_leaves)
+    {
+        node = node * 2 + 1;
+        if (e + archive->min_excess[node] - archive->excess[node] > target)
+        {
+            e -= archive->excess[node];
+            node--;
+        }
+    }
+
+    block = node - archive->n_leaves;
+    found = archive_scan_backward(archive->shape, block * ARCHIVE_BLOCK_BITS,
+                                  archive_block_end(archive, block),
+                                  &e, target);
+    assert(found != SIZE_MAX);
+    return found;
+}
+
+static inline void
+archive_check_term(const cpeg_term_archive *archive, size_t term)
+{
+    assert(term < archive->n_bits && archive_bit(archive->shape, term));
+    (void)archive;
+    (void)term;
+}
+
+static inline size_t
+archive_close(const cpeg_term_archive *archive, size_t term)
+{
+    /* Most terms are leaves */
+    if (!archive_bit(archive->shape, term + 1))
+        return term + 1;
+    return archive_forward(archive, term, 0);
+}
+
+typedef struct archive_builder {
+    cpeg_term_archive *archive;
+    /* The pairs as found in the tree, by which they are looked up */
+    archive_pair *originals;
+    unsigned capacity;
+    /* Open addressing over pair indices plus one, twice the capacity */
+    uint32_t *slots;
+    size_t mask;
+    /* Siblings mostly have the same type and value */
+    const cpeg_term_type *last_type;
+    void *last_value;
+    uint32_t last_id;
+} archive_builder;
+
+static inline size_t
+archive_pair_hash(const cpeg_term_type *type, const void *value)
+{
+    uint64_t val = ((uintptr_t)type ^
+                    (type->hash ? type->hash(value) : (uintptr_t)value) *
+                    UINT64_C(0xc2b2ae3d27d4eb4f)) *
+        UINT64_C(0x9e3779b97f4a7c15);
+
+    return (size_t)(val >> 32 ^ val);
+}
+
+static uint32_t *
+archive_pair_probe(const archive_builder *builder,
+                   const cpeg_term_type *type, const void *value)
+{
+    size_t i;
+
+    for (i = archive_pair_hash(type, value) & builder->mask;
+         builder->slots[i] != 0; i = (i + 1) & builder->mask)
+    {
+        const archive_pair *pair = &builder->originals[builder->slots[i] - 1];
+
+        if (pair->type == type &&
+            (type->equal ? type->equal(pair->value, value) :
+             pair->value == value))
+            break;
+    }
+    return &builder->slots[i];
+}
+
+static void
+archive_grow_pairs(archive_builder *builder)
+{
+    cpeg_term_archive *archive = builder->archive;
+    unsigned i;
+
+    builder->capacity = builder->capacity == 0 ? 8 : builder->capacity * 2;
+    archive->pairs = cpeg_mem_realloc(archive->pairs, builder->capacity *
+                                      sizeof(*archive->pairs));
+    builder->originals = cpeg_mem_realloc(builder->originals,
+                                          builder->capacity *
+                                          sizeof(*builder->originals));
+    cpeg_mem_free(builder->slots);
+    builder->mask = builder->capacity * 2 - 1;
+    builder->slots = cpeg_mem_alloc((builder->mask + 1) *
+                                    sizeof(*builder->slots));
+    memset(builder->slots, 0, (builder->mask + 1) * sizeof(*builder->slots));
+    for (i = 0; i < archive->n_pairs; i++)
+    {
+        *archive_pair_probe(builder, builder->originals[i].type,
+                            builder->originals[i].value) = i + 1;
+    }
+}
+
+static uint32_t
+archive_pair_id(archive_builder *builder, const cpeg_term *term)
+{
+    cpeg_term_archive *archive = builder->archive;
+    uint32_t *slot;
+
+    if (term->type == builder->last_type && term->value == builder->last_value)
+        return builder->last_id;
+
+    slot = archive_pair_probe(builder, term->type, term->value);
+    if (*slot == 0)
+    {
+        if (archive->n_pairs == builder->capacity)
+        {
+            archive_grow_pairs(builder);
+            slot = archive_pair_probe(builder, term->type, term->value);
+        }
+        builder->originals[archive->n_pairs] = (archive_pair){
+            term->type, term->value
+        };
+        archive->pairs[archive->n_pairs] = (archive_pair){
+            term->type,
+            term->type->init ? term->type->init(term->value) : term->value
+        };
+        *slot = ++archive->n_pairs;
+    }
+    builder->last_type = term->type;
+    builder->last_value = term->value;
+    builder->last_id = *slot - 1;
+    return builder->last_id;
+}
+
+static inline uint32_t
+archive_pair_index(const cpeg_term_archive *archive, size_t index)
+{
+    size_t offset = index * archive->pair_bits;
+    unsigned shift = (unsigned)(offset % 64);
+    uint64_t bits = archive->pair_ids[offset / 64] >> shift;
+
+    if (shift + archive->pair_bits > 64)
+        bits |= archive->pair_ids[offset / 64 + 1] << (64 - shift);
+    return (uint32_t)(bits & ((UINT64_C(1) << archive->pair_bits) - 1));
+}
+
+static void
+archive_pack_pairs(cpeg_term_archive *archive, const uint32_t *ids)
+{
+    size_t n_words;
+    size_t i;
+
+    archive->pair_bits = 1;
+    while ((archive->n_pairs - 1) >> archive->pair_bits != 0)
+        archive->pair_bits++;
+
+    n_words = (archive->n_terms * archive->pair_bits + 63) / 64;
+    archive->pair_ids = cpeg_mem_alloc(n_words * sizeof(*archive->pair_ids));
+    memset(archive->pair_ids, 0, n_words * sizeof(*archive->pair_ids));
+    for (i = 0; i < archive->n_terms; i++)
+    {
+        size_t offset = i * archive->pair_bits;
+        unsigned shift = (unsigned)(offset % 64);
+
+        archive->pair_ids[offset / 64] |= (uint64_t)ids[i] << shift;
+        if (shift + archive->pair_bits > 64)
+        {
+            archive->pair_ids[offset / 64 + 1] |=
+                (uint64_t)ids[i] >> (64 - shift);
+        }
+    }
+}
+
+static void
+archive_index_shape(cpeg_term_archive *archive)
+{
+    size_t block;
+    size_t node;
+    uint32_t rank = 0;
+
+    archive->n_blocks = (archive->n_bits + ARCHIVE_BLOCK_BITS - 1) /
+        ARCHIVE_BLOCK_BITS;
+    for (archive->n_leaves = 1; archive->n_leaves < archive->n_blocks;
+         archive->n_leaves *= 2)
+        ;
+    archive->ranks = cpeg_mem_alloc(archive->n_blocks *
+                                    sizeof(*archive->ranks));
+    archive->excess = cpeg_mem_alloc(2 * archive->n_leaves *
+                                     sizeof(*archive->excess));
+    archive->min_excess = cpeg_mem_alloc(2 * archive->n_leaves *
+                                         sizeof(*archive->min_excess));
+
+    for (block = 0; block < archive->n_leaves; block++)
+    {
+        int32_t e = 0;
+        int32_t min = 0;
+        size_t i;
+
+        if (block < archive->n_blocks)
+        {
+            archive->ranks[block] = rank;
+            for (i = block * ARCHIVE_BLOCK_BITS;
+                 i < archive_block_end(archive, block); i++)
+            {
+                if (archive_bit(archive->shape, i))
+                {
+                    e++;
+                    rank++;
+                }
+                else if (--e < min)
+                    min = e;
+            }
+        }
+        archive->excess[archive->n_leaves + block] = e;
+        archive->min_excess[archive->n_leaves + block] = min;
+    }
+
+    for (node = archive->n_leaves - 1; node > 0; node--)
+    {
+        int32_t right = archive->excess[2 * node] +
+            archive->min_excess[2 * node + 1];
+
+        archive->excess[node] = archive->excess[2 * node] +
+            archive->excess[2 * node + 1];
+        archive->min_excess[node] = archive->min_excess[2 * node] < right ?
+            archive->min_excess[2 * node] : right;
+    }
+}
+
+typedef struct archive_frame {
+    const cpeg_term *term;
+    unsigned pos;
+} archive_frame;
+
+/* Room for `n_terms` terms, the shape having two bits per term */
+static void
+archive_grow_terms(cpeg_term_archive *archive, uint32_t **ids,
+                   size_t *capacity, size_t n_terms)
+{
+    size_t old_words = (2 * *capacity + 63) / 64;
+    size_t n_words = (2 * n_terms + 63) / 64;
+
+    assert(n_terms < UINT32_MAX);
+    archive->shape = cpeg_mem_realloc(archive->shape,
+                                      n_words * sizeof(*archive->shape));
+    memset(archive->shape + old_words, 0,
+           (n_words - old_words) * sizeof(*archive->shape));
+    *ids = cpeg_mem_realloc(*ids, n_terms * sizeof(**ids));
+    *capacity = n_terms;
+}
+
+cpeg_term_archive *
+cpeg_term_archive_create(const cpeg_term *term)
+{
+    cpeg_term_archive *archive = cpeg_mem_alloc(sizeof(*archive));
+    archive_builder builder = {.archive = archive};
+    uint32_t *ids = NULL;
+    size_t ids_capacity = 0;
+    archive_frame *stack;
+    unsigned depth = 0;
+    unsigned capacity = 16;
+    size_t pos = 0;
+    size_t index = 0;
+
+    /* No archive can be navigated before one is created */
+    pthread_once(&archive_tables_once, archive_init_tables);
+    memset(archive, 0, sizeof(*archive));
+    /* Only a hint, which cached metrics make exact and cheap */
+    archive_grow_terms(archive, &ids, &ids_capacity, cpeg_term_size(term));
+
+    archive_grow_pairs(&builder);
+
+    stack = cpeg_mem_alloc(capacity * sizeof(*stack));
+    stack[depth++] = (archive_frame){.term = term, .pos = 0};
+    archive->shape[0] |= 1;
+    ids[index++] = archive_pair_id(&builder, term);
+    pos++;
+    while (depth > 0)
+    {
+        archive_frame *top = &stack[depth - 1];
+        const cpeg_term *child;
+
+        if (top->pos == top->term->n_children)
+        {
+            /* Closing parentheses are already clear */
+            pos++;
+            depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        if (index == ids_capacity)
+            archive_grow_terms(archive, &ids, &ids_capacity, 2 * index);
+        archive->shape[pos / 64] |= UINT64_C(1) << (pos % 64);
+        ids[index++] = archive_pair_id(&builder, child);
+        pos++;
+
+        if (depth == capacity)
+        {
+            capacity *= 2;
+            stack = cpeg_mem_realloc(stack, capacity * sizeof(*stack));
+        }
+        stack[depth++] = (archive_frame){.term = child, .pos = 0};
+    }
+    assert(pos == 2 * index);
+    archive->n_terms = index;
+    archive->n_bits = pos;
+    archive->shape = cpeg_mem_realloc(archive->shape,
+                                      (pos + 63) / 64 *
+                                      sizeof(*archive->shape));
+
+    cpeg_mem_free(stack);
+    cpeg_mem_free(builder.slots);
+    cpeg_mem_free(builder.originals);
+    archive->pairs = cpeg_mem_realloc(archive->pairs, archive->n_pairs *
+                                      sizeof(*archive->pairs));
+    archive_pack_pairs(archive, ids);
+    cpeg_mem_free(ids);
+    archive_index_shape(archive);
+    return archive;
+}
+
+void
+cpeg_term_archive_destroy(cpeg_term_archive *archive)
+{
+    unsigned i;
+
+    if (archive == NULL)
+        return;
+
+    for (i = 0; i < archive->n_pairs; i++)
+    {
+        if (archive->pairs[i].type->destroy)
+            archive->pairs[i].type->destroy(archive->pairs[i].value);
+    }
+    cpeg_mem_free(archive->pairs);
+    cpeg_mem_free(archive->pair_ids);
+    cpeg_mem_free(archive->shape);
+    cpeg_mem_free(archive->ranks);
+    cpeg_mem_free(archive->excess);
+    cpeg_mem_free(archive->min_excess);
+    cpeg_mem_free(archive);
+}
+
+size_t
+cpeg_term_archive_memory(const cpeg_term_archive *archive)
+{
+    return sizeof(*archive) +
+        (archive->n_bits + 63) / 64 * sizeof(*archive->shape) +
+        archive->n_blocks * sizeof(*archive->ranks) +
+        2 * archive->n_leaves * (sizeof(*archive->excess) +
+                                 sizeof(*archive->min_excess)) +
+        archive->n_pairs * sizeof(*archive->pairs) +
+        (archive->n_terms * archive->pair_bits + 63) / 64 *
+        sizeof(*archive->pair_ids);
+}
+
+size_t
+cpeg_term_archive_n_terms(const cpeg_term_archive *archive)
+{
+    return archive->n_terms;
+}
+
+size_t
+cpeg_term_archive_parent(const cpeg_term_archive *archive, size_t term)
+{
+    archive_check_term(archive, term);
+    if (term == 0)
+        return CPEG_ARCHIVE_NONE;
+    if (archive_bit(archive->shape, term - 1))
+        return term - 1;
+    return archive_backward(archive, term, -1);
+}
+
+size_t
+cpeg_term_archive_first_child(const cpeg_term_archive *archive, size_t term)
+{
+    archive_check_term(archive, term);
+    return archive_bit(archive->shape, term + 1) ? term + 1 :
+        CPEG_ARCHIVE_NONE;
+}
+
+size_t
+cpeg_term_archive_next_sibling(const cpeg_term_archive *archive, size_t term)
+{
+    size_t next;
+
+    archive_check_term(archive, term);
+    next = archive_close(archive, term) + 1;
+    return next < archive->n_bits && archive_bit(archive->shape, next) ?
+        next : CPEG_ARCHIVE_NONE;
+}
+
+size_t
+cpeg_term_archive_subtree_size(const cpeg_term_archive *archive, size_t term)
+{
+    archive_check_term(archive, term);
+    return (archive_close(archive, term) - term + 1) / 2;
+}
+
+size_t
+cpeg_term_archive_index(const cpeg_term_archive *archive, size_t term)
+{
+    size_t block = term / ARCHIVE_BLOCK_BITS;
+    size_t rank;
+    size_t word;
+
+    archive_check_term(archive, term);
+    rank = archive->ranks[block];
+    for (word = block * ARCHIVE_BLOCK_WORDS; word < term / 64; word++)
+        rank += (size_t)__builtin_popcountll(archive->shape[word]);
+    return rank + (size_t)__builtin_popcountll(archive->shape[word] &
+                                               ((UINT64_C(1) << term % 64) -
+                                                1));
+}
+
+size_t
+cpeg_term_archive_term(const cpeg_term_archive *archive, size_t index)
+{
+    size_t lo = 0;
+    size_t hi = archive->n_blocks;
+    size_t word;
+    uint64_t bits;
+
+    assert(index < archive->n_terms);
+    /* The last block with fewer opening parentheses before it */
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (archive->ranks[mid] <= index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    index -= archive->ranks[lo];
+    for (word = lo * ARCHIVE_BLOCK_WORDS;; word++)
+    {
+        size_t ones = (size_t)__builtin_popcountll(archive->shape[word]);
+
+        if (index < ones)
+            break;
+        index -= ones;
+    }
+    for (bits = archive->shape[word]; index > 0; index--)
+        bits &= bits - 1;
+    return word * 64 + (size_t)__builtin_ctzll(bits);
+}
+
+const cpeg_term_type *
+cpeg_term_archive_type(const cpeg_term_archive *archive, size_t term)
+{
+    return archive->pairs[archive_pair_index(
+            archive, cpeg_term_archive_index(archive, term))].type;
+}
+
+void *
+cpeg_term_archive_value(const cpeg_term_archive *archive, size_t term)
+{
+    return archive->pairs[archive_pair_index(
+            archive, cpeg_term_archive_index(archive, term))].value;
+}
+
+typedef struct archive_extract_frame {
+    unsigned mark;
+    uint32_t pair;
+} archive_extract_frame;
+
+cpeg_term *
+cpeg_term_archive_extract(const cpeg_term_archive *archive, size_t term)
+{
+    cpeg_term_builder builder;
+    archive_extract_frame *stack;
+    unsigned depth = 0;
+    unsigned capacity = 16;
+    size_t end;
+    size_t index;
+    size_t pos;
+    cpeg_term *result = NULL;
+
+    archive_check_term(archive, term);
+    end = archive_close(archive, term);
+    index = cpeg_term_archive_index(archive, term);
+    cpeg_term_builder_init(&builder);
+    stack = cpeg_mem_alloc(capacity * sizeof(*stack));
+
+    for (pos = term; pos <= end; pos++)
+    {
+        const archive_pair *pair;
+
+        if (archive_bit(archive->shape, pos))
+        {
+            if (depth == capacity)
+            {
+                capacity *= 2;
+                stack = cpeg_mem_realloc(stack, capacity * sizeof(*stack));
+            }
+            stack[depth++] = (archive_extract_frame){
+                .mark = cpeg_term_builder_mark(&builder),
+                .pair = archive_pair_index(archive, index++)
+            };
+            continue;
+        }
+
+        depth--;
+        pair = &archive->pairs[stack[depth].pair];
+        result = cpeg_term_builder_finish(&builder, stack[depth].mark,
+                                          pair->type, pair->value);
+        if (depth > 0)
+            cpeg_term_builder_add(&builder, result);
+    }
+    assert(depth == 0);
+
+    cpeg_mem_free(stack);
+    cpeg_term_builder_fini(&builder);
+    return result;
+}
+
+#ifdef LIBCPEG_TESTING
+
+CQC_TESTCASE(test_archive,
+             "An archived tree can be navigated like the original one "
+             "and extracted back")
+{
+    cqc_forall_range(unsigned, n, 1, 3000)
+    {
+        cqc_forall_range(unsigned, spine, 0, 1)
+        {
+            cqc_expect
+            {
+                unsigned saved_cnt = test_archive_object_count;
+                unsigned next = 0;
+                cpeg_term *t = spine ? test_archive_spine(n) :
+                    test_archive_tree(&next, n);
+                size_t size = cpeg_term_size(t);
+                cpeg_term_archive *archive = cpeg_term_archive_create(t);
+                size_t index = 0;
+                cpeg_term *copy;
+
+                cqc_assert_eq(size_t, cpeg_term_archive_n_terms(archive),
+                              size);
+                cqc_assert_eq(size_t,
+                              test_archive_check(archive, t, 0,
+                                                 CPEG_ARCHIVE_NONE, &index),
+                              size);
+                cqc_assert_eq(size_t, index, size);
+                cqc_assert_eq(size_t,
+                              cpeg_term_archive_next_sibling(archive, 0),
+                              CPEG_ARCHIVE_NONE);
+                cqc_assert(cpeg_term_archive_memory(archive) <
+                           size * sizeof(cpeg_term) / 4 + 1024);
+
+                copy = cpeg_term_archive_extract(archive, 0);
+                cqc_assert(cpeg_term_isomorphic(t, copy));
+                cqc_assert(test_archive_same_values(t, copy));
+                cpeg_term_free(copy);
+                if (t->n_children > 0)
+                {
+                    copy = cpeg_term_archive_extract(archive, 1);
+                    cqc_assert(cpeg_term_isomorphic(t->children[0], copy));
+                    cpeg_term_free(copy);
+                }
+
+                cpeg_term_free(t);
+                /* Only the five labels of one type are copied */
+                cqc_assert(test_archive_object_count - saved_cnt <= 5);
+                cpeg_term_archive_destroy(archive);
+                cqc_assert_eq(unsigned, test_archive_object_count, saved_cnt);
+            }
+        }
+    }
+}
+
+CQC_TESTCASE(test_archive_shared,
+             "Shared subterms are archived once per occurrence")
+{
+    cqc_forall_range(unsigned, depth, 0, 300)
+    {
+        cqc_expect
+        {
+            cpeg_term *sub = test_archive_spine(depth);
+            cpeg_term *t = cpeg_term_newl(&test_archive_type, (void *)"root",
+                                          sub, cpeg_term_use(sub), NULL);
+            cpeg_term_archive *archive = cpeg_term_archive_create(t);
+            size_t second;
+            cpeg_term *copy;
+
+            cqc_assert_eq(size_t, cpeg_term_archive_n_terms(archive),
+                          4 * depth + 3);
+            second = cpeg_term_archive_next_sibling(archive, 1);
+            cqc_assert_eq(size_t, second, 4 * depth + 3);
+            cqc_assert_eq(size_t, cpeg_term_archive_parent(archive, second),
+                          0);
+            cqc_assert_eq(size_t, cpeg_term_archive_index(archive, second),
+                          2 * depth + 2);
+
+            copy = cpeg_term_archive_extract(archive, 0);
+            cqc_assert(cpeg_term_isomorphic(t, copy));
+            cqc_assert(copy->children[0] != copy->children[1]);
+            cpeg_term_free(copy);
+            cpeg_term_archive_destroy(archive);
+            cpeg_term_free(t);
+        }
+    }
+}
+
+#endif
@@ -1,11 +1,15 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include "libcpeg_memattr.h"
+#include "libcpeg_ptrmap.h"
 #include "libcpeg_terms.h"
+#include "libcpeg_stats.h"
 #ifdef LIBCPEG_TESTING
 #include "cqc.h"
 #endif
@@ -75,217 +79,2683 @@ cpeg_term_validate(const cpeg_term *term)
 
 #endif
 
-static cpeg_term *term_free_list;
+/*
+ * Terms are allocated in size classes by their inline capacity:
+ * class 1 has no inline children, class k > 1 has 2^(k - 2) of them.
+ * Terms wider than the largest class are allocated exactly and
+ * not pooled.
+ */
+#define TERM_SIZE_CLASSES 8
+#define TERM_MAX_POOLED_CHILDREN (1u << (TERM_SIZE_CLASSES - 2))
+
+/*
+ * Free terms are cached per thread in magazines of up to
+ * TERM_MAGAZINE_SIZE terms chained through their `value`.
+ * Each thread has a loaded magazine it allocates from and frees to,
+ * and a spare one; full magazines are exchanged with the global depot,
+ * so the depot lock is taken once per TERM_MAGAZINE_SIZE operations
+ * at most, and terms freed on another thread are returned to
+ * circulation in batches.
+ */
+#define TERM_MAGAZINE_SIZE 256
+
+typedef struct term_magazine {
+    cpeg_term *head;
+    unsigned count;
+} term_magazine;
+
+typedef struct term_cache {
+    term_magazine loaded[TERM_SIZE_CLASSES + 1];
+    term_magazine spare[TERM_SIZE_CLASSES + 1];
+} term_cache;
+
+static __thread term_cache term_local_cache;
+static __thread bool term_local_cache_active;
+
+static struct {
+    term_magazine *magazines;
+    size_t n_magazines;
+    size_t capacity;
+} term_depot[TERM_SIZE_CLASSES + 1];
+
+/*
+ * The depot keeps at most this many magazines of each class,
+ * anything above is returned to malloc right away.
+ */
+#define TERM_DEPOT_DEFAULT_LIMIT 64
+
+static size_t term_depot_limit = TERM_DEPOT_DEFAULT_LIMIT;
+
+static pthread_mutex_t term_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t term_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t term_cache_key;
+
+/*
+ * Statistics are counted per thread along with the cache and only
+ * summed up by cpeg_term_stats_snapshot(). The owning thread updates
+ * its counters with relaxed atomic stores, which cost no more than
+ * plain ones, so that they may be read concurrently. Counters of exited
+ * threads are moved to `term_stats_retired`. All the lists are
+ * protected by the depot lock.
+ */
+#define TERM_STATS_TYPES 64
+
+typedef struct term_type_count {
+    const cpeg_term_type *type;
+    unsigned long live;
+} term_type_count;
+
+typedef struct term_stats {
+    unsigned long reclaimed;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long cached;
+    unsigned long other_live;
+    term_type_count types[TERM_STATS_TYPES];
+    struct term_stats *prev;
+    struct term_stats *next;
+} term_stats;
+
+static __thread term_stats term_local_stats;
+static term_stats *term_stats_threads;
+static term_stats term_stats_retired;
+
+static inline void
+term_stat_add(unsigned long *counter, unsigned long delta)
+{
+    __atomic_store_n(counter, *counter + delta, __ATOMIC_RELAXED);
+}
+
+static inline void
+term_stat_sub(unsigned long *counter, unsigned long delta)
+{
+    __atomic_store_n(counter, *counter - delta, __ATOMIC_RELAXED);
+}
+
+/* Live terms of a type; types that do not fit are counted together */
+static unsigned long *
+term_stats_type_live(term_stats *stats, const cpeg_term_type *type)
+{
+    size_t i = (size_t)(((uintptr_t)type * UINT64_C(0x9e3779b97f4a7c15)) >>
+                        32) & (TERM_STATS_TYPES - 1);
+    unsigned n;
+
+    for (n = 0; n < TERM_STATS_TYPES; n++, i = (i + 1) & (TERM_STATS_TYPES - 1))
+    {
+        if (stats->types[i].type == type)
+            return &stats->types[i].live;
+        if (stats->types[i].type == NULL)
+        {
+            __atomic_store_n(&stats->types[i].type, type, __ATOMIC_RELEASE);
+            return &stats->types[i].live;
+        }
+    }
+    return &stats->other_live;
+}
+
+static void
+term_stats_retire(term_stats *stats)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&term_depot_lock);
+    term_stats_retired.reclaimed += stats->reclaimed;
+    term_stats_retired.cache_hits += stats->cache_hits;
+    term_stats_retired.cache_misses += stats->cache_misses;
+    term_stats_retired.cached += stats->cached;
+    term_stats_retired.other_live += stats->other_live;
+    for (i = 0; i < TERM_STATS_TYPES; i++)
+    {
+        if (stats->types[i].type != NULL)
+        {
+            *term_stats_type_live(&term_stats_retired, stats->types[i].type) +=
+                stats->types[i].live;
+        }
+    }
+
+    if (stats->prev != NULL)
+        stats->prev->next = stats->next;
+    else
+        term_stats_threads = stats->next;
+    if (stats->next != NULL)
+        stats->next->prev = stats->prev;
+    pthread_mutex_unlock(&term_depot_lock);
+
+    memset(stats, 0, sizeof(*stats));
+}
+
+static size_t
+term_magazine_release(term_magazine *mag)
+{
+    size_t count = mag->count;
+
+    while (mag->head != NULL)
+    {
+        cpeg_term *term = mag->head;
+
+        mag->head = term->value;
+        cpeg_mem_free(term);
+    }
+    mag->count = 0;
+    return count;
+}
+
+static void
+term_depot_put(unsigned class, term_magazine *mag)
+{
+    if (mag->count == 0)
+        return;
+
+    term_stat_sub(&term_local_stats.cached, mag->count);
+
+    pthread_mutex_lock(&term_depot_lock);
+    if (term_depot[class].n_magazines >= term_depot_limit)
+    {
+        pthread_mutex_unlock(&term_depot_lock);
+        term_magazine_release(mag);
+        return;
+    }
+    if (term_depot[class].n_magazines == term_depot[class].capacity)
+    {
+        term_depot[class].capacity = term_depot[class].capacity * 2 + 1;
+        term_depot[class].magazines =
+            realloc(term_depot[class].magazines,
+                    term_depot[class].capacity *
+                    sizeof(*term_depot[class].magazines));
+        assert(term_depot[class].magazines != NULL);
+    }
+    term_depot[class].magazines[term_depot[class].n_magazines++] = *mag;
+    pthread_mutex_unlock(&term_depot_lock);
+
+    mag->head = NULL;
+    mag->count = 0;
+}
+
+static void
+term_depot_get(unsigned class, term_magazine *mag)
+{
+    pthread_mutex_lock(&term_depot_lock);
+    if (term_depot[class].n_magazines > 0)
+        *mag = term_depot[class].magazines[--term_depot[class].n_magazines];
+    pthread_mutex_unlock(&term_depot_lock);
+
+    term_stat_add(&term_local_stats.cached, mag->count);
+}
+
+static bool reclaim_drain(size_t budget);
+
+static void
+term_cache_flush(void *data)
+{
+    term_cache *cache = data;
+    unsigned class;
+
+    reclaim_drain(SIZE_MAX);
+
+    for (class = 1; class <= TERM_SIZE_CLASSES; class++)
+    {
+        term_depot_put(class, &cache->loaded[class]);
+        term_depot_put(class, &cache->spare[class]);
+    }
+    term_stats_retire(&term_local_stats);
+    term_local_cache_active = false;
+}
+
+static void
+term_cache_create_key(void)
+{
+    int rc = pthread_key_create(&term_cache_key, term_cache_flush);
+
+    assert(rc == 0);
+    (void)rc;
+}
+
+/* Makes sure the cache is flushed to the depot when the thread exits */
+static void
+term_cache_activate(void)
+{
+    pthread_once(&term_cache_once, term_cache_create_key);
+    pthread_setspecific(term_cache_key, &term_local_cache);
+    term_local_cache_active = true;
+
+    pthread_mutex_lock(&term_depot_lock);
+    term_local_stats.prev = NULL;
+    term_local_stats.next = term_stats_threads;
+    if (term_stats_threads != NULL)
+        term_stats_threads->prev = &term_local_stats;
+    term_stats_threads = &term_local_stats;
+    pthread_mutex_unlock(&term_depot_lock);
+}
+
+static inline term_stats *
+term_stats_local(void)
+{
+    if (!term_local_cache_active)
+        term_cache_activate();
+    return &term_local_stats;
+}
+
+static cpeg_term *
+term_cache_pop(unsigned class)
+{
+    term_magazine *mag = &term_local_cache.loaded[class];
+    cpeg_term *term;
+
+    if (mag->head == NULL)
+    {
+        term_magazine *spare = &term_local_cache.spare[class];
+
+        if (spare->head != NULL)
+        {
+            *mag = *spare;
+            spare->head = NULL;
+            spare->count = 0;
+        }
+        else
+        {
+            if (!term_local_cache_active)
+                term_cache_activate();
+            term_depot_get(class, mag);
+            if (mag->head == NULL)
+                return NULL;
+        }
+    }
+    term = mag->head;
+    mag->head = term->value;
+    mag->count--;
+    term_stat_sub(&term_local_stats.cached, 1);
+    return term;
+}
+
+static void
+term_cache_push(unsigned class, cpeg_term *term)
+{
+    term_magazine *mag = &term_local_cache.loaded[class];
+
+    if (!term_local_cache_active)
+        term_cache_activate();
+    if (mag->count >= TERM_MAGAZINE_SIZE)
+    {
+        term_magazine *spare = &term_local_cache.spare[class];
+
+        term_depot_put(class, spare);
+        *spare = *mag;
+        mag->head = NULL;
+        mag->count = 0;
+    }
+    term->value = mag->head;
+    mag->head = term;
+    mag->count++;
+    term_stat_add(&term_local_stats.cached, 1);
+}
+
+/* Releases the magazines above `limit` in the depot */
+static size_t
+term_depot_shrink(size_t limit)
+{
+    size_t released = 0;
+    unsigned class;
+
+    for (class = 1; class <= TERM_SIZE_CLASSES; class++)
+    {
+        for (;;)
+        {
+            term_magazine mag = {NULL, 0};
+
+            pthread_mutex_lock(&term_depot_lock);
+            if (term_depot[class].n_magazines > limit)
+            {
+                mag = term_depot[class].magazines[
+                    --term_depot[class].n_magazines];
+            }
+            else if (term_depot[class].n_magazines == 0)
+            {
+                free(term_depot[class].magazines);
+                term_depot[class].magazines = NULL;
+                term_depot[class].capacity = 0;
+            }
+            pthread_mutex_unlock(&term_depot_lock);
+
+            if (mag.head == NULL)
+                break;
+            released += term_magazine_release(&mag);
+        }
+    }
+    return released;
+}
+
+void
+cpeg_term_cache_limit(size_t n_terms)
+{
+    size_t limit = n_terms / TERM_MAGAZINE_SIZE;
+
+    pthread_mutex_lock(&term_depot_lock);
+    term_depot_limit = limit;
+    pthread_mutex_unlock(&term_depot_lock);
+
+    term_depot_shrink(limit);
+}
+
+size_t
+cpeg_term_cache_trim(void)
+{
+    size_t released = 0;
+    unsigned class;
+
+    for (class = 1; class <= TERM_SIZE_CLASSES; class++)
+    {
+        size_t count = term_local_cache.loaded[class].count +
+            term_local_cache.spare[class].count;
+
+        term_stat_sub(&term_local_stats.cached, count);
+        released += term_magazine_release(&term_local_cache.loaded[class]);
+        released += term_magazine_release(&term_local_cache.spare[class]);
+    }
+    return released + term_depot_shrink(0);
+}
+
+static unsigned
+term_size_class(unsigned n_children)
+{
+    unsigned class = 1;
+    unsigned cap = 0;
+
+    if (n_children > TERM_MAX_POOLED_CHILDREN)
+        return 0;
+
+    while (cap < n_children)
+    {
+        cap = cap == 0 ? 1 : cap * 2;
+        class++;
+    }
+    return class;
+}
+
+static unsigned
+term_class_capacity(unsigned class)
+{
+    return class <= 1 ? 0 : 1u << (class - 2);
+}
+
+static cpeg_term *
+alloc_term(const cpeg_term_type *type, unsigned n_children)
+{
+    unsigned class = term_size_class(n_children);
+    unsigned capacity = class == 0 ? n_children : term_class_capacity(class);
+    cpeg_term *term = class == 0 ? NULL : term_cache_pop(class);
+    term_stats *stats = term_stats_local();
+
+    if (term == NULL)
+    {
+        term = cpeg_mem_alloc(sizeof(*term) +
+                              capacity * sizeof(*term->inline_children));
+        assert(term != NULL);
+        term_stat_add(&stats->cache_misses, 1);
+    }
+    else
+    {
+        term_stat_add(&stats->cache_hits, 1);
+    }
+    term_stat_add(term_stats_type_live(stats, type), 1);
+    term->type     = type;
+    term->refcnt   = 1;
+    term->capacity = capacity;
+    term->flags    = class;
+    term->children = capacity == 0 ? NULL : term->inline_children;
+#ifdef LIBCPEG_TERM_METRICS
+    term->metrics.parent = NULL;
+#endif
+    return term;
+}
+
+static void
+reserve_children(cpeg_term *term, unsigned n_children)
+{
+    if (n_children <= term->capacity)
+        return;
+
+    /* Terms grown a child at a time are resized a logarithmic number of times */
+    if (n_children < term->capacity * 2)
+        n_children = term->capacity * 2;
+
+    if (term->children != NULL && term->children != term->inline_children)
+    {
+        term->children = cpeg_mem_realloc(term->children,
+                                          n_children *
+                                          sizeof(*term->children));
+    }
+    else
+    {
+        cpeg_term **children = cpeg_mem_alloc(n_children *
+                                               sizeof(*children));
+
+        if (term->n_children > 0)
+        {
+            memcpy(children, term->children,
+                   term->n_children * sizeof(*children));
+        }
+        term->children = children;
+    }
+    term->capacity = n_children;
+}
+
+#ifdef LIBCPEG_TERM_METRICS
+/* The epoch of metrics whose descendants have been edited since */
+#define TERM_METRICS_DIRTY SIZE_MAX
+/* The parent of terms covered by several terms, or by immortal ones */
+#define TERM_METRICS_MANY ((cpeg_term *)1)
+
+static inline size_t term_metrics_current(void);
+static void term_metrics_compute(cpeg_term *term);
+static void term_metrics_add(const cpeg_term *term,
+                             cpeg_term_metrics *metrics,
+                             const cpeg_term *child, bool first);
+static void term_metrics_insert(cpeg_term *term, unsigned pos);
+static void term_metrics_remove(cpeg_term *term, unsigned pos,
+                                const cpeg_term *removed);
+static bool term_metrics_begin(cpeg_term *term);
+static void term_metrics_unlink(const cpeg_term *term);
+static size_t term_shape_refresh(cpeg_term *term);
+#else
+static inline void
+term_metrics_compute(__attribute__((unused)) cpeg_term *term)
+{
+}
+#endif
+
+static void term_memo_invalidate(cpeg_term *term);
+
+static void
+alloc_children(cpeg_term *term, unsigned n_children,
+               cpeg_term *children[], bool share)
+{
+    unsigned i;
+
+    reserve_children(term, n_children);
+    term->n_children = n_children;
+    for (i = 0; i < n_children; i++)
+        term->children[i] = share ? cpeg_term_use(children[i]) : children[i];
+    term_metrics_compute(term);
+}
+
+/*
+ * All the tree walks below use an explicit stack instead of recursion,
+ * so that the depth of a term is only limited by the available memory.
+ * A stack starts in a small buffer within the walker's own frame and
+ * moves to the heap when it grows deeper; it is private to a single
+ * walk, so callbacks may start nested walks freely.
+ */
+#define TERM_STACK_INITIAL 32
+
+typedef struct term_frame {
+    const cpeg_term *term;
+    const cpeg_term *other;
+    unsigned pos;
+} term_frame;
+
+typedef struct term_stack {
+    term_frame *frames;
+    size_t depth;
+    size_t capacity;
+    term_frame initial[TERM_STACK_INITIAL];
+} term_stack;
+
+typedef struct term_results {
+    void **items;
+    size_t n_items;
+    size_t capacity;
+    void *initial[TERM_STACK_INITIAL];
+} term_results;
+
+static void
+term_stack_init(term_stack *stack)
+{
+    stack->frames = stack->initial;
+    stack->depth = 0;
+    stack->capacity = TERM_STACK_INITIAL;
+}
+
+static void
+term_stack_fini(term_stack *stack)
+{
+    if (stack->frames != stack->initial)
+        free(stack->frames);
+}
+
+static void
+term_stack_push(term_stack *stack, const cpeg_term *term,
+                const cpeg_term *other)
+{
+    term_frame *frame;
+
+    if (stack->depth == stack->capacity)
+    {
+        size_t capacity = stack->capacity * 2;
+        term_frame *frames;
+
+        if (stack->frames == stack->initial)
+        {
+            frames = malloc(capacity * sizeof(*frames));
+            assert(frames != NULL);
+            memcpy(frames, stack->initial, sizeof(stack->initial));
+        }
+        else
+        {
+            frames = realloc(stack->frames, capacity * sizeof(*frames));
+            assert(frames != NULL);
+        }
+        stack->frames = frames;
+        stack->capacity = capacity;
+    }
+    frame = &stack->frames[stack->depth++];
+    frame->term = term;
+    frame->other = other;
+    frame->pos = 0;
+}
+
+static inline term_frame *
+term_stack_top(term_stack *stack)
+{
+    return &stack->frames[stack->depth - 1];
+}
+
+static void
+term_results_init(term_results *results)
+{
+    results->items = results->initial;
+    results->n_items = 0;
+    results->capacity = TERM_STACK_INITIAL;
+}
+
+static void
+term_results_fini(term_results *results)
+{
+    if (results->items != results->initial)
+        free(results->items);
+}
+
+/* Always leaves room for one more item */
+static void
+term_results_push(term_results *results, void *item)
+{
+    results->items[results->n_items++] = item;
+    if (results->n_items == results->capacity)
+    {
+        size_t capacity = results->capacity * 2;
+        void **items;
+
+        if (results->items == results->initial)
+        {
+            items = malloc(capacity * sizeof(*items));
+            assert(items != NULL);
+            memcpy(items, results->initial, sizeof(results->initial));
+        }
+        else
+        {
+            items = realloc(results->items, capacity * sizeof(*items));
+            assert(items != NULL);
+        }
+        results->items = items;
+        results->capacity = capacity;
+    }
+}
+
+typedef void *(*term_fold_fn)(const cpeg_term *, void *[], void *);
+
+/*
+ * Calls `fn` for each subterm in postorder, passing it the results
+ * for all its children.
+ */
+static void *
+term_fold(term_fold_fn fn, const cpeg_term *term, void *data)
+{
+    term_stack stack;
+    term_results results;
+    void *result;
+
+    term_stack_init(&stack);
+    term_results_init(&results);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *current = top->term;
+
+        if (top->pos < current->n_children)
+        {
+            term_stack_push(&stack, current->children[top->pos++], NULL);
+            continue;
+        }
+
+        results.n_items -= current->n_children;
+        result = fn(current, &results.items[results.n_items], data);
+        term_results_push(&results, result);
+        stack.depth--;
+    }
+    result = results.items[0];
+
+    term_results_fini(&results);
+    term_stack_fini(&stack);
+    return result;
+}
+
+/* Only terms referenced more than once may be reached by several paths */
+static inline bool
+term_multiref(const cpeg_term *term)
+{
+    if (term->flags & CPEG_TERM_SHARED)
+        return __atomic_load_n(&term->refcnt, __ATOMIC_RELAXED) > 1;
+    return term->refcnt > 1;
+}
+
+/*
+ * Like term_fold(), but the results for terms referenced more than
+ * once are remembered, so that `fn` is called once per distinct
+ * subterm. If the results are `terms`, every reuse of a result takes
+ * a new reference to it.
+ */
+static void *
+term_fold_dag(term_fold_fn fn, const cpeg_term *term, void *data, bool terms)
+{
+    term_stack stack;
+    term_results results;
+    cpeg_ptrmap seen;
+    void *result;
+
+    term_stack_init(&stack);
+    term_results_init(&results);
+    cpeg_ptrmap_init(&seen);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *current = top->term;
+
+        if (top->pos < current->n_children)
+        {
+            const cpeg_term *child = current->children[top->pos++];
+            void **known = term_multiref(child) ?
+                cpeg_ptrmap_lookup(&seen, child) : NULL;
+
+            if (known == NULL)
+                term_stack_push(&stack, child, NULL);
+            else
+                term_results_push(&results,
+                                  terms ? cpeg_term_use(*known) : *known);
+            continue;
+        }
+
+        results.n_items -= current->n_children;
+        result = fn(current, &results.items[results.n_items], data);
+        if (term_multiref(current))
+            *cpeg_ptrmap_insert(&seen, current) = result;
+        term_results_push(&results, result);
+        stack.depth--;
+    }
+    result = results.items[0];
+
+    cpeg_ptrmap_fini(&seen);
+    term_results_fini(&results);
+    term_stack_fini(&stack);
+    return result;
+}
+
+cpeg_term *
+cpeg_term_new(const cpeg_term_type *type, void *value,
+              unsigned n_children, cpeg_term *children[])
+{
+    cpeg_term *term = alloc_term(type, n_children);
+
+    term->value  = type->init ? type->init(value) : value;
+    alloc_children(term, n_children, children, false);
+
+    return term;
+}
+
+#ifdef LIBCPEG_TESTING
+CQC_TESTCASE(term_new, "Any term is valid")
+{
+    cqc_forall(cpeg_term_ptr, t)
+    {
+        cqc_expect
+        {
+            cpeg_term_validate(t);
+        }
+    }
+}
+
+
+CQC_TESTCASE(term_new_no_use,
+             "Term construction does not automatically increment refcounters")
+{
+    cqc_forall(cpeg_term_ptr, t1)
+    {
+        cqc_expect
+        {
+            cpeg_term_ptr t2 = cpeg_term_newl(&test_term_type, NULL,
+                                              t1, NULL);
+            cqc_assert_eq(unsigned, t1->refcnt, 1);
+            cqc_assert_eq(unsigned, t2->n_children, 1);
+            cqc_assert_eq(cpeg_term_ptr, t2->children[0], t1);
+        }
+    }
+}
+
+
+CQC_TESTCASE(terms_reused,
+             "A reclaimed term is reused at the next allocation "
+             "of the same size")
+{
+    cqc_forall(cpeg_term_ptr, t)
+    {
+        cqc_expect
+        {
+            uintptr_t oldv = (uintptr_t)t->value;
+            unsigned n = t->n_children;
+            cpeg_term *children[n + 1];
+            cpeg_term *leaf = CPEG_TERM_LEAF(test_term_type, NULL);
+            cpeg_term *nt;
+            unsigned i;
+
+            for (i = 0; i < n; i++)
+                children[i] = leaf;
+            cpeg_term_free(t);
+            nt = cpeg_term_new(&test_term_type, (void *)(oldv + 1),
+                               n, children);
+            cqc_assert_eq(cpeg_term_ptr, t, nt);
+            cqc_assert_eq(cqc_opaque, t->value, (void *)(oldv + 1));
+            cqc_assert_eq(unsigned, t->n_children, n);
+            cqc_assert_eq(cqc_opaque, t->children,
+                          n == 0 ? NULL : t->inline_children);
+        }
+    }
+}
+
+
+CQC_TESTCASE(term_children_inline,
+             "Children of a new term are stored inline")
+{
+    cqc_forall(cpeg_term_ptr, t)
+    {
+        cqc_expect
+        {
+            cqc_assert(t->capacity >= t->n_children);
+            if (t->n_children > 0)
+            {
+                cqc_assert_eq(cqc_opaque, t->children,
+                              t->inline_children);
+            }
+        }
+    }
+}
+
+
+CQC_TESTCASE(term_children_spill,
+             "Grafting past the inline capacity keeps all children")
+{
+    cqc_forall(cpeg_term_ptr, t)
+    {
+        cqc_expect
+        {
+            unsigned n = t->n_children;
+            unsigned extra = t->capacity - n + 1;
+            cpeg_term *leaf = CPEG_TERM_LEAF(test_term_type, NULL);
+            unsigned i;
+
+            for (i = 0; i < extra; i++)
+                cpeg_term_graft(t, 0, leaf);
+            cqc_assert_eq(unsigned, t->n_children, n + extra);
+            cqc_assert_neq(cqc_opaque, t->children, t->inline_children);
+            for (i = 0; i < extra; i++)
+                cqc_assert_eq(cpeg_term_ptr, t->children[i], leaf);
+            cpeg_term_validate(t);
+        }
+    }
+}
+
+
+CQC_TESTCASE(test_static_term,
+             "Statically declared terms are not refcounted")
+{
+    cqc_once
+    {
+        cqc_expect
+        {
+            cpeg_term *t = CPEG_TERM_LEAF(test_term_type, NULL);
+            cpeg_term_use(t);
+            cqc_assert_eq(unsigned, t->refcnt, UINT_MAX);
+            cpeg_term_free(t);
+            cqc_assert_eq(unsigned, t->refcnt, UINT_MAX);
+        }
+    }
+}
+
+static void *
+use_and_free_shared(void *data)
+{
+    cpeg_term *t = data;
+    unsigned i;
+
+    for (i = 0; i < 10000; i++)
+    {
+        cpeg_term_use(t);
+        if (t->n_children > 0)
+            cpeg_term_use(t->children[0]);
+        cpeg_term_free(t);
+        if (t->n_children > 0)
+            cpeg_term_free(t->children[0]);
+    }
+    return NULL;
+}
+
+CQC_TESTCASE(test_shared_term,
+             "Shared terms are refcounted atomically by all threads")
+{
+    cqc_forall(cpeg_term_ptr, t)
+    {
+        cqc_expect
+        {
+            pthread_t threads[4];
+            unsigned i;
+
+            cpeg_term_share(t);
+            cqc_assert(t->flags & CPEG_TERM_SHARED);
+            for (i = 0; i < sizeof(threads) / sizeof(*threads); i++)
+                pthread_create(&threads[i], NULL, use_and_free_shared, t);
+            for (i = 0; i < sizeof(threads) / sizeof(*threads); i++)
+                pthread_join(threads[i], NULL);
+            cqc_assert_eq(unsigned, t->refcnt, 1);
+            if (t->n_children > 0)
+            {
+                cqc_assert(t->children[0]->flags & CPEG_TERM_SHARED);
+                cqc_assert_eq(unsigned, t->children[0]->refcnt, 1);
+            }
+        }
+    }
+}
+
+CQC_TESTCASE(test_share_reaches_all,
+             "Sharing marks terms under immortal ones and terms grafted "
+             "into shared ones")
+{
+    cqc_expect
+    {
+        cpeg_term *below = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *grafted = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *glued = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *side = cpeg_term_newl(&test_term_type, NULL, glued, NULL);
+        cpeg_term *t =
+            cpeg_term_newl(&test_term_type, NULL,
+                           CPEG_TERM_NODE(test_term_type, NULL, below),
+                           NULL);
+
+        cpeg_term_share(t);
+        cqc_assert(t->flags & CPEG_TERM_SHARED);
+        cqc_assert(!(t->children[0]->flags & CPEG_TERM_SHARED));
+        cqc_assert(below->flags & CPEG_TERM_SHARED);
+        cpeg_term_graft(t, 0, grafted);
+        cqc_assert(grafted->flags & CPEG_TERM_SHARED);
+        cpeg_term_glue(t, side);
+        cqc_assert(glued->flags & CPEG_TERM_SHARED);
+        cqc_assert_eq(unsigned, glued->refcnt, 2);
+        cpeg_term_free(side);
+        cpeg_term_free(t);
+        cpeg_term_free(below);
+    }
+}
+
+static int
+count_terms(__attribute__((unused)) const cpeg_term *term, void *data)
+{
+    (*(unsigned *)data)++;
+    return 0;
+}
+
+static void *
+count_reduce(const cpeg_term *term, void *results[],
+             __attribute__((unused)) void *data)
+{
+    return (void *)((term->n_children > 0 ? (uintptr_t)results[0] : 0) + 1);
+}
+
+static int
+count_pairs(__attribute__((unused)) const cpeg_term *term1,
+            __attribute__((unused)) const cpeg_term *term2, void *data)
+{
+    (*(unsigned *)data)++;
+    return 0;
+}
+
+static cpeg_term *
+identity_mapping(__attribute__((unused)) const cpeg_term *term,
+                 __attribute__((unused)) void *data)
+{
+    return NULL;
+}
+
+CQC_TESTCASE(test_deep_term,
+             "Very deep terms are handled without exhausting the C stack")
+{
+    cqc_forall(uint8_t, depth_scale)
+    {
+        cqc_expect
+        {
+            unsigned depth = 100000 + (unsigned)depth_scale * 1000;
+            unsigned saved_cnt = test_term_object_count;
+            cpeg_term *t = NULL;
+            cpeg_term *copy;
+            cpeg_term *mapped;
+            unsigned count = 0;
+            unsigned i;
+
+            for (i = 0; i < depth; i++)
+                t = cpeg_term_new(&test_term_type, NULL, t ? 1 : 0, &t);
+
+            cqc_assert_eq(int, cpeg_term_traverse_preorder(count_terms, t,
+                                                           &count), 0);
+            cqc_assert_eq(unsigned, count, depth);
+            count = 0;
+            cqc_assert_eq(int, cpeg_term_traverse_postorder(count_terms, t,
+                                                            &count), 0);
+            cqc_assert_eq(unsigned, count, depth);
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_reduce(count_reduce, t, NULL),
+                          depth);
+
+            copy = cpeg_term_deep_copy(t);
+            cqc_assert(cpeg_term_isomorphic(t, copy));
+            count = 0;
+            cqc_assert_eq(int, cpeg_term_zip(count_pairs, t, copy, &count), 0);
+            cqc_assert_eq(unsigned, count, depth);
+            mapped = cpeg_term_map(identity_mapping, t, NULL);
+            cqc_assert(cpeg_term_isomorphic(t, mapped));
+
+            cpeg_term_free(mapped);
+            cpeg_term_free(copy);
+            cpeg_term_free(t);
+            cqc_assert_eq(unsigned, test_term_object_count, saved_cnt);
+        }
+    }
+}
+
+CQC_TESTCASE(test_term_stats,
+             "Term statistics follow allocations and reclamations")
+{
+    cqc_forall(uint8_t, n)
+    {
+        cqc_expect
+        {
+            cpeg_term_stats before;
+            cpeg_term_stats after;
+            cpeg_term *terms[(unsigned)n + 1];
+            size_t live_before = 0;
+            size_t live_after = 0;
+            unsigned i;
+
+            cpeg_term_stats_snapshot(&before);
+            for (i = 0; i < n; i++)
+                terms[i] = cpeg_term_new(&test_term_type, NULL, 0, NULL);
+            cpeg_term_stats_snapshot(&after);
+            for (i = 0; i < before.n_types; i++)
+            {
+                if (before.types[i].type == &test_term_type)
+                    live_before = before.types[i].live;
+            }
+            for (i = 0; i < after.n_types; i++)
+            {
+                if (after.types[i].type == &test_term_type)
+                    live_after = after.types[i].live;
+            }
+            cqc_assert_eq(size_t, live_after, live_before + n);
+            cqc_assert_eq(size_t, after.live, before.live + n);
+            cqc_assert_eq(uint64_t, after.cache_hits + after.cache_misses,
+                          before.cache_hits + before.cache_misses + n);
+
+            for (i = 0; i < n; i++)
+                cpeg_term_free(terms[i]);
+            cpeg_term_stats_snapshot(&after);
+            cqc_assert_eq(size_t, after.live, before.live);
+            cqc_assert_eq(uint64_t, after.reclaimed, before.reclaimed + n);
+        }
+    }
+}
+
+CQC_TESTCASE(test_cache_trim,
+             "Trimming empties the free lists")
+{
+    cqc_forall(uint16_t, n)
+    {
+        cqc_expect
+        {
+            cpeg_term **terms = malloc(((size_t)n + 1) * sizeof(*terms));
+            cpeg_term_stats stats;
+            unsigned i;
+
+            cpeg_term_cache_limit(TERM_MAGAZINE_SIZE);
+            for (i = 0; i < n; i++)
+                terms[i] = cpeg_term_new(&test_term_type, NULL, 0, NULL);
+            for (i = 0; i < n; i++)
+                cpeg_term_free(terms[i]);
+            cpeg_term_stats_snapshot(&stats);
+            cqc_assert(stats.depot <= TERM_SIZE_CLASSES * TERM_MAGAZINE_SIZE);
+
+            cpeg_term_cache_trim();
+            cpeg_term_stats_snapshot(&stats);
+            cqc_assert_eq(size_t, stats.depot, 0);
+            cqc_assert_eq(size_t, stats.cached, 0);
+            cpeg_term_cache_limit(TERM_DEPOT_DEFAULT_LIMIT *
+                                  TERM_MAGAZINE_SIZE);
+            free(terms);
+        }
+    }
+}
+
+static cpeg_term *
+test_chain(unsigned length)
+{
+    cpeg_term *t = NULL;
+    unsigned i;
+
+    for (i = 0; i < length; i++)
+        t = cpeg_term_new(&test_term_type, NULL, t == NULL ? 0 : 1, &t);
+    return t;
+}
+
+CQC_TESTCASE(test_deferred_reclaim,
+             "Deferred reclamation proceeds in bounded steps")
+{
+    cqc_forall_range(unsigned, length, 1, 1000)
+    {
+        cqc_expect
+        {
+            unsigned saved_cnt = test_term_object_count;
+            cpeg_term *t = test_chain(length);
+            unsigned steps = 0;
+
+            cpeg_term_reclaim_mode(CPEG_RECLAIM_DEFERRED);
+            cpeg_term_free(t);
+            cqc_assert_eq(unsigned, test_term_object_count,
+                          saved_cnt + length - 1);
+            while (cpeg_term_reclaim_step(1))
+                steps++;
+            cpeg_term_reclaim_mode(CPEG_RECLAIM_IMMEDIATE);
+            cqc_assert_eq(unsigned, test_term_object_count, saved_cnt);
+            cqc_assert(steps + 1 >= length);
+        }
+    }
+}
+
+CQC_TESTCASE(test_background_reclaim,
+             "Background reclamation destroys every term once")
+{
+    cqc_forall_range(unsigned, length, 1, 1000)
+    {
+        cqc_expect
+        {
+            unsigned saved_cnt = test_term_object_count;
+            cpeg_term *t = test_chain(length);
+
+            cpeg_term_reclaim_mode(CPEG_RECLAIM_BACKGROUND);
+            cpeg_term_free(t);
+            cpeg_term_reclaim_mode(CPEG_RECLAIM_IMMEDIATE);
+            cpeg_term_reclaim_wait();
+            cqc_assert_eq(unsigned, test_term_object_count, saved_cnt);
+        }
+    }
+}
+
+CQC_TESTCASE(test_builder,
+             "Builders make the same terms as cpeg_term_new()")
+{
+    cqc_forall(uint16_t, n)
+    {
+        cqc_expect
+        {
+            unsigned saved_cnt = test_term_object_count;
+            cpeg_term_builder builder;
+            cpeg_term *t;
+            unsigned outer;
+            unsigned inner;
+            unsigned i;
+
+            cpeg_term_builder_init(&builder);
+            outer = cpeg_term_builder_mark(&builder);
+            for (i = 0; i < n; i++)
+            {
+                inner = cpeg_term_builder_mark(&builder);
+                cpeg_term_builder_add(&builder,
+                                      cpeg_term_new(&test_term_type, NULL,
+                                                    0, NULL));
+                cpeg_term_builder_add(&builder,
+                                      cpeg_term_new(&test_term_type, NULL,
+                                                    0, NULL));
+                /* Every other pair of children is backtracked over */
+                if (i % 2)
+                {
+                    cpeg_term_builder_rewind(&builder, inner);
+                    continue;
+                }
+                cpeg_term_builder_add(&builder,
+                                      cpeg_term_builder_finish(&builder, inner,
+                                                               &test_term_type,
+                                                               NULL));
+            }
+            t = cpeg_term_builder_finish(&builder, outer, &test_term_type,
+                                         NULL);
+            cpeg_term_validate(t);
+            cqc_assert_eq(unsigned, t->n_children, (n + 1u) / 2);
+            for (i = 0; i < t->n_children; i++)
+                cqc_assert_eq(unsigned, t->children[i]->n_children, 2);
+            cqc_assert_eq(unsigned, builder.n_children, 0);
+            cpeg_term_builder_fini(&builder);
+            cpeg_term_free(t);
+            cqc_assert_eq(unsigned, test_term_object_count, saved_cnt);
+        }
+    }
+}
+
+CQC_TESTCASE(test_graft_amortised,
+             "Grafting one by one grows the children geometrically")
+{
+    cqc_forall(uint16_t, n)
+    {
+        cqc_expect
+        {
+            cpeg_term *t = cpeg_term_new(&test_term_type, NULL, 0, NULL);
+            unsigned n_resizes = 0;
+            unsigned i;
+
+            for (i = 0; i < n; i++)
+            {
+                unsigned capacity = t->capacity;
+
+                cpeg_term_graft(t, UINT_MAX,
+                                cpeg_term_new(&test_term_type, NULL, 0, NULL));
+                if (t->capacity != capacity)
+                    n_resizes++;
+            }
+            cqc_assert(n_resizes <= 17);
+            cqc_assert_eq(unsigned, t->n_children, (unsigned)n);
+            cpeg_term_free(t);
+        }
+    }
+}
+
+CQC_TESTCASE(test_newl_long,
+             "Argument lists may be longer than the largest size class")
+{
+    cqc_forall(unsigned, v)
+    {
+        cqc_expect
+        {
+            cpeg_term *c = cpeg_term_new(&test_term_type, NULL, 0, NULL);
+            cpeg_term *t;
+
+#define TEST_TEN c, c, c, c, c, c, c, c, c, c
+            t = cpeg_term_newl(&test_term_type, (void *)(uintptr_t)v,
+                               TEST_TEN, TEST_TEN, TEST_TEN, TEST_TEN,
+                               TEST_TEN, TEST_TEN, TEST_TEN, TEST_TEN,
+                               NULL);
+#undef TEST_TEN
+            cpeg_term_validate(t);
+            cqc_assert_eq(unsigned, t->n_children, 80);
+            cqc_assert_eq(cpeg_term_ptr, t->children[79], c);
+            /* All the children are the same borrowed term */
+            t->n_children = 0;
+            cpeg_term_free(t);
+            cpeg_term_free(c);
+        }
+    }
+}
+
+static size_t
+test_term_size(const cpeg_term *t)
+{
+    size_t size = 1;
+    unsigned i;
+
+    for (i = 0; i < t->n_children; i++)
+        size += test_term_size(t->children[i]);
+    return size;
+}
+
+static unsigned
+test_term_height(const cpeg_term *t)
+{
+    unsigned height = 0;
+    unsigned i;
+
+    for (i = 0; i < t->n_children; i++)
+    {
+        if (test_term_height(t->children[i]) + 1 > height)
+            height = test_term_height(t->children[i]) + 1;
+    }
+    return height;
+}
+
+static cpeg_term *
+test_term_edge(cpeg_term *t, bool right)
+{
+    while (t->n_children > 0)
+        t = t->children[right ? t->n_children - 1 : 0];
+    return t;
+}
+
+CQC_TESTCASE(test_term_metrics,
+             "Subtree metrics follow grafting, gluing and pruning")
+{
+    cqc_forall(cpeg_term_ptr, t1)
+    {
+        cqc_forall(cpeg_term_ptr, t2)
+        {
+            cqc_expect
+            {
+                cpeg_term *root = cpeg_term_new(&test_term_type, NULL, 0, NULL);
+                cpeg_term *outer = cpeg_term_newl(&test_term_type, NULL,
+                                                  cpeg_term_use(root), NULL);
+                unsigned op;
+
+                for (op = 0; op < 16; op++)
+                {
+                    unsigned n = root->n_children;
+                    cpeg_term *copy;
+
+                    switch (random() % 4)
+                    {
+                        case 0:
+                            cpeg_term_graft(root, UINT_MAX, cpeg_term_use(t1));
+                            break;
+                        case 1:
+                            cpeg_term_graft(root, (unsigned)random() % (n + 1),
+                                            cpeg_term_use(t2));
+                            break;
+                        case 2:
+                            cpeg_term_glue(root, t1);
+                            break;
+                        default:
+                            if (n > 0)
+                            {
+                                cpeg_term_free(cpeg_term_prune(root,
+                                                               (unsigned)random() % n));
+                            }
+                            break;
+                    }
+
+                    copy = cpeg_term_deep_copy(root);
+                    cqc_assert_eq(size_t, cpeg_term_size(root),
+                                  test_term_size(root));
+                    cqc_assert_eq(unsigned, cpeg_term_height(root),
+                                  test_term_height(root));
+                    cqc_assert_eq(size_t, cpeg_term_shape_hash(root),
+                                  cpeg_term_shape_hash(copy));
+                    cqc_assert_eq(cpeg_term_ptr, cpeg_term_leftmost(root),
+                                  test_term_edge(root, false));
+                    cqc_assert_eq(cpeg_term_ptr, cpeg_term_rightmost(root),
+                                  test_term_edge(root, true));
+                    cqc_assert_eq(size_t, cpeg_term_size(outer),
+                                  test_term_size(outer));
+                    cqc_assert_eq(unsigned, cpeg_term_height(outer),
+                                  test_term_height(outer));
+                    cqc_assert_eq(cpeg_term_ptr, cpeg_term_leftmost(outer),
+                                  test_term_edge(outer, false));
+                    cqc_assert(cpeg_term_isomorphic(root, copy));
+                    cqc_assert(root->n_children == 0 ||
+                               !cpeg_term_isomorphic(root->children[0], copy));
+                    cpeg_term_free(copy);
+                }
+                cpeg_term_free(root);
+                cpeg_term_free(outer);
+            }
+        }
+    }
+}
+
+CQC_TESTCASE(test_term_metrics_below,
+             "Subtree metrics follow edits of attached subterms")
+{
+    cqc_expect
+    {
+        cpeg_term *x = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *a = cpeg_term_newl(&test_term_type, NULL, x, NULL);
+        cpeg_term *p = cpeg_term_newl(&test_term_type, NULL, a, NULL);
+        cpeg_term *b = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *q =
+            cpeg_term_newl(&test_term_type, NULL,
+                           CPEG_TERM_NODE(test_term_type, NULL, b), NULL);
+        cpeg_term *copy;
+
+        cqc_assert_eq(size_t, cpeg_term_size(p), 3);
+        cpeg_term_free(cpeg_term_prune(a, 0));
+        cqc_assert_eq(size_t, cpeg_term_size(p), 2);
+        cqc_assert_eq(unsigned, cpeg_term_height(p), 1);
+        cqc_assert_eq(cpeg_term_ptr, cpeg_term_leftmost(p), a);
+        cqc_assert_eq(cpeg_term_ptr, cpeg_term_rightmost(p), a);
+        copy = cpeg_term_deep_copy(p);
+        cqc_assert(cpeg_term_isomorphic(p, copy));
+        cqc_assert_eq(size_t, cpeg_term_shape_hash(p),
+                      cpeg_term_shape_hash(copy));
+
+        cpeg_term_graft(a, 0, cpeg_term_use(copy));
+        cqc_assert_eq(size_t, cpeg_term_size(p), 4);
+        cqc_assert_eq(unsigned, cpeg_term_height(p), 3);
+        cqc_assert_eq(cpeg_term_ptr, cpeg_term_rightmost(p),
+                      copy->children[0]);
+
+        cqc_assert_eq(size_t, cpeg_term_size(q), 3);
+        cpeg_term_graft(b, UINT_MAX, cpeg_term_newl(&test_term_type,
+                                                    NULL, NULL));
+        cqc_assert_eq(size_t, cpeg_term_size(q), 4);
+        cqc_assert_eq(cpeg_term_ptr, cpeg_term_leftmost(q),
+                      b->children[0]);
+
+        cpeg_term_free(copy);
+        cpeg_term_free(p);
+        cpeg_term_free(q);
+        cpeg_term_free(b);
+    }
+}
+
+#ifdef LIBCPEG_TERM_METRICS
+CQC_TESTCASE(test_term_metrics_scoped,
+             "Editing an attached subterm only makes the metrics of its "
+             "ancestors stale")
+{
+    cqc_expect
+    {
+        cpeg_term *x = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *a = cpeg_term_newl(&test_term_type, NULL, x, NULL);
+        cpeg_term *p = cpeg_term_newl(&test_term_type, NULL, a, NULL);
+        cpeg_term *other = cpeg_term_newl(&test_term_type, NULL,
+                                          cpeg_term_newl(&test_term_type,
+                                                         NULL, NULL),
+                                          NULL);
+        size_t epoch = term_metrics_current();
+
+        cqc_assert_eq(cpeg_term_ptr, x->metrics.parent, a);
+        cqc_assert_eq(cpeg_term_ptr, a->metrics.parent, p);
+        cpeg_term_graft(x, UINT_MAX, cpeg_term_newl(&test_term_type,
+                                                    NULL, NULL));
+        cqc_assert_eq(size_t, term_metrics_current(), epoch);
+        cqc_assert_eq(size_t, p->metrics.epoch, TERM_METRICS_DIRTY);
+        cqc_assert_eq(size_t, other->metrics.epoch, epoch);
+        cqc_assert_eq(size_t, cpeg_term_size(p), 4);
+        cqc_assert_eq(unsigned, cpeg_term_height(p), 3);
+        cqc_assert_eq(size_t, p->metrics.epoch, epoch);
+
+        /* A subterm outliving its parent forgets it */
+        cpeg_term_use(x);
+        cpeg_term_free(p);
+        cqc_assert_eq(cpeg_term_ptr, x->metrics.parent, NULL);
+        cpeg_term_free(cpeg_term_prune(x, 0));
+        cqc_assert_eq(size_t, term_metrics_current(), epoch);
+        cqc_assert_eq(size_t, cpeg_term_size(x), 1);
+
+        /* Terms covered by several terms fall back to a new epoch */
+        a = cpeg_term_newl(&test_term_type, NULL, cpeg_term_use(x), NULL);
+        p = cpeg_term_newl(&test_term_type, NULL, cpeg_term_use(x), NULL);
+        cqc_assert_eq(cpeg_term_ptr, x->metrics.parent, TERM_METRICS_MANY);
+        cpeg_term_graft(x, UINT_MAX, cpeg_term_newl(&test_term_type,
+                                                    NULL, NULL));
+        cqc_assert(term_metrics_current() != epoch);
+        cqc_assert_eq(size_t, cpeg_term_size(a), 3);
+        cqc_assert_eq(size_t, cpeg_term_size(p), 3);
+
+        cpeg_term_free(a);
+        cpeg_term_free(p);
+        cpeg_term_free(x);
+        cpeg_term_free(other);
+    }
+}
+#endif
+
+static unsigned test_memo_calls;
+static unsigned test_memo_released;
+
+static void *
+test_memo_size(const cpeg_term *term, void *children[],
+               __attribute__((unused)) void *data)
+{
+    uintptr_t size = 1;
+    unsigned i;
+
+    test_memo_calls++;
+    for (i = 0; i < term->n_children; i++)
+        size += (uintptr_t)children[i];
+    return (void *)size;
+}
+
+static void
+test_memo_release(__attribute__((unused)) void *result)
+{
+    test_memo_released++;
+}
+
+static cpeg_term *
+test_memo_tree(unsigned depth)
+{
+    cpeg_term *node = cpeg_term_new(&test_term_type, NULL, 0, NULL);
+    unsigned i;
+
+    for (i = 0; depth > 0 && i < 3; i++)
+        cpeg_term_graft(node, UINT_MAX, test_memo_tree(depth - 1));
+    return node;
+}
+
+CQC_TESTCASE(test_memo_reduce,
+             "A memoized reduce only recomputes edited terms "
+             "and their ancestors")
+{
+    cqc_forall_range(unsigned, depth, 1, 6)
+    {
+        cqc_expect
+        {
+            cpeg_term_memo *memo = cpeg_term_memo_create(test_memo_size, NULL,
+                                                         test_memo_release);
+            cpeg_term *tree = test_memo_tree(depth);
+            size_t size = test_term_size(tree);
+            cpeg_term *node = tree;
+            unsigned i;
+
+            test_memo_calls = 0;
+            test_memo_released = 0;
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, tree), size);
+            cqc_assert_eq(unsigned, test_memo_calls, (unsigned)size);
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, tree), size);
+            cqc_assert_eq(unsigned, test_memo_calls, (unsigned)size);
+
+            /* Edits in place deep in the tree, behind the parents' back */
+            for (i = 0; i < depth; i++)
+                node = node->children[(unsigned)random() % 3];
+            cpeg_term_graft(node, UINT_MAX, test_memo_tree(0));
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, tree),
+                          size + 1);
+            cqc_assert_eq(unsigned, test_memo_calls,
+                          (unsigned)size + depth + 2);
+
+            cpeg_term_free(cpeg_term_prune(node, 0));
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, tree), size);
+            cqc_assert_eq(unsigned, test_memo_calls,
+                          (unsigned)size + 2 * depth + 3);
+
+            cpeg_term_memo_destroy(memo);
+            cpeg_term_free(tree);
+            /* Every stored result, including the pruned leaf, is released */
+            cqc_assert_eq(unsigned, test_memo_released, test_memo_calls);
+        }
+    }
+}
+
+CQC_TESTCASE(test_memo_through_immortal,
+             "Terms above an immortal term are only memoized if nothing "
+             "below can be edited")
+{
+    cqc_once
+    {
+        cqc_expect
+        {
+            cpeg_term_memo *memo = cpeg_term_memo_create(test_memo_size, NULL,
+                                                         test_memo_release);
+            cpeg_term *c = cpeg_term_newl(&test_term_type, NULL, NULL);
+            cpeg_term *p =
+                cpeg_term_newl(&test_term_type, NULL,
+                               CPEG_TERM_NODE(test_term_type, NULL, c), NULL);
+            cpeg_term *frozen =
+                cpeg_term_newl(&test_term_type, NULL,
+                               CPEG_TERM_NODE(test_term_type, NULL,
+                                              CPEG_TERM_LEAF(test_term_type,
+                                                             NULL)),
+                               NULL);
+
+            test_memo_calls = 0;
+            test_memo_released = 0;
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, p), 3);
+            cqc_assert_eq(unsigned, test_memo_calls, 3);
+            /* Only the child below the immortal term is kept */
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, p), 3);
+            cqc_assert_eq(unsigned, test_memo_calls, 5);
+
+            cpeg_term_graft(c, UINT_MAX, test_memo_tree(0));
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, p), 4);
+            cqc_assert_eq(unsigned, test_memo_calls, 9);
+
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, frozen), 3);
+            cqc_assert_eq(unsigned, test_memo_calls, 12);
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_memo_reduce(memo, frozen), 3);
+            cqc_assert_eq(unsigned, test_memo_calls, 12);
+
+            cpeg_term_memo_destroy(memo);
+            cpeg_term_free(p);
+            cpeg_term_free(c);
+            cpeg_term_free(frozen);
+            cqc_assert_eq(unsigned, test_memo_released, test_memo_calls);
+        }
+    }
+}
+
+static cpeg_term *
+test_diamonds(unsigned n)
+{
+    cpeg_term *t = cpeg_term_new(&test_term_type, NULL, 0, NULL);
+
+    while (n-- > 0)
+        t = cpeg_term_newl(&test_term_type, NULL, t, cpeg_term_use(t), NULL);
+    return t;
+}
+
+static int
+test_count_visits(__attribute__((unused)) const cpeg_term *term, void *data)
+{
+    (*(unsigned *)data)++;
+    return 0;
+}
+
+static int
+test_count_pairs(__attribute__((unused)) const cpeg_term *term1,
+                 __attribute__((unused)) const cpeg_term *term2, void *data)
+{
+    (*(unsigned *)data)++;
+    return 0;
+}
+
+static cpeg_term *
+test_keep_node(__attribute__((unused)) const cpeg_term *term,
+               __attribute__((unused)) void *data)
+{
+    return NULL;
+}
+
+static bool
+test_diamonds_copied(const cpeg_term *copy, const cpeg_term *orig)
+{
+    while (orig->n_children > 0)
+    {
+        if (copy == orig || copy->n_children != 2 ||
+            copy->children[0] != copy->children[1] ||
+            copy->children[0]->refcnt != 2)
+            return false;
+        copy = copy->children[0];
+        orig = orig->children[0];
+    }
+    return copy != orig && copy->n_children == 0;
+}
+
+CQC_TESTCASE(test_dag_algorithms,
+             "DAG-aware algorithms visit shared subterms once")
+{
+    cqc_forall_range(unsigned, n, 1, 24)
+    {
+        cqc_expect
+        {
+            unsigned saved_cnt = test_term_object_count;
+            cpeg_term *t = test_diamonds(n);
+            cpeg_term *copy;
+            unsigned visits;
+
+            test_memo_calls = 0;
+            cqc_assert_eq(uintptr_t,
+                          (uintptr_t)cpeg_term_reduce_dag(test_memo_size,
+                                                          t, NULL),
+                          (UINTMAX_C(2) << n) - 1);
+            cqc_assert_eq(unsigned, test_memo_calls, n + 1);
+
+            visits = 0;
+            cpeg_term_traverse_preorder_dag(test_count_visits, t, &visits);
+            cqc_assert_eq(unsigned, visits, n + 1);
+            visits = 0;
+            cpeg_term_traverse_postorder_dag(test_count_visits, t, &visits);
+            cqc_assert_eq(unsigned, visits, n + 1);
+            visits = 0;
+            cpeg_term_zip_dag(test_count_pairs, t, t, &visits);
+            cqc_assert_eq(unsigned, visits, n + 1);
+
+            copy = cpeg_term_deep_copy_dag(t);
+            cqc_assert(test_diamonds_copied(copy, t));
+            cpeg_term_free(copy);
+            copy = cpeg_term_map_dag(test_keep_node, t, NULL);
+            cqc_assert(test_diamonds_copied(copy, t));
+            cpeg_term_free(copy);
+
+            cpeg_term_free(t);
+            cqc_assert_eq(unsigned, test_term_object_count, saved_cnt);
+        }
+    }
+}
+
+CQC_TESTCASE(test_zip_dag_pairs,
+             "DAG-aware zip visits each pair once, whatever the order")
+{
+    cqc_expect
+    {
+        cpeg_term *s = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *u = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *v = cpeg_term_newl(&test_term_type, NULL, NULL);
+        cpeg_term *t1 = cpeg_term_newl(&test_term_type, NULL, s,
+                                       cpeg_term_use(s), cpeg_term_use(s),
+                                       cpeg_term_use(s), NULL);
+        cpeg_term *t2 = cpeg_term_newl(&test_term_type, NULL, u, v,
+                                       cpeg_term_use(u), cpeg_term_use(v),
+                                       NULL);
+        unsigned visits = 0;
+
+        cpeg_term_zip_dag(test_count_pairs, t1, t2, &visits);
+        cqc_assert_eq(unsigned, visits, 3);
+        cpeg_term_free(t1);
+        cpeg_term_free(t2);
+    }
+}
+
+static cpeg_term *
+test_replace_node(const cpeg_term *term, void *data)
+{
+    if (term != data)
+        return NULL;
+    return cpeg_term_new(&test_term_type, NULL, 0, NULL);
+}
+
+static cpeg_term *
+test_identity_node(const cpeg_term *term,
+                   __attribute__((unused)) void *data)
+{
+    return (cpeg_term *)term;
+}
+
+CQC_TESTCASE(test_rewrite,
+             "Rewriting only copies the ancestors of replaced terms")
+{
+    cqc_forall_range(unsigned, depth, 1, 6)
+    {
+        cqc_expect
+        {
+            unsigned saved_cnt = test_term_object_count;
+            cpeg_term *t = test_memo_tree(depth);
+            unsigned tree_cnt = test_term_object_count;
+            cpeg_term *r = cpeg_term_rewrite(test_keep_node, t, NULL);
+            const cpeg_term *orig;
+            const cpeg_term *copy;
+            unsigned i;
+
+            cqc_assert_eq(cpeg_term_ptr, r, t);
+            cqc_assert_eq(unsigned, t->refcnt, 2);
+            cqc_assert_eq(unsigned, test_term_object_count, tree_cnt);
+            cpeg_term_free(r);
+
+            r = cpeg_term_rewrite(test_identity_node, t, NULL);
+            cqc_assert_eq(cpeg_term_ptr, r, t);
+            cqc_assert_eq(unsigned, t->refcnt, 2);
+            cqc_assert_eq(unsigned, t->children[0]->refcnt, 1);
+            cqc_assert_eq(unsigned, test_term_object_count, tree_cnt);
+            cpeg_term_free(r);
+
+            r = cpeg_term_rewrite(test_replace_node, t,
+                                  cpeg_term_leftmost(t));
+            cqc_assert_eq(unsigned, test_term_object_count,
+                          tree_cnt + depth + 1);
+            for (orig = t, copy = r; orig->n_children > 0;
+                 orig = orig->children[0], copy = copy->children[0])
+            {
+                cqc_assert_neq(cpeg_term_ptr, (cpeg_term *)copy,
+                               (cpeg_term *)orig);
+                cqc_assert_eq(unsigned, copy->n_children, orig->n_children);
+                for (i = 1; i < orig->n_children; i++)
+                    cqc_assert_eq(cpeg_term_ptr, copy->children[i],
+                                  orig->children[i]);
+            }
+            cqc_assert_neq(cpeg_term_ptr, (cpeg_term *)copy,
+                           (cpeg_term *)orig);
+            cpeg_term_free(r);
+            cpeg_term_free(t);
+            cqc_assert_eq(unsigned, test_term_object_count, saved_cnt);
+        }
+    }
+}
+
+#undef LIBCPEG_TESTING
+#endif
+
+/*
+ * Terms built from NULL-terminated argument lists are allocated
+ * with the right size right away, so the lists may be of any length.
+ */
+static unsigned
+count_term_args(va_list args)
+{
+    va_list copy;
+    unsigned n = 0;
+
+    va_copy(copy, args);
+    while (va_arg(copy, cpeg_term *) != NULL)
+        n++;
+    va_end(copy);
+    return n;
+}
+
+static void
+fill_term_args(cpeg_term *term, unsigned n, va_list args)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        term->children[i] = va_arg(args, cpeg_term *);
+    term->n_children = n;
+    term_metrics_compute(term);
+}
+
+cpeg_term *
+cpeg_term_newl(const cpeg_term_type *type, void *value, ...)
+{
+    va_list args;
+    cpeg_term *term;
+    unsigned n;
+
+    va_start(args, value);
+    n = count_term_args(args);
+    term = alloc_term(type, n);
+    term->value = type->init ? type->init(value) : value;
+    fill_term_args(term, n, args);
+    va_end(args);
+
+    return term;
+}
+
+cpeg_term *
+cpeg_term_fromstr(const cpeg_term_type *type,
+                  const char *value, unsigned n_children,
+                  cpeg_term *children[])
+{
+    cpeg_term *term = alloc_term(type, n_children);
+
+    assert(type->fromstr != NULL);
+    term->value = type->fromstr(value);
+    alloc_children(term, n_children, children, false);
+
+    return term;
+}
+
+cpeg_term *
+cpeg_term_fromstrl(const cpeg_term_type *type, const char *value, ...)
+{
+    va_list args;
+    cpeg_term *term;
+    unsigned n;
+
+    assert(type->fromstr != NULL);
+    va_start(args, value);
+    n = count_term_args(args);
+    term = alloc_term(type, n);
+    term->value = type->fromstr(value);
+    fill_term_args(term, n, args);
+    va_end(args);
+
+    return term;
+}
+
+void
+cpeg_term_builder_init(cpeg_term_builder *builder)
+{
+    builder->children = NULL;
+    builder->n_children = 0;
+    builder->capacity = 0;
+}
+
+void
+cpeg_term_builder_grow(cpeg_term_builder *builder)
+{
+    builder->capacity = builder->capacity == 0 ? 16 : builder->capacity * 2;
+    builder->children = cpeg_mem_realloc(builder->children,
+                                         builder->capacity *
+                                         sizeof(*builder->children));
+}
+
+void
+cpeg_term_builder_rewind(cpeg_term_builder *builder, unsigned mark)
+{
+    assert(mark <= builder->n_children);
+    while (builder->n_children > mark)
+        cpeg_term_free(builder->children[--builder->n_children]);
+}
+
+void
+cpeg_term_builder_fini(cpeg_term_builder *builder)
+{
+    cpeg_term_builder_rewind(builder, 0);
+    cpeg_mem_free(builder->children);
+    cpeg_term_builder_init(builder);
+}
+
+cpeg_term *
+cpeg_term_builder_finish(cpeg_term_builder *builder, unsigned mark,
+                         const cpeg_term_type *type, void *value)
+{
+    cpeg_term *term;
+
+    assert(mark <= builder->n_children);
+    term = cpeg_term_new(type, value, builder->n_children - mark,
+                         builder->children + mark);
+    builder->n_children = mark;
+    return term;
+}
+
+/*
+ * Dead terms are queued through their `value` fields, which are no longer
+ * needed once destroyed, and are processed by the outermost reclaim call
+ * on the thread. Dropping references to children, their attributes or
+ * anything else from within destructors only adds to the queue.
+ *
+ * A term stays at the head of the queue until all its children have
+ * been released one by one, so the work can be split into slices
+ * of any size. In the deferred mode, the queue is only processed by
+ * cpeg_term_reclaim_step(); in the background mode, dead terms are
+ * handed over to a reclaimer thread with its own queue.
+ */
+static __thread cpeg_term *reclaim_queue;
+static __thread bool reclaim_active;
+static __thread cpeg_reclaim_mode reclaim_mode;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_t thread;
+    cpeg_term *queue;
+    bool started;
+    bool busy;
+} reclaimer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER
+};
+
+static void
+reclaim_finish(cpeg_term *term)
+{
+    term_stats *stats = term_stats_local();
+
+    term_stat_add(&stats->reclaimed, 1);
+    term_stat_sub(term_stats_type_live(stats, term->type), 1);
+
+    if (term->children != NULL && term->children != term->inline_children)
+        cpeg_mem_free(term->children);
+    cpeg_mem_release_attrs(term);
+    if ((term->flags & CPEG_TERM_CLASS_MASK) == 0)
+        cpeg_mem_free(term);
+    else
+        term_cache_push(term->flags & CPEG_TERM_CLASS_MASK, term);
+}
+
+/* Returns true if there is still work to do */
+static bool
+reclaim_drain(size_t budget)
+{
+    assert(!reclaim_active);
+    reclaim_active = true;
+    while (reclaim_queue != NULL && budget > 0)
+    {
+        cpeg_term *term = reclaim_queue;
+
+        budget--;
+        if (term->n_children > 0)
+        {
+            cpeg_term_free(term->children[--term->n_children]);
+            continue;
+        }
+        reclaim_queue = term->value;
+        reclaim_finish(term);
+    }
+    reclaim_active = false;
+
+    return reclaim_queue != NULL;
+}
+
+static void *
+reclaimer_main(__attribute__((unused)) void *arg)
+{
+    pthread_mutex_lock(&reclaimer.lock);
+    for (;;)
+    {
+        cpeg_term *batch;
+
+        while (reclaimer.queue == NULL)
+        {
+            reclaimer.busy = false;
+            pthread_cond_broadcast(&reclaimer.idle);
+            pthread_cond_wait(&reclaimer.wake, &reclaimer.lock);
+        }
+        batch = reclaimer.queue;
+        reclaimer.queue = NULL;
+        reclaimer.busy = true;
+        pthread_mutex_unlock(&reclaimer.lock);
+
+        while (batch != NULL)
+        {
+            cpeg_term *term = batch;
+
+            batch = term->value;
+            term->value = reclaim_queue;
+            reclaim_queue = term;
+            reclaim_drain(SIZE_MAX);
+        }
+
+        pthread_mutex_lock(&reclaimer.lock);
+    }
+    return NULL;
+}
+
+static void
+reclaimer_submit(cpeg_term *term)
+{
+    pthread_mutex_lock(&reclaimer.lock);
+    if (!reclaimer.started)
+    {
+        int rc = pthread_create(&reclaimer.thread, NULL, reclaimer_main, NULL);
+
+        assert(rc == 0);
+        (void)rc;
+        pthread_detach(reclaimer.thread);
+        reclaimer.started = true;
+    }
+    term->value = reclaimer.queue;
+    reclaimer.queue = term;
+    reclaimer.busy = true;
+    pthread_cond_signal(&reclaimer.wake);
+    pthread_mutex_unlock(&reclaimer.lock);
+}
+
+void
+cpeg_term_reclaim(cpeg_term *term)
+{
+    assert(term->refcnt == 0);
+    if (term->type->destroy)
+        term->type->destroy(term->value);
+#ifdef LIBCPEG_TERM_METRICS
+    term_metrics_unlink(term);
+#endif
+
+    if (reclaim_mode == CPEG_RECLAIM_BACKGROUND && !reclaim_active)
+    {
+        reclaimer_submit(term);
+        return;
+    }
+
+    term->value = reclaim_queue;
+    reclaim_queue = term;
+
+    if (reclaim_active)
+        return;
+    if (reclaim_mode == CPEG_RECLAIM_DEFERRED)
+    {
+        /* Whatever is left is reclaimed when the thread exits */
+        term_stats_local();
+        return;
+    }
+    reclaim_drain(SIZE_MAX);
+}
+
+cpeg_reclaim_mode
+cpeg_term_reclaim_mode(cpeg_reclaim_mode mode)
+{
+    cpeg_reclaim_mode old = reclaim_mode;
+
+    reclaim_mode = mode;
+    return old;
+}
+
+bool
+cpeg_term_reclaim_step(size_t budget)
+{
+    if (reclaim_active)
+        return reclaim_queue != NULL;
+    return reclaim_drain(budget);
+}
+
+void
+cpeg_term_reclaim_wait(void)
+{
+    pthread_mutex_lock(&reclaimer.lock);
+    while (reclaimer.busy)
+        pthread_cond_wait(&reclaimer.idle, &reclaimer.lock);
+    pthread_mutex_unlock(&reclaimer.lock);
+}
+
+static void
+term_stats_collect(cpeg_term_stats *stats, term_stats *src)
+{
+    unsigned i;
+
+    stats->reclaimed += __atomic_load_n(&src->reclaimed, __ATOMIC_RELAXED);
+    stats->cache_hits += __atomic_load_n(&src->cache_hits, __ATOMIC_RELAXED);
+    stats->cache_misses += __atomic_load_n(&src->cache_misses,
+                                           __ATOMIC_RELAXED);
+    stats->cached += __atomic_load_n(&src->cached, __ATOMIC_RELAXED);
+    stats->other_live += __atomic_load_n(&src->other_live, __ATOMIC_RELAXED);
+
+    for (i = 0; i < TERM_STATS_TYPES; i++)
+    {
+        const cpeg_term_type *type = __atomic_load_n(&src->types[i].type,
+                                                     __ATOMIC_ACQUIRE);
+        unsigned long live = __atomic_load_n(&src->types[i].live,
+                                             __ATOMIC_RELAXED);
+        size_t j;
+
+        if (type == NULL)
+            continue;
+        for (j = 0; j < stats->n_types; j++)
+        {
+            if (stats->types[j].type == type)
+                break;
+        }
+        if (j == stats->n_types)
+        {
+            if (j == CPEG_STATS_MAX_TYPES)
+            {
+                stats->other_live += live;
+                continue;
+            }
+            stats->types[j].type = type;
+            stats->types[j].live = 0;
+            stats->n_types++;
+        }
+        stats->types[j].live += live;
+    }
+}
+
+void
+cpeg_term_stats_snapshot(cpeg_term_stats *stats)
+{
+    term_stats *iter;
+    unsigned class;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&term_depot_lock);
+    term_stats_collect(stats, &term_stats_retired);
+    for (iter = term_stats_threads; iter != NULL; iter = iter->next)
+        term_stats_collect(stats, iter);
+    for (class = 1; class <= TERM_SIZE_CLASSES; class++)
+    {
+        size_t i;
+
+        for (i = 0; i < term_depot[class].n_magazines; i++)
+            stats->depot += term_depot[class].magazines[i].count;
+    }
+    pthread_mutex_unlock(&term_depot_lock);
+
+    stats->allocated = stats->cache_hits + stats->cache_misses;
+    stats->live = stats->allocated - stats->reclaimed;
+}
+
+
+cpeg_term *
+cpeg_term_share(cpeg_term *term)
+{
+    term_stack stack;
+    cpeg_ptrmap seen;
+
+    if (term == NULL || (term->flags & CPEG_TERM_SHARED))
+        return term;
+
+    /*
+     * Immortal terms are not marked, but refcounted terms below them
+     * must be, so the walk goes through them, once per term.
+     */
+    term_stack_init(&stack);
+    cpeg_ptrmap_init(&seen);
+    if (term->refcnt != UINT_MAX)
+        term->flags |= CPEG_TERM_SHARED;
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+        cpeg_term *child;
+
+        if (top->pos == top->term->n_children)
+        {
+            stack.depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        if (child == NULL || (child->flags & CPEG_TERM_SHARED))
+            continue;
+        if (child->refcnt == UINT_MAX)
+        {
+            void **visited;
+
+            if (child->n_children == 0)
+                continue;
+            visited = cpeg_ptrmap_insert(&seen, child);
+            if (*visited != NULL)
+                continue;
+            *visited = child;
+        }
+        else
+        {
+            child->flags |= CPEG_TERM_SHARED;
+        }
+        term_stack_push(&stack, child, NULL);
+    }
+    cpeg_ptrmap_fini(&seen);
+    term_stack_fini(&stack);
+
+    return term;
+}
+
+#ifdef LIBCPEG_TESTING
+CQC_TESTCASE(term_destructor_called,
+             "Term destructor is called", CQC_NO_CLASSES,
+             unsigned saved_cnt = test_term_object_count;
+             cqc_forall(cpeg_term_ptr, t,
+                        cqc_expect(cqc_assert(saved_cnt <
+                                              test_term_object_count)));
+             cqc_expect(cqc_assert_eq(unsigned, saved_cnt,
+                                      test_term_object_count)));
+#endif
+
+static inline size_t
+shape_mix(size_t hash, size_t child)
+{
+    uint64_t h = (hash ^ child) * UINT64_C(0x9e3779b97f4a7c15);
+
+    return (size_t)(h >> 32 ^ h);
+}
+
+/* The shape hash of a leaf; NULL children count as 0 */
+#define SHAPE_HASH_LEAF ((size_t)0x5bd1e995u)
+
+#ifdef LIBCPEG_TERM_METRICS
+/*
+ * The metrics of a term also depend on its descendants, which may be
+ * edited without the term knowing. A term covered by the metrics of
+ * a single mortal term links to it, and editing the term marks its
+ * ancestors as dirty. Editing a term whose ancestors are not known
+ * starts a new epoch instead. Dirty metrics and those from older
+ * epochs are recomputed before use. Metrics that depend on a walk
+ * through terms without metrics cannot be followed and have epoch 0,
+ * and so are never used.
+ */
+static size_t term_metrics_epoch = 1;
+
+static inline size_t
+term_metrics_current(void)
+{
+    return __atomic_load_n(&term_metrics_epoch, __ATOMIC_RELAXED);
+}
+
+/* Stale metrics that the current thread may recompute */
+static inline bool
+term_metrics_stale(const cpeg_term *term)
+{
+    return term->metrics.size != 0 && term->metrics.epoch != 0 &&
+        term->metrics.epoch != term_metrics_current() &&
+        term->refcnt != UINT_MAX && !(term->flags & CPEG_TERM_SHARED);
+}
+
+static void term_metrics_revalidate(cpeg_term *term);
+
+static inline bool
+term_has_metrics(const cpeg_term *term)
+{
+    if (term->metrics.size == 0 || term->metrics.epoch == 0)
+        return false;
+    if (term->metrics.epoch == term_metrics_current())
+        return true;
+    if (!term_metrics_stale(term))
+        return false;
+    term_metrics_revalidate((cpeg_term *)term);
+    return term->metrics.epoch != 0;
+}
+#else
+static inline bool
+term_has_metrics(__attribute__((unused)) const cpeg_term *term)
+{
+    return false;
+}
+#endif
+
+cpeg_term *
+cpeg_term_leftmost(cpeg_term *term)
+{
+    if (term == NULL)
+        return NULL;
+
+    while (term->n_children > 0)
+    {
+#ifdef LIBCPEG_TERM_METRICS
+        if (term_has_metrics(term))
+            return term->metrics.leftmost;
+#endif
+        term = term->children[0];
+    }
+
+    return term;
+}
 
-static cpeg_term *
-alloc_term(const cpeg_term_type *type)
+cpeg_term *
+cpeg_term_rightmost(cpeg_term *term)
 {
-    cpeg_term *term = term_free_list;
+    if (term == NULL)
+        return NULL;
 
-    if (term != NULL)
-        term_free_list = term_free_list->value;
-    else
+    while (term->n_children > 0)
     {
-        term = cpeg_mem_alloc(sizeof(*term));
-        assert(term != NULL);
+#ifdef LIBCPEG_TERM_METRICS
+        if (term_has_metrics(term))
+            return term->metrics.rightmost;
+#endif
+        term = term->children[term->n_children - 1];
     }
-    term->type   = type;
-    term->refcnt = 1;
+
     return term;
 }
 
-static void
-alloc_children(cpeg_term *term, unsigned n_children,
-               cpeg_term *children[], bool share)
+static void *
+size_node(const cpeg_term *term, void *children[],
+          __attribute__((unused)) void *data)
 {
+    size_t size = 1;
     unsigned i;
 
-    term->n_children = n_children;
-    if (n_children == 0)
-        term->children = NULL;
-    else
-        term->children = cpeg_mem_alloc(n_children * sizeof(*term->children));
+    for (i = 0; i < term->n_children; i++)
+        size += (uintptr_t)children[i];
+    return (void *)(uintptr_t)size;
+}
 
-    for (i = 0; i < n_children; i++)
-        term->children[i] = share ? cpeg_term_use(children[i]) : children[i];
+static void *
+height_node(const cpeg_term *term, void *children[],
+            __attribute__((unused)) void *data)
+{
+    uintptr_t height = 0;
+    unsigned i;
+
+    for (i = 0; i < term->n_children; i++)
+    {
+        if ((uintptr_t)children[i] + 1 > height)
+            height = (uintptr_t)children[i] + 1;
+    }
+    return (void *)height;
 }
 
-cpeg_term *
-cpeg_term_new(const cpeg_term_type *type, void *value,
-              unsigned n_children, cpeg_term *children[])
+static void *
+shape_node(const cpeg_term *term, void *children[],
+           __attribute__((unused)) void *data)
 {
-    cpeg_term *term = alloc_term(type);
+    size_t hash = SHAPE_HASH_LEAF;
+    unsigned i;
 
-    term->value  = type->init ? type->init(value) : value;
-    alloc_children(term, n_children, children, false);
+    for (i = 0; i < term->n_children; i++)
+        hash = shape_mix(hash, (uintptr_t)children[i]);
+    return (void *)(uintptr_t)hash;
+}
 
-    return term;
+size_t
+cpeg_term_size(const cpeg_term *term)
+{
+    if (term == NULL)
+        return 0;
+#ifdef LIBCPEG_TERM_METRICS
+    if (term_has_metrics(term))
+        return term->metrics.size;
+#endif
+    return (uintptr_t)term_fold(size_node, term, NULL);
 }
 
-#ifdef LIBCPEG_TESTING
-CQC_TESTCASE(term_new, "Any term is valid")
+unsigned
+cpeg_term_height(const cpeg_term *term)
 {
-    cqc_forall(cpeg_term_ptr, t)
+    if (term == NULL)
+        return 0;
+#ifdef LIBCPEG_TERM_METRICS
+    if (term_has_metrics(term))
+        return term->metrics.height;
+#endif
+    return (unsigned)(uintptr_t)term_fold(height_node, term, NULL);
+}
+
+size_t
+cpeg_term_shape_hash(const cpeg_term *term)
+{
+    if (term == NULL)
+        return 0;
+#ifdef LIBCPEG_TERM_METRICS
+    if (term_has_metrics(term))
     {
-        cqc_expect
-        {
-            cpeg_term_validate(t);
-        }
+        if (term->metrics.stale_shape)
+            return term_shape_refresh((cpeg_term *)term);
+        return term->metrics.shape_hash;
     }
+#endif
+    return (uintptr_t)term_fold(shape_node, term, NULL);
 }
 
+#ifdef LIBCPEG_TERM_METRICS
+/*
+ * The shape hash cannot be updated when a child is inserted or removed
+ * anywhere but at the end, so it is recomputed on demand instead,
+ * and cached unless other threads may be reading the term.
+ */
+static size_t
+term_shape_refresh(cpeg_term *term)
+{
+    size_t hash = SHAPE_HASH_LEAF;
+    unsigned i;
 
-CQC_TESTCASE(term_new_no_use,
-             "Term construction does not automatically increment refcounters")
+    for (i = 0; i < term->n_children; i++)
+        hash = shape_mix(hash, cpeg_term_shape_hash(term->children[i]));
+
+    if (!(term->flags & CPEG_TERM_SHARED))
+    {
+        term->metrics.shape_hash = hash;
+        term->metrics.stale_shape = false;
+    }
+    return hash;
+}
+
+/* Records that the metrics of `parent` include those of `child` */
+static inline void
+term_metrics_link(const cpeg_term *child, const cpeg_term *parent)
 {
-    cqc_forall(cpeg_term_ptr, t1)
+    cpeg_term *mutable = (cpeg_term *)child;
+
+    if (child->refcnt == UINT_MAX || (child->flags & CPEG_TERM_SHARED))
+        return;
+    if (parent->refcnt == UINT_MAX)
+        mutable->metrics.parent = TERM_METRICS_MANY;
+    else if (child->metrics.parent == NULL)
+        mutable->metrics.parent = (cpeg_term *)parent;
+    else if (child->metrics.parent != parent)
+        mutable->metrics.parent = TERM_METRICS_MANY;
+}
+
+/*
+ * Links the terms with metrics below an immortal term without them
+ * to it; false if there are terms that cannot be followed.
+ */
+static bool
+term_cover_below(const cpeg_term *term)
+{
+    term_stack stack;
+    bool followed = true;
+
+    term_stack_init(&stack);
+    term_stack_push(&stack, term, NULL);
+    while (followed && stack.depth > 0)
     {
-        cqc_expect
+        term_frame *top = term_stack_top(&stack);
+        cpeg_term *child;
+
+        if (top->pos == top->term->n_children)
         {
-            cpeg_term_ptr t2 = cpeg_term_newl(&test_term_type, NULL,
-                                              t1, NULL);
-            cqc_assert_eq(unsigned, t1->refcnt, 1);
-            cqc_assert_eq(unsigned, t2->n_children, 1);
-            cqc_assert_eq(cpeg_term_ptr, t2->children[0], t1);
+            stack.depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        if (child == NULL || (child->flags & CPEG_TERM_SHARED))
+            continue;
+        if (child->refcnt != UINT_MAX)
+        {
+            if (child->metrics.size == 0)
+                followed = false;
+            term_metrics_link(child, term);
         }
+        else if (child->metrics.size == 0)
+            term_stack_push(&stack, child, NULL);
     }
+    term_stack_fini(&stack);
+
+    return followed;
 }
 
+/*
+ * The metrics of a child of `term`, except for its shape hash. The child
+ * is linked to the term, and `epoch` is 0 if its changes cannot be
+ * followed.
+ */
+static void
+term_metrics_of(const cpeg_term *term, const cpeg_term *child,
+                cpeg_term_metrics *sub)
+{
+    if (child == NULL)
+    {
+        *sub = (cpeg_term_metrics){.size = 0, .epoch = 1};
+        return;
+    }
+    term_metrics_link(child, term);
+    if (term_has_metrics(child))
+        *sub = child->metrics;
+    else
+    {
+        sub->size = cpeg_term_size(child);
+        sub->height = cpeg_term_height(child);
+        sub->leftmost = cpeg_term_leftmost((cpeg_term *)child);
+        sub->rightmost = cpeg_term_rightmost((cpeg_term *)child);
+        if (child->metrics.size == 0)
+            sub->epoch = term_cover_below(child) ? 1 : 0;
+        else
+            sub->epoch = child->metrics.epoch;
+    }
+}
 
-CQC_TESTCASE(terms_reused,
-             "A reclaimed term is reused at the next allocation")
+static void
+term_metrics_add(const cpeg_term *term, cpeg_term_metrics *metrics,
+                 const cpeg_term *child, bool first)
 {
-    cqc_forall(cpeg_term_ptr, t)
+    cpeg_term_metrics sub;
+
+    term_metrics_of(term, child, &sub);
+    if (sub.epoch == 0)
+        metrics->epoch = 0;
+    metrics->size += sub.size;
+    if (child != NULL && sub.height + 1 > metrics->height)
+        metrics->height = sub.height + 1;
+    if (!metrics->stale_shape)
     {
-        cqc_expect
-        {
-            uintptr_t oldv = (uintptr_t)t->value;
-            cpeg_term *nt;
-            cpeg_term_free(t);
-            nt = cpeg_term_newl(&test_term_type, (void *)(oldv + 1), NULL);
-            cqc_assert_eq(cpeg_term_ptr, t, nt);
-            cqc_assert_eq(cqc_opaque, t->value, (void *)(oldv + 1));
-            cqc_assert_eq(unsigned, t->n_children, 0);
-            cqc_assert_eq(cqc_opaque, t->children, NULL);
-        }
+        metrics->shape_hash = shape_mix(metrics->shape_hash,
+                                        cpeg_term_shape_hash(child));
     }
+    if (first)
+        metrics->leftmost = sub.leftmost;
+    metrics->rightmost = sub.rightmost;
 }
 
+static inline void
+term_metrics_stamp(cpeg_term *term)
+{
+    if (term->metrics.epoch != 0)
+        term->metrics.epoch = term_metrics_current();
+}
 
-CQC_TESTCASE(test_static_term,
-             "Statically declared terms are not refcounted")
+/*
+ * Called before a term is edited. Dirty ancestors have dirty ancestors
+ * of their own, so the walk stops at the first one.
+ */
+static void
+term_metrics_touch(const cpeg_term *term)
 {
-    cqc_once
+    cpeg_term *parent;
+
+    if (term->refcnt == UINT_MAX)
+        return;
+    if (term->flags & CPEG_TERM_SHARED)
+        parent = TERM_METRICS_MANY;
+    else
+        parent = term->metrics.parent;
+    for (; parent != NULL; parent = parent->metrics.parent)
     {
-        cqc_expect
+        if (parent == TERM_METRICS_MANY)
         {
-            cpeg_term *t = CPEG_TERM_LEAF(test_term_type, NULL);
-            cpeg_term_use(t);
-            cqc_assert_eq(unsigned, t->refcnt, UINT_MAX);
-            cpeg_term_free(t);
-            cqc_assert_eq(unsigned, t->refcnt, UINT_MAX);
+            __atomic_add_fetch(&term_metrics_epoch, 1, __ATOMIC_RELAXED);
+            return;
         }
+        if (parent->metrics.epoch == TERM_METRICS_DIRTY)
+            return;
+        parent->metrics.epoch = TERM_METRICS_DIRTY;
     }
 }
 
-#undef LIBCPEG_TESTING
-#endif
+/* Children of a freed term are no longer covered by it */
+static void
+term_metrics_unlink(const cpeg_term *term)
+{
+    unsigned i;
 
-#define MAX_INLINE_CHILDREN 64
-#define SETUP_INLINE_CHILDREN(_children, _n, _lastarg)          \
-    cpeg_term *_children[MAX_INLINE_CHILDREN];                  \
-    va_list _args;                                              \
-    unsigned _n;                                                \
-                                                                \
-    va_start(_args, _lastarg);                                  \
-    for (_n = 0;; _n++)                                         \
-    {                                                           \
-        _children[_n] = va_arg(_args, cpeg_term *);             \
-        if (_children[_n] == NULL)                              \
-            break;                                              \
-        assert(_n < sizeof(_children) / sizeof(*_children));    \
-    }                                                           \
-    va_end(_args)
+    if (term->flags & CPEG_TERM_SHARED)
+        return;
+    for (i = 0; i < term->n_children; i++)
+    {
+        cpeg_term *child = term->children[i];
 
-cpeg_term *
-cpeg_term_newl(const cpeg_term_type *type, void *value, ...)
+        if (child != NULL && child->refcnt != UINT_MAX &&
+            !(child->flags & CPEG_TERM_SHARED) &&
+            child->metrics.parent == term)
+            child->metrics.parent = NULL;
+    }
+}
+
+/*
+ * Also tells whether the metrics of the term may be updated
+ * incrementally after the edit, or must be computed anew.
+ */
+static bool
+term_metrics_begin(cpeg_term *term)
 {
-    SETUP_INLINE_CHILDREN(children, n, value);
+    bool fresh = term->metrics.size != 0 &&
+        term->metrics.epoch == term_metrics_current();
 
-    return cpeg_term_new(type, value, n, children);
+    term_metrics_touch(term);
+    return fresh;
 }
 
-cpeg_term *
-cpeg_term_fromstr(const cpeg_term_type *type,
-                  const char *value, unsigned n_children,
-                  cpeg_term *children[])
+/* Called after `children[pos]` has been inserted */
+static void
+term_metrics_insert(cpeg_term *term, unsigned pos)
 {
-    cpeg_term *term = alloc_term(type);
-
-    assert(type->fromstr != NULL);
-    term->value = type->fromstr(value);
-    alloc_children(term, n_children, children, false);
+    const cpeg_term *child = term->children[pos];
+    cpeg_term_metrics sub;
 
-    return term;
+    if (pos == term->n_children - 1)
+        term_metrics_add(term, &term->metrics, child, pos == 0);
+    else
+    {
+        term_metrics_of(term, child, &sub);
+        if (sub.epoch == 0)
+            term->metrics.epoch = 0;
+        term->metrics.size += sub.size;
+        if (child != NULL && sub.height + 1 > term->metrics.height)
+            term->metrics.height = sub.height + 1;
+        if (pos == 0)
+            term->metrics.leftmost = sub.leftmost;
+        term->metrics.stale_shape = true;
+    }
+    term_metrics_stamp(term);
 }
 
-cpeg_term *
-cpeg_term_fromstrl(const cpeg_term_type *type, const char *value, ...)
+/* Called after `removed` has been taken out of `children[pos]` */
+static void
+term_metrics_remove(cpeg_term *term, unsigned pos, const cpeg_term *removed)
 {
-    SETUP_INLINE_CHILDREN(children, n, value);
+    cpeg_term_metrics sub;
+    unsigned i;
 
-    return cpeg_term_fromstr(type, value, n, children);
+    if (term->n_children == 0)
+    {
+        term_metrics_compute(term);
+        return;
+    }
+
+    term_metrics_of(term, removed, &sub);
+    term->metrics.size -= sub.size;
+    if (pos == 0)
+    {
+        term_metrics_of(term, term->children[0], &sub);
+        term->metrics.leftmost = sub.leftmost;
+    }
+    if (pos == term->n_children)
+    {
+        term_metrics_of(term, term->children[pos - 1], &sub);
+        term->metrics.rightmost = sub.rightmost;
+    }
+    term->metrics.stale_shape = true;
+    term_metrics_stamp(term);
+
+    /* Only look for a new height if the tallest child may be gone */
+    if (removed == NULL ||
+        cpeg_term_height(removed) + 1 < term->metrics.height)
+        return;
+    term->metrics.height = 0;
+    for (i = 0; i < term->n_children; i++)
+    {
+        const cpeg_term *child = term->children[i];
+
+        if (child != NULL && cpeg_term_height(child) + 1 > term->metrics.height)
+        {
+            term->metrics.height = cpeg_term_height(child) + 1;
+            if (term->metrics.height == cpeg_term_height(removed) + 1)
+                break;
+        }
+    }
 }
 
-void
-cpeg_term_reclaim(cpeg_term *term)
+static void
+term_metrics_compute(cpeg_term *term)
 {
+    cpeg_term_metrics metrics = {
+        .size = 1,
+        .shape_hash = SHAPE_HASH_LEAF,
+        .height = 0,
+        .leftmost = term,
+        .rightmost = term,
+        .epoch = term_metrics_current(),
+        .parent = term->refcnt == UINT_MAX ? NULL : term->metrics.parent
+    };
     unsigned i;
 
-    assert(term->refcnt == 0);
-    if (term->type->destroy)
-        term->type->destroy(term->value);
     for (i = 0; i < term->n_children; i++)
-        cpeg_term_free(term->children[i]);
-    cpeg_mem_free(term->children);
-    cpeg_mem_release_attrs(term);
-    term->value = term_free_list;
-    term_free_list = term;
+        term_metrics_add(term, &metrics, term->children[i], i == 0);
+    term->metrics = metrics;
 }
 
-#ifdef LIBCPEG_TESTING
-CQC_TESTCASE(term_destructor_called,
-             "Term destructor is called", CQC_NO_CLASSES,
-             unsigned saved_cnt = test_term_object_count;
-             cqc_forall(cpeg_term_ptr, t,
-                        cqc_expect(cqc_assert(saved_cnt <
-                                              test_term_object_count)));
-             cqc_expect(cqc_assert_eq(unsigned, saved_cnt,
-                                      test_term_object_count)));
-#endif
-
-cpeg_term *
-cpeg_term_leftmost(cpeg_term *term)
+/* Recomputes stale metrics of the term and of the subterms they use */
+static void
+term_metrics_revalidate(cpeg_term *term)
 {
-    if (term == NULL)
-        return NULL;
+    term_stack stack;
 
-    while (term->n_children > 0)
-        term = term->children[0];
+    term_stack_init(&stack);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+        cpeg_term *child;
 
-    return term;
+        if (top->pos == top->term->n_children)
+        {
+            term_metrics_compute((cpeg_term *)top->term);
+            stack.depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        if (child != NULL && term_metrics_stale(child))
+            term_stack_push(&stack, child, NULL);
+    }
+    term_stack_fini(&stack);
 }
+#endif
 
-cpeg_term *
-cpeg_term_rightmost(cpeg_term *term)
+void
+cpeg_term_refresh(cpeg_term *term)
 {
-    if (term == NULL)
-        return NULL;
-
-    while (term->n_children > 0)
-        term = term->children[term->n_children - 1];
-
-    return term;
+#ifdef LIBCPEG_TERM_METRICS
+    term_metrics_touch(term);
+#endif
+    term_metrics_compute(term);
+    term_memo_invalidate(term);
 }
 
 #ifdef LIBCPEG_TESTING
@@ -313,7 +2783,7 @@ cpeg_term_copy(const cpeg_term *term)
         return NULL;
     else
     {
-        cpeg_term *copy = alloc_term(term->type);
+        cpeg_term *copy = alloc_term(term->type, term->n_children);
 
         copy->value = term->type->init ?
             term->type->init(term->value) :
@@ -341,22 +2811,30 @@ CQC_TESTCASE(term_copy_eq, "Shallow copying terms works", CQC_NO_CLASSES,
                                                    t1->children, ->refcnt, 2))));
 #endif
 
+static void *
+deep_copy_node(const cpeg_term *term, void *children[],
+               __attribute__((unused)) void *data)
+{
+    return cpeg_term_new(term->type, term->value, term->n_children,
+                         (cpeg_term **)children);
+}
+
 cpeg_term *
 cpeg_term_deep_copy(const cpeg_term *term)
 {
     if (term == NULL)
         return NULL;
-    else
-    {
-        cpeg_term *children[term->n_children + 1];
-        unsigned i;
 
-        for (i = 0; i < term->n_children; i++)
-            children[i] = cpeg_term_deep_copy(term->children[i]);
+    return term_fold(deep_copy_node, term, NULL);
+}
 
-        return cpeg_term_new(term->type, term->value,
-                             term->n_children, children);
-    }
+cpeg_term *
+cpeg_term_deep_copy_dag(const cpeg_term *term)
+{
+    if (term == NULL)
+        return NULL;
+
+    return term_fold_dag(deep_copy_node, term, NULL, true);
 }
 
 #ifdef LIBCPEG_TESTING
@@ -394,22 +2872,35 @@ cpeg_term_graft(cpeg_term *term, unsigned pos,
                 cpeg_term *child)
 {
     cpeg_term **new_children;
+#ifdef LIBCPEG_TERM_METRICS
+    bool fresh;
+#endif
 
+    assert(term->refcnt != UINT_MAX);
     if (pos == UINT_MAX)
         pos = term->n_children;
     assert(pos <= term->n_children);
+#ifdef LIBCPEG_TERM_METRICS
+    fresh = term_metrics_begin(term);
+#endif
 
-    new_children = cpeg_mem_realloc(term->children,
-                                    sizeof(*new_children) *
-                                    (term->n_children + 1));
-    assert(new_children != NULL);
+    reserve_children(term, term->n_children + 1);
+    new_children = term->children;
 
     memmove(&new_children[pos + 1], &new_children[pos],
             sizeof(*term->children) * (term->n_children - pos));
     new_children[pos] = child;
+    if (term->flags & CPEG_TERM_SHARED)
+        cpeg_term_share(child);
 
     term->n_children++;
-    term->children = new_children;
+#ifdef LIBCPEG_TERM_METRICS
+    if (fresh)
+        term_metrics_insert(term, pos);
+    else
+        term_metrics_compute(term);
+#endif
+    term_memo_invalidate(term);
 
     return term;
 }
@@ -464,16 +2955,39 @@ cpeg_term_glue(cpeg_term *term,
                const cpeg_term *side)
 {
     unsigned i;
+#ifdef LIBCPEG_TERM_METRICS
+    bool fresh;
+#endif
 
     if (side == NULL || side->n_children == 0)
         return term;
 
-    term->children = cpeg_mem_realloc(term->children,
-                                      sizeof(*term->children) *
-                                      (term->n_children + side->n_children));
+    assert(term->refcnt != UINT_MAX);
+#ifdef LIBCPEG_TERM_METRICS
+    fresh = term_metrics_begin(term);
+#endif
+    reserve_children(term, term->n_children + side->n_children);
     for (i = 0; i < side->n_children; i++)
+    {
         term->children[i + term->n_children] = cpeg_term_use(side->children[i]);
+        if (term->flags & CPEG_TERM_SHARED)
+            cpeg_term_share(side->children[i]);
+#ifdef LIBCPEG_TERM_METRICS
+        if (fresh)
+        {
+            term_metrics_add(term, &term->metrics, side->children[i],
+                             i + term->n_children == 0);
+        }
+#endif
+    }
     term->n_children += side->n_children;
+#ifdef LIBCPEG_TERM_METRICS
+    if (fresh)
+        term_metrics_stamp(term);
+    else
+        term_metrics_compute(term);
+#endif
+    term_memo_invalidate(term);
 
     return term;
 }
@@ -561,14 +3075,43 @@ cpeg_term *
 cpeg_term_prune(cpeg_term *term, unsigned pos)
 {
     cpeg_term *pruned;
+#ifdef LIBCPEG_TERM_METRICS
+    bool fresh;
+#endif
 
+    assert(term->refcnt != UINT_MAX);
     if (pos >= term->n_children)
         return NULL;
 
+#ifdef LIBCPEG_TERM_METRICS
+    fresh = term_metrics_begin(term);
+#endif
     pruned = term->children[pos];
     memmove(&term->children[pos], &term->children[pos + 1],
             sizeof(*term->children) * (term->n_children - pos - 1));
     term->n_children--;
+#ifdef LIBCPEG_TERM_METRICS
+    if (fresh)
+        term_metrics_remove(term, pos, pruned);
+    else
+        term_metrics_compute(term);
+    if (pruned != NULL && pruned->refcnt != UINT_MAX &&
+        !(pruned->flags & CPEG_TERM_SHARED) &&
+        pruned->metrics.parent == term)
+    {
+        unsigned i;
+
+        /* Unless it occurs again, no other metrics cover it */
+        for (i = 0; pruned->refcnt > 1 && i < term->n_children; i++)
+        {
+            if (term->children[i] == pruned)
+                break;
+        }
+        if (pruned->refcnt == 1 || i == term->n_children)
+            pruned->metrics.parent = NULL;
+    }
+#endif
+    term_memo_invalidate(term);
 
     return pruned;
 }
@@ -598,42 +3141,153 @@ CQC_TESTCASE(test_prune,
 #endif
 
 int
-cpeg_term_traverse_preorder(cpeg_term_traverse_fn fn,
-                            const cpeg_term *term,
-                            void *data)
+cpeg_term_traverse_preorder(cpeg_term_traverse_fn fn,
+                            const cpeg_term *term,
+                            void *data)
+{
+    term_stack stack;
+    int rc;
+
+    rc = fn(term, data);
+    if (rc != 0)
+        return rc;
+
+    term_stack_init(&stack);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *child;
+
+        if (top->pos == top->term->n_children)
+        {
+            stack.depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        rc = fn(child, data);
+        if (rc != 0)
+            break;
+        if (child->n_children > 0)
+            term_stack_push(&stack, child, NULL);
+    }
+    term_stack_fini(&stack);
+
+    return rc;
+}
+
+int
+cpeg_term_traverse_postorder(cpeg_term_traverse_fn fn,
+                             const cpeg_term *term,
+                             void *data)
 {
-    unsigned i;
+    term_stack stack;
+    int rc = 0;
+
+    term_stack_init(&stack);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+
+        if (top->pos < top->term->n_children)
+        {
+            term_stack_push(&stack, top->term->children[top->pos++], NULL);
+            continue;
+        }
+        rc = fn(top->term, data);
+        if (rc != 0)
+            break;
+        stack.depth--;
+    }
+    term_stack_fini(&stack);
+
+    return rc;
+}
+
+int
+cpeg_term_traverse_preorder_dag(cpeg_term_traverse_fn fn,
+                                const cpeg_term *term,
+                                void *data)
+{
+    term_stack stack;
+    cpeg_ptrmap seen;
     int rc;
 
     rc = fn(term, data);
     if (rc != 0)
         return rc;
 
-    for (i = 0; i < term->n_children; i++)
+    term_stack_init(&stack);
+    cpeg_ptrmap_init(&seen);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
     {
-        rc = cpeg_term_traverse_preorder(fn, term->children[i], data);
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *child;
+
+        if (top->pos == top->term->n_children)
+        {
+            stack.depth--;
+            continue;
+        }
+        child = top->term->children[top->pos++];
+        if (term_multiref(child))
+        {
+            if (cpeg_ptrmap_lookup(&seen, child) != NULL)
+                continue;
+            *cpeg_ptrmap_insert(&seen, child) = (void *)child;
+        }
+        rc = fn(child, data);
         if (rc != 0)
-            return rc;
+            break;
+        if (child->n_children > 0)
+            term_stack_push(&stack, child, NULL);
     }
-    return 0;
+    cpeg_ptrmap_fini(&seen);
+    term_stack_fini(&stack);
+
+    return rc;
 }
 
 int
-cpeg_term_traverse_postorder(cpeg_term_traverse_fn fn,
-                             const cpeg_term *term,
-                             void *data)
+cpeg_term_traverse_postorder_dag(cpeg_term_traverse_fn fn,
+                                 const cpeg_term *term,
+                                 void *data)
 {
-    unsigned i;
-    int rc;
-
-    for (i = 0; i < term->n_children; i++)
+    term_stack stack;
+    cpeg_ptrmap seen;
+    int rc = 0;
+
+    term_stack_init(&stack);
+    cpeg_ptrmap_init(&seen);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
     {
-        rc = cpeg_term_traverse_postorder(fn, term->children[i], data);
+        term_frame *top = term_stack_top(&stack);
+
+        if (top->pos < top->term->n_children)
+        {
+            const cpeg_term *child = top->term->children[top->pos++];
+
+            if (term_multiref(child))
+            {
+                if (cpeg_ptrmap_lookup(&seen, child) != NULL)
+                    continue;
+                *cpeg_ptrmap_insert(&seen, child) = (void *)child;
+            }
+            term_stack_push(&stack, child, NULL);
+            continue;
+        }
+        rc = fn(top->term, data);
         if (rc != 0)
-            return rc;
+            break;
+        stack.depth--;
     }
+    cpeg_ptrmap_fini(&seen);
+    term_stack_fini(&stack);
 
-    return fn(term, data);
+    return rc;
 }
 
 #ifdef LIBCPEG_TESTING
@@ -756,25 +3410,73 @@ CQC_TESTCASE(traverse_nonzero_postorder,
 
 #endif
 
+/* Cached metrics can only prove that two shapes are different */
+static inline bool
+shapes_differ(const cpeg_term *term1, const cpeg_term *term2)
+{
+#ifdef LIBCPEG_TERM_METRICS
+    return term_has_metrics(term1) && term_has_metrics(term2) &&
+        (term1->metrics.size != term2->metrics.size ||
+         (!term1->metrics.stale_shape && !term2->metrics.stale_shape &&
+          term1->metrics.shape_hash != term2->metrics.shape_hash));
+#else
+    (void)term1;
+    (void)term2;
+    return false;
+#endif
+}
+
 bool
 cpeg_term_isomorphic(const cpeg_term *term1, const cpeg_term *term2)
 {
-    unsigned i;
+    term_stack stack;
+    bool result = true;
 
     if (term1 == NULL)
         return term2 == NULL;
     if (term2 == NULL)
         return false;
 
-    if (term1->n_children != term2->n_children)
+    /* Always the case for interned terms */
+    if (term1 == term2)
+        return true;
+
+    if (term1->n_children != term2->n_children ||
+        shapes_differ(term1, term2))
         return false;
 
-    for (i = 0; i < term1->n_children; i++)
+    term_stack_init(&stack);
+    term_stack_push(&stack, term1, term2);
+    while (stack.depth > 0)
     {
-        if (!cpeg_term_isomorphic(term1->children[i], term2->children[i]))
-            return false;
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *child1;
+        const cpeg_term *child2;
+
+        if (top->pos == top->term->n_children)
+        {
+            stack.depth--;
+            continue;
+        }
+        child1 = top->term->children[top->pos];
+        child2 = top->other->children[top->pos];
+        top->pos++;
+
+        if (child1 == child2)
+            continue;
+        if (child1 == NULL || child2 == NULL ||
+            child1->n_children != child2->n_children ||
+            shapes_differ(child1, child2))
+        {
+            result = false;
+            break;
+        }
+        if (child1->n_children > 0)
+            term_stack_push(&stack, child1, child2);
     }
-    return true;
+    term_stack_fini(&stack);
+
+    return result;
 }
 
 int
@@ -782,53 +3484,609 @@ cpeg_term_zip(cpeg_term_zip_fn fn,
               const cpeg_term *term1, const cpeg_term *term2,
               void *data)
 {
+    term_stack stack;
     int rc = fn(term1, term2, data);
-    unsigned i;
 
     if (rc != 0)
         return rc;
+
     assert(term1->n_children == term2->n_children);
-    for (i = 0; i < term1->n_children; i++)
+    term_stack_init(&stack);
+    term_stack_push(&stack, term1, term2);
+    while (stack.depth > 0)
     {
-        rc = cpeg_term_zip(fn, term1->children[i],
-                           term2->children[i], data);
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *child1;
+        const cpeg_term *child2;
+
+        if (top->pos == top->term->n_children)
+        {
+            stack.depth--;
+            continue;
+        }
+        child1 = top->term->children[top->pos];
+        child2 = top->other->children[top->pos];
+        top->pos++;
+
+        rc = fn(child1, child2, data);
         if (rc != 0)
-            return rc;
+            break;
+        assert(child1->n_children == child2->n_children);
+        if (child1->n_children > 0)
+            term_stack_push(&stack, child1, child2);
     }
-    return 0;
+    term_stack_fini(&stack);
+
+    return rc;
 }
 
-cpeg_term *
-cpeg_term_map(cpeg_term_map_fn map, const cpeg_term *term, void *data)
+/*
+ * The partners a term has been visited with: the first one is kept in
+ * the map itself, and the others in a map of their own, whose address
+ * is tagged with the lowest bit.
+ */
+static bool
+zip_pair_seen(cpeg_ptrmap *seen, const cpeg_term *term1,
+              const cpeg_term *term2)
 {
-    cpeg_term *children[term->n_children + 1];
-    cpeg_term *mapped;
-    unsigned i;
+    void **known = cpeg_ptrmap_insert(seen, term1);
+    cpeg_ptrmap *partners;
 
-    for (i = 0; i < term->n_children; i++)
-        children[i] = cpeg_term_map(map, term->children[i], data);
+    if (*known == NULL)
+    {
+        *known = (void *)term2;
+        return false;
+    }
+    if (!((uintptr_t)*known & 1u))
+    {
+        if (*known == term2)
+            return true;
+        partners = cpeg_mem_alloc(sizeof(*partners));
+        cpeg_ptrmap_init(partners);
+        *cpeg_ptrmap_insert(partners, *known) = *known;
+        *known = (void *)((uintptr_t)partners | 1u);
+    }
+    else
+    {
+        partners = (cpeg_ptrmap *)((uintptr_t)*known & ~(uintptr_t)1u);
+    }
+
+    known = cpeg_ptrmap_insert(partners, term2);
+    if (*known != NULL)
+        return true;
+    *known = (void *)term2;
+    return false;
+}
+
+static void
+zip_pairs_fini(cpeg_ptrmap *seen)
+{
+    size_t i;
+
+    for (i = 0; seen->entries != NULL && i <= seen->mask; i++)
+    {
+        uintptr_t known = (uintptr_t)seen->entries[i].value;
+
+        if (seen->entries[i].key != NULL && (known & 1u))
+        {
+            cpeg_ptrmap *partners = (cpeg_ptrmap *)(known & ~(uintptr_t)1u);
+
+            cpeg_ptrmap_fini(partners);
+            cpeg_mem_free(partners);
+        }
+    }
+    cpeg_ptrmap_fini(seen);
+}
+
+/* A pair is skipped if it has already been visited */
+int
+cpeg_term_zip_dag(cpeg_term_zip_fn fn,
+                  const cpeg_term *term1, const cpeg_term *term2,
+                  void *data)
+{
+    term_stack stack;
+    cpeg_ptrmap seen;
+    int rc = fn(term1, term2, data);
+
+    if (rc != 0)
+        return rc;
+
+    assert(term1->n_children == term2->n_children);
+    term_stack_init(&stack);
+    cpeg_ptrmap_init(&seen);
+    term_stack_push(&stack, term1, term2);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *child1;
+        const cpeg_term *child2;
+
+        if (top->pos == top->term->n_children)
+        {
+            stack.depth--;
+            continue;
+        }
+        child1 = top->term->children[top->pos];
+        child2 = top->other->children[top->pos];
+        top->pos++;
+
+        if (term_multiref(child1) && zip_pair_seen(&seen, child1, child2))
+            continue;
+        rc = fn(child1, child2, data);
+        if (rc != 0)
+            break;
+        assert(child1->n_children == child2->n_children);
+        if (child1->n_children > 0)
+            term_stack_push(&stack, child1, child2);
+    }
+    zip_pairs_fini(&seen);
+    term_stack_fini(&stack);
+
+    return rc;
+}
+
+void *
+cpeg_term_map_node(const cpeg_term *term, void *children[], void *data)
+{
+    cpeg_term_map_closure *closure = data;
+    cpeg_term *mapped = closure->map(term, closure->data);
 
-    mapped = map(term, data);
     if (mapped == NULL)
     {
         return cpeg_term_new(term->type, term->value,
-                             term->n_children, children);
+                             term->n_children, (cpeg_term **)children);
+    }
+    assert(mapped->n_children == 0);
+    alloc_children(mapped, term->n_children, (cpeg_term **)children, false);
+
+    return mapped;
+}
+
+cpeg_term *
+cpeg_term_map(cpeg_term_map_fn map, const cpeg_term *term, void *data)
+{
+    cpeg_term_map_closure closure = {.map = map, .data = data};
+
+    return term_fold(cpeg_term_map_node, term, &closure);
+}
+
+static void *
+rewrite_node(const cpeg_term *term, void *children[], void *data)
+{
+    cpeg_term_map_closure *closure = data;
+    cpeg_term *mapped = closure->map(term, closure->data);
+    unsigned i;
+
+    /* The term itself comes without a reference of its own */
+    if (mapped == NULL || mapped == term)
+    {
+        for (i = 0; i < term->n_children; i++)
+        {
+            if (children[i] != term->children[i])
+            {
+                return cpeg_term_new(term->type, term->value,
+                                     term->n_children,
+                                     (cpeg_term **)children);
+            }
+        }
+        /* The results for unchanged children are extra references */
+        for (i = 0; i < term->n_children; i++)
+            cpeg_term_free(children[i]);
+        return cpeg_term_use((cpeg_term *)term);
     }
     assert(mapped->n_children == 0);
-    alloc_children(mapped, term->n_children, children, false);
+    alloc_children(mapped, term->n_children, (cpeg_term **)children, false);
 
     return mapped;
 }
 
+cpeg_term *
+cpeg_term_rewrite(cpeg_term_map_fn map, const cpeg_term *term, void *data)
+{
+    cpeg_term_map_closure closure = {.map = map, .data = data};
+
+    return term_fold(rewrite_node, term, &closure);
+}
+
+cpeg_term *
+cpeg_term_map_dag(cpeg_term_map_fn map, const cpeg_term *term, void *data)
+{
+    cpeg_term_map_closure closure = {.map = map, .data = data};
+
+    return term_fold_dag(cpeg_term_map_node, term, &closure, true);
+}
+
 void *
 cpeg_term_reduce(cpeg_term_reduce_fn reduce, const cpeg_term *term,
                  void *data)
 {
-    void *results[term->n_children + 1];
+    return term_fold(reduce, term, data);
+}
+
+void *
+cpeg_term_reduce_dag(cpeg_term_reduce_fn reduce, const cpeg_term *term,
+                     void *data)
+{
+    return term_fold_dag(reduce, term, data, false);
+}
+
+/*
+ * Memoized results of a term are kept in a record attached to it
+ * under `memo_attr`, one entry per memo, along with the parents the
+ * term has been reached from. Terms that have a record are flagged,
+ * unless they are shared, so that the attribute is only looked up
+ * for them; the flag may outlive the record.
+ */
+static const char memo_attr[] = "memo";
+
+struct cpeg_term_memo {
+    cpeg_term_reduce_fn reduce;
+    void *data;
+    void (*release)(void *);
+    unsigned refcnt;
+    bool dead;
+    /* Results of the last call that could not be memoized */
+    void **loose;
+    size_t n_loose;
+    size_t capacity;
+};
+
+/*
+ * Immortal terms cannot carry records, so no parents are recorded
+ * through them: a result is only stored if no term below an immortal
+ * term can be edited, that is, if it is mortal (and so tracked) or
+ * immortal all the way down (and so frozen).
+ */
+typedef enum memo_state {
+    MEMO_TRACKED,
+    MEMO_FROZEN,
+    MEMO_LOOSE
+} memo_state;
+
+typedef struct memo_entry {
+    cpeg_term_memo *memo;
+    void *result;
+    struct memo_entry *next;
+} memo_entry;
+
+typedef struct memo_record {
+    memo_entry *entries;
+    const cpeg_term **parents;
+    unsigned n_parents;
+    unsigned capacity;
+} memo_record;
+
+static void
+memo_unref(cpeg_term_memo *memo)
+{
+    if (__atomic_sub_fetch(&memo->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        cpeg_mem_free(memo);
+}
+
+static void
+memo_entry_release(memo_entry *entry)
+{
+    if (entry->memo->release != NULL)
+        entry->memo->release(entry->result);
+    memo_unref(entry->memo);
+    cpeg_mem_free(entry);
+}
+
+static void
+memo_record_destroy(void *value)
+{
+    memo_record *record = value;
+
+    while (record->entries != NULL)
+    {
+        memo_entry *entry = record->entries;
+
+        record->entries = entry->next;
+        memo_entry_release(entry);
+    }
+    cpeg_mem_free(record->parents);
+    cpeg_mem_free(record);
+}
+
+static const cpeg_term_type memo_record_type = {
+    .id = "memo",
+    .destroy = memo_record_destroy
+};
+
+static inline bool
+memo_may_have_record(const cpeg_term *term)
+{
+    return (term->flags & (CPEG_TERM_MEMOIZED | CPEG_TERM_SHARED)) != 0;
+}
+
+static memo_record *
+memo_find_record(const cpeg_term *term)
+{
+    cpeg_term *holder;
+
+    if (!memo_may_have_record(term))
+        return NULL;
+    holder = cpeg_mem_attr_get(term, memo_attr);
+    return holder == NULL ? NULL : holder->value;
+}
+
+static void
+memo_add_parent(memo_record *record, const cpeg_term *parent)
+{
+    unsigned i;
+
+    for (i = 0; i < record->n_parents; i++)
+    {
+        if (record->parents[i] == parent)
+            return;
+    }
+    if (record->n_parents == record->capacity)
+    {
+        unsigned kept = 0;
+
+        /* Forget the parents that have been freed or edited since */
+        for (i = 0; i < record->n_parents; i++)
+        {
+            if (cpeg_mem_attr_get(record->parents[i], memo_attr) != NULL)
+                record->parents[kept++] = record->parents[i];
+        }
+        record->n_parents = kept;
+    }
+    if (record->n_parents == record->capacity)
+    {
+        record->capacity = record->capacity == 0 ? 2 : record->capacity * 2;
+        record->parents = cpeg_mem_realloc(record->parents,
+                                           record->capacity *
+                                           sizeof(*record->parents));
+    }
+    record->parents[record->n_parents++] = parent;
+}
+
+static bool
+memo_lookup(cpeg_term_memo *memo, const cpeg_term *term, void **result)
+{
+    memo_record *record = memo_find_record(term);
+    memo_entry *entry;
+
+    if (record == NULL)
+        return false;
+    for (entry = record->entries; entry != NULL; entry = entry->next)
+    {
+        if (entry->memo == memo)
+        {
+            *result = entry->result;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Children learn about the parent once it has a record of its own */
+static void
+memo_store(cpeg_term_memo *memo, const cpeg_term *term, void *result)
+{
+    memo_record *record;
+    memo_entry **link;
+    memo_entry *entry;
     unsigned i;
 
+    /* Attributes of immortal terms may outlive them */
+    assert(term->refcnt != UINT_MAX);
+
+    record = memo_find_record(term);
+    if (record == NULL)
+    {
+        record = cpeg_mem_alloc(sizeof(*record));
+        record->entries = NULL;
+        record->parents = NULL;
+        record->n_parents = 0;
+        record->capacity = 0;
+        cpeg_mem_attr_set(term, memo_attr,
+                          cpeg_term_new(&memo_record_type, record, 0, NULL));
+        if (!(term->flags & CPEG_TERM_SHARED))
+            ((cpeg_term *)term)->flags |= CPEG_TERM_MEMOIZED;
+    }
+
+    /* Entries of destroyed memos are dropped on the way */
+    for (link = &record->entries; *link != NULL; )
+    {
+        entry = *link;
+        if (__atomic_load_n(&entry->memo->dead, __ATOMIC_RELAXED))
+        {
+            *link = entry->next;
+            memo_entry_release(entry);
+        }
+        else
+        {
+            link = &entry->next;
+        }
+    }
+
+    entry = cpeg_mem_alloc(sizeof(*entry));
+    entry->memo = memo;
+    entry->result = result;
+    entry->next = record->entries;
+    record->entries = entry;
+    __atomic_add_fetch(&memo->refcnt, 1, __ATOMIC_RELAXED);
+
     for (i = 0; i < term->n_children; i++)
-        results[i] = cpeg_term_reduce(reduce, term->children[i], data);
+    {
+        memo_record *child = memo_find_record(term->children[i]);
+
+        if (child != NULL)
+            memo_add_parent(child, term);
+    }
+}
+
+/*
+ * Drops the records of the term and of all its known ancestors.
+ * Parents are only used as keys, as some of them may be gone.
+ */
+static void
+term_memo_invalidate(cpeg_term *term)
+{
+    const cpeg_term *initial[TERM_STACK_INITIAL];
+    const cpeg_term **pending = initial;
+    size_t n_pending = 0;
+    size_t capacity = TERM_STACK_INITIAL;
+
+    if (!memo_may_have_record(term))
+        return;
+
+    term->flags &= ~CPEG_TERM_MEMOIZED;
+    pending[n_pending++] = term;
+    while (n_pending > 0)
+    {
+        const cpeg_term *current = pending[--n_pending];
+        cpeg_term *holder = cpeg_mem_attr_get(current, memo_attr);
+        memo_record *record;
+        unsigned i;
+
+        if (holder == NULL)
+            continue;
+        record = holder->value;
+        if (n_pending + record->n_parents > capacity)
+        {
+            while (n_pending + record->n_parents > capacity)
+                capacity *= 2;
+            if (pending == initial)
+            {
+                pending = cpeg_mem_alloc(capacity * sizeof(*pending));
+                memcpy(pending, initial, n_pending * sizeof(*pending));
+            }
+            else
+            {
+                pending = cpeg_mem_realloc(pending,
+                                           capacity * sizeof(*pending));
+            }
+        }
+        for (i = 0; i < record->n_parents; i++)
+            pending[n_pending++] = record->parents[i];
+        cpeg_mem_attr_set(current, memo_attr, NULL);
+    }
+    if (pending != initial)
+        cpeg_mem_free(pending);
+}
+
+cpeg_term_memo *
+cpeg_term_memo_create(cpeg_term_reduce_fn reduce, void *data,
+                      void (*release)(void *))
+{
+    cpeg_term_memo *memo = cpeg_mem_alloc(sizeof(*memo));
+
+    memo->reduce = reduce;
+    memo->data = data;
+    memo->release = release;
+    memo->refcnt = 1;
+    memo->dead = false;
+    memo->loose = NULL;
+    memo->n_loose = 0;
+    memo->capacity = 0;
+    return memo;
+}
+
+static void
+memo_keep_loose(cpeg_term_memo *memo, void *result)
+{
+    if (memo->n_loose == memo->capacity)
+    {
+        memo->capacity = memo->capacity == 0 ? 16 : memo->capacity * 2;
+        memo->loose = cpeg_mem_realloc(memo->loose,
+                                       memo->capacity * sizeof(*memo->loose));
+    }
+    memo->loose[memo->n_loose++] = result;
+}
+
+static void
+memo_release_loose(cpeg_term_memo *memo)
+{
+    if (memo->release != NULL)
+    {
+        while (memo->n_loose > 0)
+            memo->release(memo->loose[--memo->n_loose]);
+    }
+    memo->n_loose = 0;
+}
+
+void
+cpeg_term_memo_destroy(cpeg_term_memo *memo)
+{
+    memo_release_loose(memo);
+    cpeg_mem_free(memo->loose);
+    memo->loose = NULL;
+    memo->capacity = 0;
+    __atomic_store_n(&memo->dead, true, __ATOMIC_RELAXED);
+    memo_unref(memo);
+}
+
+void *
+cpeg_term_memo_reduce(cpeg_term_memo *memo, const cpeg_term *term)
+{
+    term_stack stack;
+    term_results results;
+    term_results states;
+    void *result;
+
+    memo_release_loose(memo);
+    if (memo_lookup(memo, term, &result))
+        return result;
+
+    term_stack_init(&stack);
+    term_results_init(&results);
+    term_results_init(&states);
+    term_stack_push(&stack, term, NULL);
+    while (stack.depth > 0)
+    {
+        term_frame *top = term_stack_top(&stack);
+        const cpeg_term *current = top->term;
+        memo_state state;
+        unsigned i;
+
+        if (top->pos < current->n_children)
+        {
+            const cpeg_term *child = current->children[top->pos++];
+
+            if (memo_lookup(memo, child, &result))
+            {
+                term_results_push(&results, result);
+                term_results_push(&states, (void *)(uintptr_t)MEMO_TRACKED);
+            }
+            else
+            {
+                term_stack_push(&stack, child, NULL);
+            }
+            continue;
+        }
+
+        results.n_items -= current->n_children;
+        states.n_items -= current->n_children;
+        state = current->refcnt == UINT_MAX ? MEMO_FROZEN : MEMO_TRACKED;
+        for (i = 0; i < current->n_children; i++)
+        {
+            memo_state sub = (memo_state)(uintptr_t)
+                states.items[states.n_items + i];
+
+            if (sub == MEMO_LOOSE ||
+                (sub == MEMO_TRACKED && state == MEMO_FROZEN))
+            {
+                state = MEMO_LOOSE;
+                break;
+            }
+        }
+        result = memo->reduce(current, &results.items[results.n_items],
+                              memo->data);
+        if (state == MEMO_TRACKED)
+            memo_store(memo, current, result);
+        else
+            memo_keep_loose(memo, result);
+        term_results_push(&results, result);
+        term_results_push(&states, (void *)(uintptr_t)state);
+        stack.depth--;
+    }
+    result = results.items[0];
 
-    return reduce(term, results, data);
+    term_results_fini(&states);
+    term_results_fini(&results);
+    term_stack_fini(&stack);
+    return result;
 }
@@ -0,0 +1,273 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "libcpeg_memattr.h"
+#include "libcpeg_terms.h"
+#include "libcpeg_stats.h"
+#include "libcpeg_zipper.h"
+#ifdef LIBCPEG_TESTING
+#include "cqc.h"
+#endif
+
+void
+cpeg_term_zipper_init(cpeg_term_zipper *zipper, cpeg_term *root)
+{
+    zipper->focus = cpeg_term_use(root);
+    zipper->path = NULL;
+    zipper->depth = 0;
+    zipper->capacity = 0;
+}
+
+void
+cpeg_term_zipper_fini(cpeg_term_zipper *zipper)
+{
+    while (zipper->depth > 0)
+        cpeg_term_free(zipper->path[--zipper->depth].parent);
+    cpeg_term_free(zipper->focus);
+    cpeg_mem_free(zipper->path);
+    zipper->focus = NULL;
+    zipper->path = NULL;
+    zipper->capacity = 0;
+}
+
+bool
+cpeg_term_zipper_down(cpeg_term_zipper *zipper, unsigned pos)
+{
+    cpeg_term *focus = zipper->focus;
+
+    if (focus == NULL || pos >= focus->n_children)
+        return false;
+
+    if (zipper->depth == zipper->capacity)
+    {
+        zipper->capacity = zipper->capacity == 0 ? 16 : zipper->capacity * 2;
+        zipper->path = cpeg_mem_realloc(zipper->path,
+                                        zipper->capacity *
+                                        sizeof(*zipper->path));
+    }
+    zipper->path[zipper->depth].parent = focus;
+    zipper->path[zipper->depth].pos = pos;
+    zipper->depth++;
+    zipper->focus = cpeg_term_use(focus->children[pos]);
+    return true;
+}
+
+bool
+cpeg_term_zipper_up(cpeg_term_zipper *zipper)
+{
+    cpeg_term_zipper_frame *frame;
+    cpeg_term *parent;
+
+    if (zipper->depth == 0)
+        return false;
+
+    frame = &zipper->path[--zipper->depth];
+    parent = frame->parent;
+    if (parent->children[frame->pos] == zipper->focus)
+        cpeg_term_free(zipper->focus);
+    else
+    {
+        /*
+         * Once a node on the path has been copied, the zipper holds
+         * the only reference to it, so later edits below it
+         * do not copy it again.
+         */
+        cpeg_term *copy = cpeg_term_cow(parent);
+
+        if (copy != parent)
+            cpeg_term_free(parent);
+        cpeg_term_free(cpeg_term_prune(copy, frame->pos));
+        cpeg_term_graft(copy, frame->pos, zipper->focus);
+        parent = copy;
+    }
+    zipper->focus = parent;
+    return true;
+}
+
+bool
+cpeg_term_zipper_left(cpeg_term_zipper *zipper)
+{
+    unsigned pos;
+
+    if (zipper->depth == 0 || zipper->path[zipper->depth - 1].pos == 0)
+        return false;
+
+    pos = zipper->path[zipper->depth - 1].pos;
+    cpeg_term_zipper_up(zipper);
+    return cpeg_term_zipper_down(zipper, pos - 1);
+}
+
+bool
+cpeg_term_zipper_right(cpeg_term_zipper *zipper)
+{
+    const cpeg_term_zipper_frame *frame;
+    unsigned pos;
+
+    if (zipper->depth == 0)
+        return false;
+
+    frame = &zipper->path[zipper->depth - 1];
+    if (frame->pos + 1 >= frame->parent->n_children)
+        return false;
+
+    pos = frame->pos;
+    cpeg_term_zipper_up(zipper);
+    return cpeg_term_zipper_down(zipper, pos + 1);
+}
+
+void
+cpeg_term_zipper_replace(cpeg_term_zipper *zipper, cpeg_term *term)
+{
+    cpeg_term_free(zipper->focus);
+    zipper->focus = term;
+}
+
+cpeg_term *
+cpeg_term_zipper_root(cpeg_term_zipper *zipper)
+{
+    while (cpeg_term_zipper_up(zipper))
+        ;
+    return cpeg_term_use(zipper->focus);
+}
+
+#ifdef LIBCPEG_TESTING
+static const cpeg_term_type test_zipper_type = {
+    .id = "zipper"
+};
+
+static cpeg_term *
+test_zipper_tree(unsigned depth, unsigned arity)
+{
+    cpeg_term *node = cpeg_term_new(&test_zipper_type, NULL, 0, NULL);
+    unsigned i;
+
+    if (depth > 0)
+    {
+        for (i = 0; i < arity; i++)
+        {
+            cpeg_term_graft(node, UINT_MAX,
+                            test_zipper_tree(depth - 1, arity));
+        }
+    }
+    return node;
+}
+
+CQC_TESTCASE(test_zipper_path_copy,
+             "Replacing the focus copies only the nodes on the path")
+{
+    cqc_forall_range(unsigned, depth, 1, 6)
+    {
+        cqc_expect
+        {
+            cpeg_term *orig = test_zipper_tree(depth, 3);
+            cpeg_term *snapshot = cpeg_term_deep_copy(orig);
+            unsigned path[6];
+            cpeg_term_zipper zipper;
+            cpeg_term *edited;
+            const cpeg_term *old_node;
+            const cpeg_term *new_node;
+            unsigned i;
+            unsigned j;
+
+            cpeg_term_zipper_init(&zipper, orig);
+            for (i = 0; i < depth; i++)
+            {
+                path[i] = (unsigned)random() % 3;
+                cqc_assert(cpeg_term_zipper_down(&zipper, path[i]));
+            }
+            cqc_assert(!cpeg_term_zipper_down(&zipper, 0));
+            cpeg_term_zipper_replace(&zipper,
+                                     cpeg_term_new(&test_zipper_type,
+                                                   (void *)(uintptr_t)1,
+                                                   0, NULL));
+            edited = cpeg_term_zipper_root(&zipper);
+            cpeg_term_zipper_fini(&zipper);
+
+            cqc_assert(cpeg_term_isomorphic(orig, snapshot));
+            old_node = orig;
+            new_node = edited;
+            for (i = 0; i < depth; i++)
+            {
+                cqc_assert_neq(cqc_opaque, old_node, new_node);
+                for (j = 0; j < 3; j++)
+                {
+                    if (j != path[i])
+                    {
+                        cqc_assert_eq(cqc_opaque, old_node->children[j],
+                                      new_node->children[j]);
+                    }
+                }
+                old_node = old_node->children[path[i]];
+                new_node = new_node->children[path[i]];
+            }
+            cqc_assert_eq(uintptr_t, (uintptr_t)new_node->value, 1);
+            cqc_assert_eq(uintptr_t, (uintptr_t)old_node->value, 0);
+
+            cpeg_term_free(orig);
+            cpeg_term_free(snapshot);
+            cpeg_term_free(edited);
+        }
+    }
+}
+
+CQC_TESTCASE(test_zipper_siblings,
+             "Edits along the same spine copy each node once")
+{
+    cqc_forall_range(unsigned, arity, 1, 8)
+    {
+        cqc_expect
+        {
+            cpeg_term *orig = test_zipper_tree(2, arity);
+            cpeg_term_zipper zipper;
+            cpeg_term_stats before;
+            cpeg_term_stats after;
+            cpeg_term *edited;
+            uintptr_t value = 1;
+            unsigned i;
+            unsigned j;
+
+            cpeg_term_stats_snapshot(&before);
+            cpeg_term_zipper_init(&zipper, orig);
+            cqc_assert(!cpeg_term_zipper_up(&zipper));
+            cqc_assert(!cpeg_term_zipper_right(&zipper));
+            cqc_assert(cpeg_term_zipper_down(&zipper, 0));
+            do {
+                cqc_assert(cpeg_term_zipper_down(&zipper, 0));
+                cqc_assert(!cpeg_term_zipper_left(&zipper));
+                do {
+                    cpeg_term_zipper_replace(&zipper,
+                                             cpeg_term_new(&test_zipper_type,
+                                                           (void *)value++,
+                                                           0, NULL));
+                } while (cpeg_term_zipper_right(&zipper));
+                cqc_assert(cpeg_term_zipper_up(&zipper));
+            } while (cpeg_term_zipper_right(&zipper));
+            edited = cpeg_term_zipper_root(&zipper);
+            cpeg_term_zipper_fini(&zipper);
+            cpeg_term_stats_snapshot(&after);
+
+            /* New leaves, plus one copy of the root and of each inner node */
+            cqc_assert_eq(size_t, after.live - before.live,
+                          (size_t)arity * arity + arity + 1);
+            value = 1;
+            for (i = 0; i < arity; i++)
+            {
+                for (j = 0; j < arity; j++)
+                {
+                    cqc_assert_eq(uintptr_t,
+                                  (uintptr_t)edited->children[i]->
+                                  children[j]->value,
+                                  value++);
+                    cqc_assert_eq(uintptr_t,
+                                  (uintptr_t)orig->children[i]->
+                                  children[j]->value,
+                                  0);
+                }
+            }
+            cpeg_term_free(orig);
+            cpeg_term_free(edited);
+        }
+    }
+}
+#endif